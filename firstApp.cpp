@@ -1,9 +1,75 @@
 #include "firstApp.hpp"
 
+#include "nestempoaory/emulator_thread.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+
+vve::FirstApp::FirstApp(std::string romPath, std::uint64_t frameLimit, int runAhead)
+    : _romPath(std::move(romPath)), _frameLimit(frameLimit), _runAhead(runAhead)
+{
+}
+
+// Buttons of controller 0 from the keyboard: arrows, X and Z for A and B, Enter for Start and right
+// Shift for Select
+std::uint8_t vve::FirstApp::_heldButtons() const
+{
+    static constexpr std::pair<int, std::uint8_t> keys[] = {
+        {GLFW_KEY_X, Controller::A},
+        {GLFW_KEY_Z, Controller::B},
+        {GLFW_KEY_RIGHT_SHIFT, Controller::Select},
+        {GLFW_KEY_ENTER, Controller::Start},
+        {GLFW_KEY_UP, Controller::Up},
+        {GLFW_KEY_DOWN, Controller::Down},
+        {GLFW_KEY_LEFT, Controller::Left},
+        {GLFW_KEY_RIGHT, Controller::Right},
+    };
+    std::uint8_t buttons = 0;
+    for (const auto &[key, button] : keys)
+    {
+        if (_window.keyDown(key))
+            buttons |= button;
+    }
+    return buttons;
+}
+
+// The emulator runs on a thread of its own at the NTSC frame rate, or flat out while Tab is held. This
+// thread handles the window, sends the keyboard on as controller input and takes the newest frame;
+// nothing draws it yet, so the window stays blank.
 void vve::FirstApp::run()
 {
-    while (!_window.shouldClose())
+    NESemulator emulator(_romPath);
+    if (!emulator.init())
+        throw std::runtime_error("Failed to start " + _romPath);
+
+    FrameMailbox frames;
+    InputQueue input;
+    EmulatorThread emulation(emulator, frames, input, FRAME_RATE, _frameLimit);
+    emulation.setRunAhead(_runAhead);
+    emulation.start();
+
+    std::uint8_t buttons = 0;
+    std::uint64_t taken = 0;
+    for (;;)
     {
-        glfwPollEvents();
+        const bool last = _frameLimit && emulation.finished();
+        // Woken by input too, so key presses reach the emulator without waiting for a frame
+        _window.waitEvents(0.001);
+        const std::uint8_t held = _heldButtons();
+        if (held != buttons && input.push({0, held, std::chrono::steady_clock::now()}))
+            buttons = held;
+        emulation.setFastForward(_window.keyDown(GLFW_KEY_TAB));
+
+        // Nothing is presented yet, so there is no input-to-photon latency to measure
+        if (frames.take())
+            taken++;
+        if (last || _window.shouldClose())
+            break;
     }
-}
\ No newline at end of file
+    emulation.stop();
+    std::cout << emulation.frameCount() << " frames, " << taken << " taken" << std::endl;
+    if (_runAhead)
+        std::cout << "Run-ahead " << _runAhead << ": " << emulation.runAheadStats().microsecondsPerFrame() << " us per frame" << std::endl;
+}
@@ -1,17 +1,32 @@
+#pragma once
+
 #include "vve_window.hpp"
 
+#include <cstdint>
+#include <string>
+
 namespace vve
 {
     class FirstApp
     {
     private:
+        std::string _romPath;
+        std::uint64_t _frameLimit;
+        int _runAhead;
         VveWindow _window{WIDTH, HEIGHT, WINDOW_NAME};
 
+        std::uint8_t _heldButtons() const;
+
     public:
-        static constexpr int WIDTH = 800;
-        static constexpr int HEIGHT = 600;
+        static constexpr int WIDTH = 768; // three times the NES picture
+        static constexpr int HEIGHT = 720;
         static constexpr const char *WINDOW_NAME = "NES";
+        static constexpr double FRAME_RATE = 1789772.7 / 29780.5; // NTSC: CPU clock over CPU cycles per frame
+
+        // frameLimit stops after that many frames, 0 runs until the window is closed; runAhead shows
+        // every frame that many frames ahead
+        FirstApp(std::string romPath, std::uint64_t frameLimit = 0, int runAhead = 0);
 
         void run();
     };
-}
\ No newline at end of file
+}
@@ -1,15 +1,56 @@
 #include <iostream>
+#include <cstdint>
 #include <cstdlib>
 #include <stdexcept>
+#include <string>
 
 #include "firstApp.hpp"
 
-int main()
+namespace
 {
-    vve::FirstApp app;
+    int usage()
+    {
+        std::cerr << "Usage: NESemulator <rom> [--frames N] [--run-ahead N]\n"
+                     "Runs the ROM in a window until it is closed, or for N frames. --run-ahead shows every\n"
+                     "frame N frames ahead, taking that many frames of the game's own lag away (up to 8)."
+                  << std::endl;
+        return 2;
+    }
+
+    bool parseCount(const char *text, std::uint64_t &value)
+    {
+        char *end = nullptr;
+        value = std::strtoull(text, &end, 10);
+        return *text != '\0' && *end == '\0';
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+        return usage();
+    std::uint64_t frames = 0;
+    std::uint64_t runAhead = 0;
+    for (int i = 2; i < argc; i++)
+    {
+        const std::string option = argv[i];
+        if (option == "--frames" && i + 1 < argc)
+        {
+            if (!parseCount(argv[++i], frames))
+                return usage();
+        }
+        else if (option == "--run-ahead" && i + 1 < argc)
+        {
+            if (!parseCount(argv[++i], runAhead) || runAhead > 8)
+                return usage();
+        }
+        else
+            return usage();
+    }
 
     try
     {
+        vve::FirstApp app(argv[1], frames, static_cast<int>(runAhead));
         app.run();
     }
     catch (const std::exception &e)
@@ -19,4 +60,4 @@ int main()
     }
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
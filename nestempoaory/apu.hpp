@@ -0,0 +1,818 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+
+#include "audio.hpp"
+
+// 2A03 audio processing unit: two pulse channels, triangle, noise, DMC and the frame counter with its
+// IRQ. Like the PPU it only runs when the CPU touches it or an IRQ comes due, and then catches up in
+// spans between frame counter steps. Within a span each channel jumps from one timer reload to the
+// next; with audio output attached every change in a channel's level becomes a step in the
+// band-limited synthesizer, otherwise the timers are advanced in one go.
+class APU
+{
+public:
+    // Cycles between flushes of the synthesizer, well within what it can hold
+    static constexpr std::uint64_t kMaxSpanCycles = 16384;
+
+private:
+    static constexpr std::uint8_t kLengths[32] = {10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+                                                  12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30};
+    static constexpr std::uint8_t kDuties[4][8] = {{0, 1, 0, 0, 0, 0, 0, 0},
+                                                   {0, 1, 1, 0, 0, 0, 0, 0},
+                                                   {0, 1, 1, 1, 1, 0, 0, 0},
+                                                   {1, 0, 0, 1, 1, 1, 1, 1}};
+    static constexpr std::uint16_t kNoisePeriods[16] = {4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068};
+    static constexpr std::uint16_t kDmcPeriods[16] = {428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54};
+
+    // Frame counter steps in CPU cycles from the start of the sequence, for the 4- and 5-step modes;
+    // steps 1 and 3 also clock lengths and sweeps, and the last step of mode 0 raises IRQ
+    static constexpr std::int32_t kFrameSteps[2][4] = {{7457, 14913, 22371, 29829}, {7457, 14913, 22371, 37281}};
+    static constexpr std::int32_t kFramePeriods[2] = {29830, 37282};
+
+    struct Envelope
+    {
+        bool start = false;
+        std::uint8_t divider = 0;
+        std::uint8_t decay = 0;
+
+        void clock(std::uint8_t period, bool loop)
+        {
+            if (start)
+            {
+                start = false;
+                decay = 15;
+                divider = period;
+            }
+            else if (divider == 0)
+            {
+                divider = period;
+                if (decay)
+                    decay--;
+                else if (loop)
+                    decay = 15;
+            }
+            else
+                divider--;
+        }
+    };
+
+    struct Pulse
+    {
+        std::uint8_t duty = 0;
+        bool halt = false; // also loops the envelope
+        bool constant = false;
+        std::uint8_t volume = 0; // constant volume, or the envelope period
+        Envelope envelope;
+        bool sweepEnabled = false;
+        bool sweepNegate = false;
+        bool sweepReload = false;
+        std::uint8_t sweepPeriod = 0;
+        std::uint8_t sweepShift = 0;
+        std::uint8_t sweepDivider = 0;
+        std::uint16_t period = 0;
+        std::uint32_t timer = 1; // CPU cycles to the next step of the sequencer
+        std::uint8_t step = 0;
+        std::uint8_t length = 0;
+        std::uint8_t level = 0; // current output, worked out from the rest
+
+        template <typename Self, typename Visitor>
+        static void visit(Self &p, Visitor &visitor)
+        {
+            visitor.value(p.duty);
+            visitor.value(p.halt);
+            visitor.value(p.constant);
+            visitor.value(p.volume);
+            visitor.value(p.envelope.start);
+            visitor.value(p.envelope.divider);
+            visitor.value(p.envelope.decay);
+            visitor.value(p.sweepEnabled);
+            visitor.value(p.sweepNegate);
+            visitor.value(p.sweepReload);
+            visitor.value(p.sweepPeriod);
+            visitor.value(p.sweepShift);
+            visitor.value(p.sweepDivider);
+            visitor.value(p.period);
+            visitor.value(p.timer);
+            visitor.value(p.step);
+            visitor.value(p.length);
+        }
+    };
+
+    struct Triangle
+    {
+        bool control = false; // halts the length counter and keeps reloading the linear one
+        std::uint8_t linearReload = 0;
+        std::uint8_t linear = 0;
+        bool linearReloading = false;
+        std::uint16_t period = 0;
+        std::uint32_t timer = 1;
+        std::uint8_t step = 0;
+        std::uint8_t length = 0;
+
+        template <typename Self, typename Visitor>
+        static void visit(Self &t, Visitor &visitor)
+        {
+            visitor.value(t.control);
+            visitor.value(t.linearReload);
+            visitor.value(t.linear);
+            visitor.value(t.linearReloading);
+            visitor.value(t.period);
+            visitor.value(t.timer);
+            visitor.value(t.step);
+            visitor.value(t.length);
+        }
+    };
+
+    struct Noise
+    {
+        bool halt = false;
+        bool constant = false;
+        std::uint8_t volume = 0;
+        Envelope envelope;
+        bool shortMode = false;
+        std::uint8_t periodIndex = 0;
+        std::uint32_t timer = 1;
+        std::uint16_t shift = 1;
+        std::uint8_t length = 0;
+        std::uint8_t level = 0;
+
+        template <typename Self, typename Visitor>
+        static void visit(Self &n, Visitor &visitor)
+        {
+            visitor.value(n.halt);
+            visitor.value(n.constant);
+            visitor.value(n.volume);
+            visitor.value(n.envelope.start);
+            visitor.value(n.envelope.divider);
+            visitor.value(n.envelope.decay);
+            visitor.value(n.shortMode);
+            visitor.value(n.periodIndex);
+            visitor.value(n.timer);
+            visitor.value(n.shift);
+            visitor.value(n.length);
+        }
+    };
+
+    struct Dmc
+    {
+        bool irqEnabled = false;
+        bool loop = false;
+        std::uint8_t periodIndex = 0;
+        std::uint8_t output = 0;
+        std::uint8_t sampleAddress = 0; // $4012
+        std::uint8_t sampleLength = 0;  // $4013
+        std::uint16_t address = 0;
+        std::uint16_t bytesRemaining = 0;
+        std::uint8_t buffer = 0;
+        bool bufferFull = false;
+        std::uint8_t shift = 0;
+        std::uint8_t bitsRemaining = 8;
+        bool silence = true;
+        std::uint32_t timer = 1;
+        bool irq = false;
+
+        template <typename Self, typename Visitor>
+        static void visit(Self &d, Visitor &visitor)
+        {
+            visitor.value(d.irqEnabled);
+            visitor.value(d.loop);
+            visitor.value(d.periodIndex);
+            visitor.value(d.output);
+            visitor.value(d.sampleAddress);
+            visitor.value(d.sampleLength);
+            visitor.value(d.address);
+            visitor.value(d.bytesRemaining);
+            visitor.value(d.buffer);
+            visitor.value(d.bufferFull);
+            visitor.value(d.shift);
+            visitor.value(d.bitsRemaining);
+            visitor.value(d.silence);
+            visitor.value(d.timer);
+            visitor.value(d.irq);
+        }
+    };
+
+    std::array<Pulse, 2> _pulses;
+    Triangle _triangle;
+    Noise _noise;
+    Dmc _dmc;
+
+    std::uint8_t _channelsEnabled = 0; // $4015: a disabled channel's length counter stays at 0
+    std::uint64_t _cycle = 0; // CPU cycles, on the CPU's count
+    bool _fiveStep = false;
+    bool _irqInhibit = false;
+    bool _frameIrq = false;
+    std::int32_t _frameCycle = 0; // into the frame counter sequence; negative while a $4017 write takes effect
+    std::uint8_t _frameStep = 0;
+    std::uint64_t _sampleFetchCycle = 0; // of the DMC sample byte being read, while it is
+
+    // Output side, none of it part of the emulated state
+    AudioRing *_output = nullptr;
+    AudioRing *_suspendedOutput = nullptr; // the output while suspended, with the synthesizer kept as it was
+    BandLimitedSynth _synth;
+    float _pulseMix = 0;
+    float _tndMix = 0;
+
+    // The console's mixer, as lookup tables over the summed channel levels
+    struct MixTables
+    {
+        std::array<float, 31> pulse;
+        std::array<float, 203> tnd; // indexed by 3 * triangle + 2 * noise + DMC
+
+        MixTables()
+        {
+            pulse[0] = tnd[0] = 0;
+            for (std::size_t i = 1; i < pulse.size(); i++)
+                pulse[i] = static_cast<float>(95.52 / (8128.0 / i + 100));
+            for (std::size_t i = 1; i < tnd.size(); i++)
+                tnd[i] = static_cast<float>(163.67 / (24329.0 / i + 100));
+        }
+    };
+
+    static const MixTables &mixTables()
+    {
+        static const MixTables tables;
+        return tables;
+    }
+
+    // Runs a timer with the given period for some cycles and returns how often it expired
+    static std::uint64_t runTimer(std::uint32_t &timer, std::uint32_t period, std::uint64_t cycles)
+    {
+        if (cycles < timer)
+        {
+            timer -= static_cast<std::uint32_t>(cycles);
+            return 0;
+        }
+        cycles -= timer;
+        timer = period - static_cast<std::uint32_t>(cycles % period);
+        return 1 + cycles / period;
+    }
+
+    static std::uint8_t lengthFor(std::uint8_t value)
+    {
+        return kLengths[value >> 3];
+    }
+
+    // Pulse 1 negates with ones' complement, pulse 2 with two's
+    std::uint16_t sweepTarget(int channel) const
+    {
+        const Pulse &p = _pulses[channel];
+        const int change = p.period >> p.sweepShift;
+        const int target = p.sweepNegate ? p.period - change - (channel == 0 ? 1 : 0) : p.period + change;
+        return static_cast<std::uint16_t>(std::max(target, 0));
+    }
+
+    bool pulseAudible(int channel) const
+    {
+        const Pulse &p = _pulses[channel];
+        return p.length && p.period >= 8 && sweepTarget(channel) <= 0x7FF;
+    }
+
+    std::uint8_t pulseLevel(int channel) const
+    {
+        const Pulse &p = _pulses[channel];
+        if (!pulseAudible(channel) || !kDuties[p.duty][p.step])
+            return 0;
+        return p.constant ? p.volume : p.envelope.decay;
+    }
+
+    std::uint8_t triangleLevel() const
+    {
+        return static_cast<std::uint8_t>(_triangle.step < 16 ? 15 - _triangle.step : _triangle.step - 16);
+    }
+
+    std::uint8_t noiseLevel() const
+    {
+        if (!_noise.length || (_noise.shift & 0x01))
+            return 0;
+        return _noise.constant ? _noise.volume : _noise.envelope.decay;
+    }
+
+    // Steps the mix of a channel group at the given cycle, if it changed
+    void emitPulses(std::uint64_t cycle)
+    {
+        const float mix = mixTables().pulse[_pulses[0].level + _pulses[1].level];
+        if (mix != _pulseMix)
+        {
+            _synth.addDelta(cycle, mix - _pulseMix);
+            _pulseMix = mix;
+        }
+    }
+
+    void emitTnd(std::uint64_t cycle)
+    {
+        const float mix = mixTables().tnd[3 * triangleLevel() + 2 * _noise.level + _dmc.output];
+        if (mix != _tndMix)
+        {
+            _synth.addDelta(cycle, mix - _tndMix);
+            _tndMix = mix;
+        }
+    }
+
+    // Works the channel levels out again after something other than their timers changed them
+    void updateLevels()
+    {
+        _pulses[0].level = pulseLevel(0);
+        _pulses[1].level = pulseLevel(1);
+        _noise.level = noiseLevel();
+        if (_output)
+        {
+            emitPulses(_cycle);
+            emitTnd(_cycle);
+        }
+    }
+
+    void runPulse(int channel, std::uint64_t end)
+    {
+        Pulse &p = _pulses[channel];
+        const std::uint32_t period = (p.period + 1u) * 2;
+        if (!_output || !pulseAudible(channel))
+        {
+            p.step = static_cast<std::uint8_t>((p.step + runTimer(p.timer, period, end - _cycle)) & 0x07);
+            return;
+        }
+        std::uint64_t at = _cycle + p.timer;
+        for (; at <= end; at += period)
+        {
+            p.step = (p.step + 1) & 0x07;
+            const std::uint8_t level = pulseLevel(channel);
+            if (level != p.level)
+            {
+                p.level = level;
+                emitPulses(at);
+            }
+        }
+        p.timer = static_cast<std::uint32_t>(at - end);
+    }
+
+    // The sequencer only moves while both counters are running. Periods below 2 would step it
+    // ultrasonically fast; it is held instead, as such notes are inaudible anyway.
+    void runTriangle(std::uint64_t end)
+    {
+        Triangle &t = _triangle;
+        if (!t.linear || !t.length || t.period < 2)
+            return;
+        const std::uint32_t period = t.period + 1u;
+        if (!_output)
+        {
+            t.step = static_cast<std::uint8_t>((t.step + runTimer(t.timer, period, end - _cycle)) & 0x1F);
+            return;
+        }
+        std::uint64_t at = _cycle + t.timer;
+        for (; at <= end; at += period)
+        {
+            t.step = (t.step + 1) & 0x1F;
+            emitTnd(at);
+        }
+        t.timer = static_cast<std::uint32_t>(at - end);
+    }
+
+    // The shift register only matters while the channel is audible, so it is left alone otherwise
+    void runNoise(std::uint64_t end)
+    {
+        Noise &n = _noise;
+        const std::uint32_t period = kNoisePeriods[n.periodIndex];
+        if (!n.length)
+        {
+            runTimer(n.timer, period, end - _cycle);
+            return;
+        }
+        const int tap = n.shortMode ? 6 : 1;
+        std::uint64_t at = _cycle + n.timer;
+        for (; at <= end; at += period)
+        {
+            const std::uint16_t feedback = (n.shift ^ (n.shift >> tap)) & 0x01;
+            n.shift = static_cast<std::uint16_t>((n.shift >> 1) | (feedback << 14));
+            if (_output)
+            {
+                const std::uint8_t level = noiseLevel();
+                if (level != n.level)
+                {
+                    n.level = level;
+                    emitTnd(at);
+                }
+            }
+        }
+        n.timer = static_cast<std::uint32_t>(at - end);
+    }
+
+    // Fills the sample buffer from memory when it is empty and there is sample left
+    template <typename Read>
+    void fetchSample(Read &read, std::uint64_t cycle)
+    {
+        Dmc &d = _dmc;
+        if (d.bufferFull || !d.bytesRemaining)
+            return;
+        _sampleFetchCycle = cycle;
+        d.buffer = read(d.address);
+        d.bufferFull = true;
+        d.address = d.address == 0xFFFF ? 0x8000 : d.address + 1;
+        if (--d.bytesRemaining == 0)
+        {
+            if (d.loop)
+                restartSample();
+            else if (d.irqEnabled)
+                d.irq = true;
+        }
+    }
+
+    void restartSample()
+    {
+        _dmc.address = static_cast<std::uint16_t>(0xC000 | (_dmc.sampleAddress << 6));
+        _dmc.bytesRemaining = static_cast<std::uint16_t>((_dmc.sampleLength << 4) | 1);
+    }
+
+    template <typename Read>
+    void runDmc(std::uint64_t end, Read &read)
+    {
+        Dmc &d = _dmc;
+        const std::uint32_t period = kDmcPeriods[d.periodIndex];
+        std::uint64_t at = _cycle + d.timer;
+        for (; at <= end; at += period)
+        {
+            if (!d.silence)
+            {
+                const std::uint8_t before = d.output;
+                if (d.shift & 0x01)
+                {
+                    if (d.output <= 125)
+                        d.output += 2;
+                }
+                else if (d.output >= 2)
+                    d.output -= 2;
+                if (_output && d.output != before)
+                    emitTnd(at);
+            }
+            d.shift >>= 1;
+            if (--d.bitsRemaining == 0)
+            {
+                d.bitsRemaining = 8;
+                d.silence = !d.bufferFull;
+                if (d.bufferFull)
+                {
+                    d.shift = d.buffer;
+                    d.bufferFull = false;
+                    fetchSample(read, at);
+                }
+            }
+        }
+        d.timer = static_cast<std::uint32_t>(at - end);
+    }
+
+    void clockQuarterFrame()
+    {
+        for (Pulse &p : _pulses)
+            p.envelope.clock(p.volume, p.halt);
+        _noise.envelope.clock(_noise.volume, _noise.halt);
+
+        Triangle &t = _triangle;
+        if (t.linearReloading)
+            t.linear = t.linearReload;
+        else if (t.linear)
+            t.linear--;
+        if (!t.control)
+            t.linearReloading = false;
+    }
+
+    void clockHalfFrame()
+    {
+        for (int channel = 0; channel < 2; channel++)
+        {
+            Pulse &p = _pulses[channel];
+            if (p.length && !p.halt)
+                p.length--;
+            if (p.sweepDivider == 0 && p.sweepEnabled && p.sweepShift && p.period >= 8 && sweepTarget(channel) <= 0x7FF)
+                p.period = sweepTarget(channel);
+            if (p.sweepDivider == 0 || p.sweepReload)
+            {
+                p.sweepDivider = p.sweepPeriod;
+                p.sweepReload = false;
+            }
+            else
+                p.sweepDivider--;
+        }
+        if (_triangle.length && !_triangle.control)
+            _triangle.length--;
+        if (_noise.length && !_noise.halt)
+            _noise.length--;
+    }
+
+    void clockFrameStep()
+    {
+        clockQuarterFrame();
+        if (_frameStep & 0x01)
+            clockHalfFrame();
+        if (_frameStep == 3)
+        {
+            if (!_fiveStep && !_irqInhibit)
+                _frameIrq = true;
+            _frameCycle -= kFramePeriods[_fiveStep];
+            _frameStep = 0;
+        }
+        else
+            _frameStep++;
+        updateLevels();
+    }
+
+    void flushOutput()
+    {
+        if (_output)
+            _synth.flush(_cycle, [this](const float *samples, std::size_t count)
+                         { _output->write(samples, count); });
+    }
+
+public:
+    // Power-on state, with the frame counter starting its sequence at the given CPU cycle
+    void reset(std::uint64_t cycle)
+    {
+        _pulses = {};
+        _triangle = {};
+        _noise = {};
+        _dmc = {};
+        _channelsEnabled = 0;
+        _cycle = cycle;
+        _fiveStep = _irqInhibit = _frameIrq = false;
+        _frameCycle = 0;
+        _frameStep = 0;
+        _synth.restart(cycle);
+        _pulseMix = _tndMix = 0;
+        updateLevels();
+    }
+
+    void setSimdLevel(SimdLevel level)
+    {
+        _synth.setSimdLevel(level);
+    }
+
+    // Sends 48 kHz samples to the ring from now on, or stops when it is null
+    void setOutput(AudioRing *output)
+    {
+        _output = output;
+        _suspendedOutput = nullptr;
+        _synth.restart(_cycle);
+        _pulseMix = _tndMix = 0;
+        updateLevels();
+    }
+
+    // Runs on without making sound and without touching what the synthesizer holds, until resumed.
+    // Saving a state here, running and loading it back then resumes without a seam, and so does
+    // running the same cycles again from an earlier state.
+    void suspendOutput()
+    {
+        if (!_output)
+            return;
+        flushOutput();
+        _suspendedOutput = _output;
+        _output = nullptr;
+    }
+
+    void resumeOutput()
+    {
+        if (!_suspendedOutput)
+            return;
+        _output = _suspendedOutput;
+        _suspendedOutput = nullptr;
+        // Silent timers leave the channel levels behind; the mixes still hold what was last heard
+        updateLevels();
+    }
+
+    // Samples per emulated second as a multiple of 48000, for the next samples on
+    void setRateScale(double scale)
+    {
+        flushOutput();
+        _synth.setRateScale(scale);
+    }
+
+    // Advances to the given CPU cycle; read(address) fetches DMC sample bytes
+    template <typename Read>
+    void run(std::uint64_t targetCycle, Read &&read)
+    {
+        while (_cycle < targetCycle)
+        {
+            const std::uint64_t toStep = static_cast<std::uint64_t>(kFrameSteps[_fiveStep][_frameStep] - _frameCycle);
+            const std::uint64_t end = std::min({targetCycle, _cycle + toStep, _cycle + kMaxSpanCycles});
+            runPulse(0, end);
+            runPulse(1, end);
+            runTriangle(end);
+            runNoise(end);
+            runDmc(end, read);
+            _frameCycle += static_cast<std::int32_t>(end - _cycle);
+            _cycle = end;
+            if (_frameCycle == kFrameSteps[_fiveStep][_frameStep])
+                clockFrameStep();
+            flushOutput();
+        }
+    }
+
+    // Cycle at which IRQ may next be raised if no register is written before then. For the DMC that is
+    // the next time the sample buffer is refilled, which is early unless it takes the last byte.
+    std::uint64_t nextIrqCycle() const
+    {
+        std::uint64_t next = std::numeric_limits<std::uint64_t>::max();
+        if (!_fiveStep && !_irqInhibit)
+            next = _cycle + static_cast<std::uint64_t>(kFrameSteps[0][3] - _frameCycle);
+        if (_dmc.irqEnabled && _dmc.bytesRemaining)
+            next = std::min(next, _cycle + _dmc.timer + (_dmc.bitsRemaining - 1u) * kDmcPeriods[_dmc.periodIndex]);
+        return next;
+    }
+
+    bool irq() const { return _frameIrq || _dmc.irq; }
+
+    // $4015: length counters still running, DMC active, and the two IRQ flags; reading clears the frame IRQ
+    std::uint8_t readStatus()
+    {
+        std::uint8_t status = 0;
+        status |= _pulses[0].length ? 0x01 : 0;
+        status |= _pulses[1].length ? 0x02 : 0;
+        status |= _triangle.length ? 0x04 : 0;
+        status |= _noise.length ? 0x08 : 0;
+        status |= _dmc.bytesRemaining ? 0x10 : 0;
+        status |= _frameIrq ? 0x40 : 0;
+        status |= _dmc.irq ? 0x80 : 0;
+        _frameIrq = false;
+        return status;
+    }
+
+    // $4000-$4013, $4015 and $4017, at the current cycle; read fetches the first DMC byte when enabled
+    template <typename Read>
+    void writeRegister(std::uint16_t address, std::uint8_t value, Read &&read)
+    {
+        if (address < 0x4008)
+        {
+            const int channel = (address >> 2) & 0x01;
+            Pulse &p = _pulses[channel];
+            switch (address & 0x03)
+            {
+            case 0:
+                p.duty = value >> 6;
+                p.halt = value & 0x20;
+                p.constant = value & 0x10;
+                p.volume = value & 0x0F;
+                break;
+            case 1:
+                p.sweepEnabled = value & 0x80;
+                p.sweepPeriod = (value >> 4) & 0x07;
+                p.sweepNegate = value & 0x08;
+                p.sweepShift = value & 0x07;
+                p.sweepReload = true;
+                break;
+            case 2:
+                p.period = static_cast<std::uint16_t>((p.period & 0x0700) | value);
+                break;
+            case 3:
+                p.period = static_cast<std::uint16_t>((p.period & 0x00FF) | ((value & 0x07) << 8));
+                if (_channelsEnabled & (1 << channel))
+                    p.length = lengthFor(value);
+                p.step = 0;
+                p.envelope.start = true;
+                break;
+            }
+        }
+        else if (address < 0x400C)
+        {
+            Triangle &t = _triangle;
+            switch (address & 0x03)
+            {
+            case 0:
+                t.control = value & 0x80;
+                t.linearReload = value & 0x7F;
+                break;
+            case 2:
+                t.period = static_cast<std::uint16_t>((t.period & 0x0700) | value);
+                break;
+            case 3:
+                t.period = static_cast<std::uint16_t>((t.period & 0x00FF) | ((value & 0x07) << 8));
+                if (_channelsEnabled & 0x04)
+                    t.length = lengthFor(value);
+                t.linearReloading = true;
+                break;
+            }
+        }
+        else if (address < 0x4010)
+        {
+            Noise &n = _noise;
+            switch (address & 0x03)
+            {
+            case 0:
+                n.halt = value & 0x20;
+                n.constant = value & 0x10;
+                n.volume = value & 0x0F;
+                break;
+            case 2:
+                n.shortMode = value & 0x80;
+                n.periodIndex = value & 0x0F;
+                break;
+            case 3:
+                if (_channelsEnabled & 0x08)
+                    n.length = lengthFor(value);
+                n.envelope.start = true;
+                break;
+            }
+        }
+        else if (address < 0x4014)
+        {
+            Dmc &d = _dmc;
+            switch (address & 0x03)
+            {
+            case 0:
+                d.irqEnabled = value & 0x80;
+                d.loop = value & 0x40;
+                d.periodIndex = value & 0x0F;
+                if (!d.irqEnabled)
+                    d.irq = false;
+                break;
+            case 1:
+                d.output = value & 0x7F;
+                break;
+            case 2:
+                d.sampleAddress = value;
+                break;
+            case 3:
+                d.sampleLength = value;
+                break;
+            }
+        }
+        else if (address == 0x4015)
+        {
+            _channelsEnabled = value & 0x1F;
+            if (!(value & 0x01))
+                _pulses[0].length = 0;
+            if (!(value & 0x02))
+                _pulses[1].length = 0;
+            if (!(value & 0x04))
+                _triangle.length = 0;
+            if (!(value & 0x08))
+                _noise.length = 0;
+            _dmc.irq = false;
+            if (!(value & 0x10))
+                _dmc.bytesRemaining = 0;
+            else if (!_dmc.bytesRemaining)
+            {
+                restartSample();
+                fetchSample(read, _cycle);
+            }
+        }
+        else if (address == 0x4017)
+        {
+            // The sequence restarts 3 or 4 cycles later; the 5-step mode clocks everything right away
+            _fiveStep = value & 0x80;
+            _irqInhibit = value & 0x40;
+            if (_irqInhibit)
+                _frameIrq = false;
+            _frameCycle = (_cycle & 0x01) ? -4 : -3;
+            _frameStep = 0;
+            if (_fiveStep)
+            {
+                clockQuarterFrame();
+                clockHalfFrame();
+            }
+        }
+        updateLevels();
+    }
+
+    // Lists the state a save-state keeps; the synthesizer and what it has not yet output are not part of it
+    template <typename Self, typename Visitor>
+    static void visitState(Self &apu, Visitor &visitor)
+    {
+        Pulse::visit(apu._pulses[0], visitor);
+        Pulse::visit(apu._pulses[1], visitor);
+        Triangle::visit(apu._triangle, visitor);
+        Noise::visit(apu._noise, visitor);
+        Dmc::visit(apu._dmc, visitor);
+        visitor.value(apu._channelsEnabled);
+        visitor.value(apu._cycle);
+        visitor.value(apu._fiveStep);
+        visitor.value(apu._irqInhibit);
+        visitor.value(apu._frameIrq);
+        visitor.value(apu._frameCycle);
+        visitor.value(apu._frameStep);
+    }
+
+    // Output picks up from the loaded cycle. While output is suspended the synthesizer is kept, as the
+    // state is expected to be the one saved when it was suspended.
+    void stateLoaded()
+    {
+        if (_suspendedOutput)
+            updateLevels();
+        else
+            restartOutput();
+    }
+
+    // Drops what the synthesizer holds and starts it over from silence at the current cycle, for when
+    // it was kept through a suspension that did not end in loading the state it was suspended at
+    void restartOutput()
+    {
+        _synth.restart(_cycle);
+        _pulseMix = _tndMix = 0;
+        updateLevels();
+    }
+
+    std::uint64_t cycle() const { return _cycle; }
+
+    // The cycle a DMC sample byte is read at, for the read callback to ask while it runs
+    std::uint64_t sampleFetchCycle() const { return _sampleFetchCycle; }
+};
@@ -0,0 +1,338 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "tile_decoder.hpp"
+
+// Same as the tile decoders: SSE2 on every x86-64, AVX2 picked at runtime. Build with
+// -DNES_AUDIO_SIMD=0 for the scalar synthesizer only.
+#ifndef NES_AUDIO_SIMD
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define NES_AUDIO_SIMD 1
+#else
+#define NES_AUDIO_SIMD 0
+#endif
+#endif
+
+#if NES_AUDIO_SIMD
+#include <immintrin.h>
+#endif
+
+// Band-limited step synthesis. A sound channel's output only ever jumps from one level to another, so
+// instead of producing it cycle by cycle and filtering it down, each jump adds a windowed-sinc step,
+// positioned to a fraction of an output sample, straight into the output buffer. The buffer holds the
+// differences of the signal and is summed up as samples are taken out.
+namespace audio
+{
+    constexpr int kSampleRate = 48000;
+    constexpr double kCpuClockHz = 1789772.7; // NTSC 2A03
+    constexpr int kTaps = 16;                 // output samples each step is spread over
+    constexpr int kPhaseBits = 6;
+    constexpr int kPhases = 1 << kPhaseBits;  // sub-sample positions a step can start at
+
+    // out[i] += kernel[i] * delta for the kTaps taps of one step
+    using AddStep = void (*)(float *out, const float *kernel, float delta);
+
+    inline void addStepScalar(float *out, const float *kernel, float delta)
+    {
+        for (int i = 0; i < kTaps; i++)
+            out[i] += kernel[i] * delta;
+    }
+
+#if NES_AUDIO_SIMD
+    inline void addStepSSE2(float *out, const float *kernel, float delta)
+    {
+        const __m128 scale = _mm_set1_ps(delta);
+        for (int i = 0; i < kTaps; i += 4)
+        {
+            __m128 sum = _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_load_ps(kernel + i), scale));
+            _mm_storeu_ps(out + i, sum);
+        }
+    }
+
+    __attribute__((target("avx2"))) inline void addStepAVX2(float *out, const float *kernel, float delta)
+    {
+        const __m256 scale = _mm256_set1_ps(delta);
+        for (int i = 0; i < kTaps; i += 8)
+        {
+            __m256 sum = _mm256_add_ps(_mm256_loadu_ps(out + i), _mm256_mul_ps(_mm256_load_ps(kernel + i), scale));
+            _mm256_storeu_ps(out + i, sum);
+        }
+    }
+#endif
+
+    inline AddStep stepAdderFor(SimdLevel level)
+    {
+#if NES_AUDIO_SIMD
+        if (level == SimdLevel::AVX2)
+            return &addStepAVX2;
+        if (level == SimdLevel::SSE2)
+            return &addStepSSE2;
+#endif
+        (void)level;
+        return &addStepScalar;
+    }
+
+    struct alignas(32) KernelPhase
+    {
+        float taps[kTaps];
+    };
+
+    // One step per phase: a Blackman-windowed sinc cut off a little below the output Nyquist
+    // frequency, delayed by half the taps so it is causal, and scaled to sum to exactly 1
+    inline const std::array<KernelPhase, kPhases> &stepKernels()
+    {
+        static const std::array<KernelPhase, kPhases> kernels = []
+        {
+            const double pi = 3.14159265358979323846;
+            const double cutoff = 0.9;
+            std::array<KernelPhase, kPhases> table{};
+            for (int phase = 0; phase < kPhases; phase++)
+            {
+                double sum = 0;
+                double taps[kTaps];
+                for (int i = 0; i < kTaps; i++)
+                {
+                    double x = i - kTaps / 2 + 1 - static_cast<double>(phase) / kPhases;
+                    double sinc = x == 0 ? 1.0 : std::sin(pi * cutoff * x) / (pi * cutoff * x);
+                    double w = (x + kTaps / 2) / kTaps;
+                    double window = 0.42 - 0.5 * std::cos(2 * pi * w) + 0.08 * std::cos(4 * pi * w);
+                    taps[i] = sinc * window;
+                    sum += taps[i];
+                }
+                for (int i = 0; i < kTaps; i++)
+                    table[phase].taps[i] = static_cast<float>(taps[i] / sum);
+            }
+            return table;
+        }();
+        return kernels;
+    }
+}
+
+// Turns level changes stamped in CPU cycles into 48 kHz samples. Time runs from an origin cycle whose
+// position, in 32.32 fixed-point samples, is known; a change at a later cycle lands at that position plus
+// the cycles times the sample/cycle ratio. Samples are complete once time has passed them by, since later
+// steps only reach forward.
+class BandLimitedSynth
+{
+public:
+    // Steps may be added at most this far, in samples, past the last flush; callers flush well within it
+    static constexpr std::size_t kMaxSamples = 2048;
+
+private:
+    static constexpr int kFractionBits = 32;
+
+    std::vector<float> _deltas = std::vector<float>(kMaxSamples + audio::kTaps, 0.0f);
+    std::vector<float> _samples = std::vector<float>(kMaxSamples, 0.0f);
+    std::uint64_t _originCycle = 0;
+    std::uint64_t _originFraction = 0; // where the origin cycle falls within sample 0
+    static constexpr double kNominalSamplesPerCycle = audio::kSampleRate / audio::kCpuClockHz;
+    std::uint64_t _samplesPerCycle = static_cast<std::uint64_t>(kNominalSamplesPerCycle * (1ull << kFractionBits) + 0.5);
+    audio::AddStep _addStep = &audio::addStepScalar;
+
+    // Running sum of the differences, then a DC blocker in place of the console's high-pass filters
+    float _level = 0;
+    float _previousLevel = 0;
+    float _previousOutput = 0;
+    static constexpr float kHighPass = 0.996f; // about 30 Hz at 48 kHz
+
+    std::uint64_t position(std::uint64_t cycle) const
+    {
+        return (cycle - _originCycle) * _samplesPerCycle + _originFraction;
+    }
+
+public:
+    void setSimdLevel(SimdLevel level)
+    {
+        _addStep = audio::stepAdderFor(level);
+    }
+
+    // Makes scale times the nominal number of samples per emulated second from the origin on, to
+    // stretch or squeeze the sound a little. Pending steps keep their places as long as this is
+    // called right after a flush.
+    void setRateScale(double scale)
+    {
+        _samplesPerCycle = static_cast<std::uint64_t>(kNominalSamplesPerCycle * scale * (1ull << kFractionBits) + 0.5);
+    }
+
+    // Drops everything pending and starts the timeline over at the given cycle, from silence
+    void restart(std::uint64_t cycle)
+    {
+        std::fill(_deltas.begin(), _deltas.end(), 0.0f);
+        _originCycle = cycle;
+        _originFraction = 0;
+        _level = _previousLevel = _previousOutput = 0;
+    }
+
+    // Adds a jump of delta in the output level at the given cycle, which must not be before the last flush
+    void addDelta(std::uint64_t cycle, float delta)
+    {
+        const std::uint64_t at = position(cycle);
+        const std::size_t index = static_cast<std::size_t>(at >> kFractionBits);
+        const int phase = static_cast<int>((at >> (kFractionBits - audio::kPhaseBits)) & (audio::kPhases - 1));
+        _addStep(&_deltas[index], audio::stepKernels()[phase].taps, delta);
+    }
+
+    // Hands every sample completed by the given cycle to sink(samples, count) and moves the origin there.
+    // A caller that let more than kMaxSamples build up loses the ones past that.
+    template <typename Sink>
+    void flush(std::uint64_t cycle, Sink &&sink)
+    {
+        const std::uint64_t at = position(cycle);
+        const std::size_t count = static_cast<std::size_t>(std::min<std::uint64_t>(at >> kFractionBits, kMaxSamples));
+        for (std::size_t i = 0; i < count; i++)
+        {
+            _level += _deltas[i];
+            _previousOutput = _level - _previousLevel + kHighPass * _previousOutput;
+            _previousLevel = _level;
+            _samples[i] = _previousOutput;
+        }
+        std::memmove(_deltas.data(), _deltas.data() + count, audio::kTaps * sizeof(float));
+        std::fill(_deltas.begin() + audio::kTaps, _deltas.begin() + audio::kTaps + count, 0.0f);
+        _originCycle = cycle;
+        _originFraction = at & ((1ull << kFractionBits) - 1);
+        if (count)
+            sink(_samples.data(), count);
+    }
+};
+
+// Single-producer, single-consumer queue of samples. The emulator thread writes and one other thread,
+// an audio callback say, reads; neither ever waits for the other. Samples that do not fit are dropped.
+class AudioRing
+{
+private:
+    std::unique_ptr<float[]> _samples;
+    std::size_t _mask;
+    alignas(64) std::atomic<std::size_t> _written{0};
+    alignas(64) std::atomic<std::size_t> _read{0};
+    alignas(64) std::atomic<std::size_t> _dropped{0};
+
+public:
+    // Capacity is rounded up to a power of two
+    explicit AudioRing(std::size_t capacity)
+    {
+        std::size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        _samples.reset(new float[size]);
+        _mask = size - 1;
+    }
+
+    std::size_t capacity() const { return _mask + 1; }
+
+    std::size_t available() const
+    {
+        return _written.load(std::memory_order_acquire) - _read.load(std::memory_order_relaxed);
+    }
+
+    // Producer side; returns how many samples went in
+    std::size_t write(const float *samples, std::size_t count)
+    {
+        const std::size_t written = _written.load(std::memory_order_relaxed);
+        const std::size_t space = capacity() - (written - _read.load(std::memory_order_acquire));
+        const std::size_t n = std::min(count, space);
+        for (std::size_t i = 0; i < n; i++)
+            _samples[(written + i) & _mask] = samples[i];
+        _written.store(written + n, std::memory_order_release);
+        if (n < count)
+            _dropped.fetch_add(count - n, std::memory_order_relaxed);
+        return n;
+    }
+
+    // Consumer side; returns how many samples came out
+    std::size_t read(float *samples, std::size_t count)
+    {
+        const std::size_t read = _read.load(std::memory_order_relaxed);
+        const std::size_t n = std::min(count, _written.load(std::memory_order_acquire) - read);
+        for (std::size_t i = 0; i < n; i++)
+            samples[i] = _samples[(read + i) & _mask];
+        _read.store(read + n, std::memory_order_release);
+        return n;
+    }
+
+    // Samples thrown away because the reader fell behind
+    std::size_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+};
+
+// Mono 32-bit float WAV at the synthesizer's rate. The sizes in the header are filled in on close.
+class WavWriter
+{
+private:
+    std::ofstream _file;
+    std::uint32_t _samples = 0;
+
+    template <typename T>
+    void put(T value)
+    {
+        _file.write(reinterpret_cast<const char *>(&value), sizeof(value)); // RIFF is little-endian, as x86 is
+    }
+
+    void writeHeader()
+    {
+        const std::uint32_t dataBytes = _samples * 4;
+        _file.write("RIFF", 4);
+        put<std::uint32_t>(36 + dataBytes);
+        _file.write("WAVEfmt ", 8);
+        put<std::uint32_t>(16);
+        put<std::uint16_t>(3); // IEEE float
+        put<std::uint16_t>(1);
+        put<std::uint32_t>(audio::kSampleRate);
+        put<std::uint32_t>(audio::kSampleRate * 4);
+        put<std::uint16_t>(4);
+        put<std::uint16_t>(32);
+        _file.write("data", 4);
+        put<std::uint32_t>(dataBytes);
+    }
+
+public:
+    ~WavWriter() { close(); }
+
+    bool open(const std::string &path)
+    {
+        _file.open(path, std::ios::binary | std::ios::trunc);
+        _samples = 0;
+        if (_file)
+            writeHeader();
+        return static_cast<bool>(_file);
+    }
+
+    void write(const float *samples, std::size_t count)
+    {
+        _file.write(reinterpret_cast<const char *>(samples), static_cast<std::streamsize>(count * sizeof(float)));
+        _samples += static_cast<std::uint32_t>(count);
+    }
+
+    bool close()
+    {
+        if (!_file.is_open())
+            return true;
+        _file.seekp(0);
+        writeHeader();
+        _file.close();
+        return !_file.fail();
+    }
+};
+
+// Checks a vector step adder against the scalar one over steps at every phase
+inline bool verifyStepSynth(SimdLevel level)
+{
+    std::vector<float> expected(audio::kPhases + audio::kTaps, 0.0f), actual(expected.size(), 0.0f);
+    const audio::AddStep add = audio::stepAdderFor(level);
+    for (int phase = 0; phase < audio::kPhases; phase++)
+    {
+        const float delta = 0.01f * static_cast<float>(phase - audio::kPhases / 2);
+        audio::addStepScalar(&expected[phase], audio::stepKernels()[phase].taps, delta);
+        add(&actual[phase], audio::stepKernels()[phase].taps, delta);
+    }
+    return expected == actual;
+}
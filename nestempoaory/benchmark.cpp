@@ -0,0 +1,528 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "nesemulator.hpp"
+
+// Runs ROMs through the CPU core for a fixed number of emulated cycles and reports how fast each went,
+// as a table and optionally as JSON to compare between commits. Besides the ROMs given, four synthetic
+// ones stress one kind of instruction each: ALU, branches, memory and the stack. None of them turns on
+// rendering, so the numbers are the CPU's alone. A ROM that halts before the budget is used up is put
+// back to its power-on state and run again; only the time spent running counts.
+
+namespace
+{
+    // NTSC 2A03: 21.477272 MHz master clock divided by 12
+    constexpr double kCpuClockHz = 1789772.7;
+
+    struct Settings
+    {
+        std::uint64_t cycles = 20000000;
+        unsigned runs = 3;
+        std::vector<DispatchMode> modes{DispatchMode::Tiered};
+        bool jit = true;
+    };
+
+    struct Result
+    {
+        std::string name;
+        std::string rom;
+        bool synthetic = false;
+        DispatchMode mode = DispatchMode::Tiered;
+        bool loaded = false;
+        std::uint64_t instructions = 0;
+        std::uint64_t cycles = 0;
+        std::uint64_t restarts = 0;
+        double seconds = 0; // fastest of the runs
+    };
+
+    int usage()
+    {
+        std::cerr << "Usage: nes_benchmark [--cycles N] [--runs N] [--dispatch table|threaded|predecoded|tiered|all]\n"
+                     "                     [--no-jit] [--no-synthetic] [--json FILE] [--label TEXT]\n"
+                     "                     [--all DIR | <rom> ...]\n"
+                     "Runs every ROM and the synthetic instruction mixes for 20000000 cycles unless --cycles\n"
+                     "says otherwise, 3 times each, and keeps the fastest run. --dispatch may be given more than\n"
+                     "once; --all takes every DIR/*.nes; --label is stored in the JSON, a commit hash say."
+                  << std::endl;
+        return 2;
+    }
+
+    bool parseCount(const std::string &text, std::uint64_t &value)
+    {
+        char *end = nullptr;
+        value = std::strtoull(text.c_str(), &end, 10);
+        return !text.empty() && *end == '\0';
+    }
+
+    bool parseDispatch(const std::string &name, DispatchMode &mode)
+    {
+        if (name == "table")
+            mode = DispatchMode::Table;
+        else if (name == "threaded")
+            mode = DispatchMode::Threaded;
+        else if (name == "predecoded")
+            mode = DispatchMode::Predecoded;
+        else if (name == "tiered")
+            mode = DispatchMode::Tiered;
+        else
+            return false;
+        return true;
+    }
+
+    const char *dispatchName(DispatchMode mode)
+    {
+        switch (mode)
+        {
+        case DispatchMode::Table:
+            return "table";
+        case DispatchMode::Threaded:
+            return "threaded";
+        case DispatchMode::Predecoded:
+            return "predecoded";
+        case DispatchMode::Tiered:
+            break;
+        }
+        return "tiered";
+    }
+
+    void addRoms(const std::filesystem::path &directory, std::vector<std::string> &roms)
+    {
+        std::vector<std::string> found;
+        for (const auto &entry : std::filesystem::directory_iterator(directory))
+        {
+            if (entry.path().extension() == ".nes")
+                found.push_back(entry.path().string());
+        }
+        std::sort(found.begin(), found.end());
+        roms.insert(roms.end(), found.begin(), found.end());
+    }
+
+    // Just enough of an assembler for the synthetic ROMs: bytes, labels, and branches either way
+    class Assembler
+    {
+    private:
+        std::vector<std::uint8_t> _code;
+        std::uint16_t _origin;
+
+    public:
+        explicit Assembler(std::uint16_t origin) : _origin(origin) {}
+
+        const std::vector<std::uint8_t> &code() const { return _code; }
+        std::uint16_t here() const { return static_cast<std::uint16_t>(_origin + _code.size()); }
+
+        void emit(std::initializer_list<std::uint8_t> bytes)
+        {
+            _code.insert(_code.end(), bytes);
+        }
+
+        // Opcode with a 16-bit operand
+        void emit(std::uint8_t opcode, std::uint16_t address)
+        {
+            emit({opcode, static_cast<std::uint8_t>(address & 0xFF), static_cast<std::uint8_t>(address >> 8)});
+        }
+
+        void branchBack(std::uint8_t opcode, std::uint16_t target)
+        {
+            emit({opcode, static_cast<std::uint8_t>(target - (here() + 2))});
+        }
+
+        // Returns where the offset goes; land() fills it in with the current address
+        std::size_t branchForward(std::uint8_t opcode)
+        {
+            emit({opcode, 0});
+            return _code.size() - 1;
+        }
+
+        void land(std::size_t offset)
+        {
+            _code[offset] = static_cast<std::uint8_t>(_code.size() - offset - 1);
+        }
+
+        // Same for JMP and JSR: returns where the address goes, for patch() to fill in
+        std::size_t jumpForward(std::uint8_t opcode)
+        {
+            emit(opcode, 0);
+            return _code.size() - 2;
+        }
+
+        void patch(std::size_t offset, std::uint16_t address)
+        {
+            _code[offset] = static_cast<std::uint8_t>(address & 0xFF);
+            _code[offset + 1] = static_cast<std::uint8_t>(address >> 8);
+        }
+    };
+
+    constexpr std::uint8_t CLC = 0x18, SEC = 0x38, SEI = 0x78, CLD = 0xD8, TAX = 0xAA, TXA = 0x8A, TAY = 0xA8,
+                           TYA = 0x98, TSX = 0xBA, TXS = 0x9A, INX = 0xE8, INY = 0xC8, DEX = 0xCA, DEY = 0x88,
+                           PHA = 0x48, PLA = 0x68, PHP = 0x08, PLP = 0x28, RTS = 0x60, RTI = 0x40, NOP = 0xEA,
+                           ASL_A = 0x0A, ROL_A = 0x2A, LSR_A = 0x4A, ROR_A = 0x6A;
+    constexpr std::uint8_t LDA_IMM = 0xA9, LDX_IMM = 0xA2, LDY_IMM = 0xA0, ADC_IMM = 0x69, SBC_IMM = 0xE9,
+                           AND_IMM = 0x29, ORA_IMM = 0x09, EOR_IMM = 0x49, CMP_IMM = 0xC9, CPX_IMM = 0xE0,
+                           LDA_ZP = 0xA5, STA_ZP = 0x85, INC_ZP = 0xE6, DEC_ZP = 0xC6, ADC_INDY = 0x71,
+                           STA_INDY = 0x91;
+    constexpr std::uint8_t LDA_ABSY = 0xB9, STA_ABSY = 0x99, INC_ABSX = 0xFE, JMP = 0x4C, JSR = 0x20;
+    constexpr std::uint8_t BNE = 0xD0, BEQ = 0xF0, BCC = 0x90, BCS = 0xB0, BMI = 0x30;
+
+    void aluMix(Assembler &a)
+    {
+        const std::uint16_t loop = a.here();
+        for (int i = 0; i < 4; i++)
+        {
+            a.emit({CLC, ADC_IMM, 0x37, EOR_IMM, 0x5A, ASL_A, ROL_A, AND_IMM, 0xF7, ORA_IMM, 0x21});
+            a.emit({SEC, SBC_IMM, 0x03, LSR_A, ROR_A, TAX, INX, TXA, TAY, DEY, TYA, CMP_IMM, 0x40, CPX_IMM, 0x10});
+        }
+        a.emit(JMP, loop);
+    }
+
+    // Short loops whose branches go both ways in a changing pattern
+    void branchMix(Assembler &a)
+    {
+        const std::uint16_t loop = a.here();
+        a.emit({LDX_IMM, 0x40});
+        const std::uint16_t inner = a.here();
+        a.emit({TXA, AND_IMM, 0x03});
+        std::size_t skip = a.branchForward(BEQ);
+        a.emit({INY});
+        a.land(skip);
+        a.emit({LSR_A});
+        skip = a.branchForward(BCC);
+        a.emit({DEY});
+        a.land(skip);
+        a.emit({CPX_IMM, 0x20});
+        skip = a.branchForward(BCS);
+        a.emit({NOP});
+        a.land(skip);
+        a.emit({TYA});
+        skip = a.branchForward(BMI);
+        a.emit({NOP});
+        a.land(skip);
+        a.emit({DEX});
+        a.branchBack(BNE, inner);
+        a.emit(JMP, loop);
+    }
+
+    // Loads and stores over pages 2-4 through absolute indexed, indirect indexed and zero page modes
+    void memoryMix(Assembler &a)
+    {
+        a.emit({LDA_IMM, 0x00, STA_ZP, 0x00, LDA_IMM, 0x02, STA_ZP, 0x01});
+        const std::uint16_t loop = a.here();
+        a.emit({LDY_IMM, 0x00});
+        const std::uint16_t inner = a.here();
+        a.emit(LDA_ABSY, 0x0200);
+        a.emit({CLC, ADC_INDY, 0x00});
+        a.emit(STA_ABSY, 0x0300);
+        a.emit({TYA, TAX});
+        a.emit(INC_ABSX, 0x0400);
+        a.emit({LDA_ZP, 0x20, STA_INDY, 0x00, DEC_ZP, 0x21, INC_ZP, 0x20, INY});
+        a.branchBack(BNE, inner);
+        a.emit(JMP, loop);
+    }
+
+    // Subroutine calls, pushes and pulls of A and P, and stack pointer transfers
+    void stackMix(Assembler &a)
+    {
+        const std::uint16_t loop = a.here();
+        const std::size_t call = a.jumpForward(JSR);
+        a.emit({PHA, PHP, PLP, PLA, TSX, TXS});
+        const std::size_t secondCall = a.jumpForward(JSR);
+        a.emit({PHA, PHA, PLA, PLA, PHP, PLP});
+        a.emit(JMP, loop);
+
+        a.patch(call, a.here());
+        a.patch(secondCall, a.here());
+        a.emit({PHA, TXA, PHA, PLA, TAX, PLA, RTS});
+    }
+
+    // NROM-128 with the program at $C000 and blank CHR-ROM; NMI and IRQ go to an RTI
+    bool writeSyntheticRom(const std::filesystem::path &path, void (*body)(Assembler &))
+    {
+        Assembler a(0xC000);
+        a.emit({SEI, CLD, LDX_IMM, 0xFF, TXS});
+        body(a);
+        const std::uint16_t handler = a.here();
+        a.emit({RTI});
+
+        std::vector<std::uint8_t> prg(0x4000, 0);
+        std::copy(a.code().begin(), a.code().end(), prg.begin());
+        const std::uint16_t vectors[3] = {handler, 0xC000, handler};
+        for (int i = 0; i < 3; i++)
+        {
+            prg[0x3FFA + 2 * i] = static_cast<std::uint8_t>(vectors[i] & 0xFF);
+            prg[0x3FFB + 2 * i] = static_cast<std::uint8_t>(vectors[i] >> 8);
+        }
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        const std::uint8_t header[16] = {'N', 'E', 'S', 0x1A, 1, 1};
+        file.write(reinterpret_cast<const char *>(header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(prg.data()), static_cast<std::streamsize>(prg.size()));
+        const std::vector<char> chr(0x2000, 0);
+        file.write(chr.data(), static_cast<std::streamsize>(chr.size()));
+        return static_cast<bool>(file);
+    }
+
+    // One timed run: restarts from the power-on keyframe whenever the CPU halts, until the budget is used
+    bool runOnce(Result &result, const Settings &settings, double &seconds)
+    {
+        std::ostringstream output;
+        NESemulator emulator(result.rom);
+        emulator.setOutput(output, std::cerr);
+        emulator.setDispatchMode(result.mode);
+        emulator.setJitEnabled(settings.jit);
+        if (!emulator.init())
+            return false;
+        std::vector<std::uint8_t> powerOn(emulator.keyframeSize());
+        if (!emulator.saveState(powerOn.data(), powerOn.size()))
+            return false;
+
+        result.instructions = result.cycles = result.restarts = 0;
+        seconds = 0;
+        while (result.cycles < settings.cycles)
+        {
+            const std::uint64_t startCycles = emulator.cpuState().cycles;
+            const auto start = std::chrono::steady_clock::now();
+            result.instructions += emulator.runCycles(settings.cycles - result.cycles);
+            seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            const CpuState state = emulator.cpuState();
+            result.cycles += state.cycles - startCycles;
+            if (!state.halted)
+                continue;
+            // A ROM that halts straight away would never get anywhere
+            if (state.cycles == startCycles || !emulator.loadState(powerOn.data(), powerOn.size()))
+                return false;
+            result.restarts++;
+        }
+        return true;
+    }
+
+    void run(Result &result, const Settings &settings)
+    {
+        result.seconds = 0;
+        for (unsigned i = 0; i < settings.runs; i++)
+        {
+            double seconds = 0;
+            result.loaded = runOnce(result, settings, seconds);
+            if (!result.loaded)
+                return;
+            if (i == 0 || seconds < result.seconds)
+                result.seconds = seconds;
+        }
+    }
+
+    double mips(const Result &result)
+    {
+        return result.seconds > 0 ? result.instructions / result.seconds / 1e6 : 0.0;
+    }
+
+    double nsPerInstruction(const Result &result)
+    {
+        return result.instructions ? result.seconds * 1e9 / result.instructions : 0.0;
+    }
+
+    double cyclesPerSecond(const Result &result)
+    {
+        return result.seconds > 0 ? result.cycles / result.seconds : 0.0;
+    }
+
+    double realTime(const Result &result)
+    {
+        return cyclesPerSecond(result) / kCpuClockHz;
+    }
+
+    std::string jsonString(const std::string &text)
+    {
+        std::ostringstream out;
+        out << '"';
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\')
+                out << '\\' << c;
+            else if (static_cast<unsigned char>(c) < 0x20)
+                out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec;
+            else
+                out << c;
+        }
+        out << '"';
+        return out.str();
+    }
+
+    const char *simdName(SimdLevel level)
+    {
+        return level == SimdLevel::AVX2 ? "avx2" : level == SimdLevel::SSE2 ? "sse2" : "scalar";
+    }
+
+    bool writeJson(const std::string &path, const std::string &label, const Settings &settings, const std::vector<Result> &results)
+    {
+        std::ofstream file(path, std::ios::trunc);
+        file << std::setprecision(6) << "{\n"
+             << "  \"label\": " << jsonString(label) << ",\n"
+             << "  \"cycles\": " << settings.cycles << ",\n"
+             << "  \"runs\": " << settings.runs << ",\n"
+             << "  \"jit\": " << (settings.jit && NES_JIT_AVAILABLE ? "true" : "false") << ",\n"
+             << "  \"simd\": \"" << simdName(tile::detectSimdLevel()) << "\",\n"
+#ifdef __OPTIMIZE__
+             << "  \"optimized\": true,\n"
+#else
+             << "  \"optimized\": false,\n"
+#endif
+             << "  \"results\": [";
+        for (std::size_t i = 0; i < results.size(); i++)
+        {
+            const Result &result = results[i];
+            file << (i ? ",\n" : "\n") << "    {\"name\": " << jsonString(result.name)
+                 << ", \"rom\": " << jsonString(result.synthetic ? "" : result.rom)
+                 << ", \"synthetic\": " << (result.synthetic ? "true" : "false")
+                 << ", \"dispatch\": \"" << dispatchName(result.mode) << "\""
+                 << ", \"loaded\": " << (result.loaded ? "true" : "false")
+                 << ", \"instructions\": " << result.instructions
+                 << ", \"cycles\": " << result.cycles
+                 << ", \"restarts\": " << result.restarts
+                 << ", \"seconds\": " << result.seconds
+                 << ", \"mips\": " << mips(result)
+                 << ", \"ns_per_instruction\": " << nsPerInstruction(result)
+                 << ", \"cycles_per_second\": " << cyclesPerSecond(result)
+                 << ", \"real_time\": " << realTime(result) << "}";
+        }
+        file << "\n  ]\n}\n";
+        return static_cast<bool>(file);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> roms;
+    Settings settings;
+    bool modesGiven = false;
+    bool synthetic = true;
+    std::string jsonPath;
+    std::string label;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        std::uint64_t value = 0;
+        if (option == "--cycles" && hasValue)
+        {
+            if (!parseCount(argv[++i], settings.cycles) || settings.cycles == 0)
+                return usage();
+        }
+        else if (option == "--runs" && hasValue)
+        {
+            if (!parseCount(argv[++i], value) || value == 0)
+                return usage();
+            settings.runs = static_cast<unsigned>(value);
+        }
+        else if (option == "--dispatch" && hasValue)
+        {
+            if (!modesGiven)
+                settings.modes.clear();
+            modesGiven = true;
+            DispatchMode mode;
+            if (std::string(argv[i + 1]) == "all")
+            {
+                ++i;
+                settings.modes = {DispatchMode::Table, DispatchMode::Threaded, DispatchMode::Predecoded, DispatchMode::Tiered};
+            }
+            else if (parseDispatch(argv[++i], mode))
+                settings.modes.push_back(mode);
+            else
+                return usage();
+        }
+        else if (option == "--json" && hasValue)
+            jsonPath = argv[++i];
+        else if (option == "--label" && hasValue)
+            label = argv[++i];
+        else if (option == "--all" && hasValue)
+            addRoms(argv[++i], roms);
+        else if (option == "--no-jit")
+            settings.jit = false;
+        else if (option == "--no-synthetic")
+            synthetic = false;
+        else if (option.rfind("--", 0) != 0)
+            roms.push_back(option);
+        else
+            return usage();
+    }
+    if (roms.empty() && !synthetic)
+        return usage();
+
+#ifndef __OPTIMIZE__
+    std::cerr << "Warning: unoptimized build, the numbers say little about a release build" << std::endl;
+#endif
+
+    std::vector<Result> results;
+    for (const std::string &rom : roms)
+        results.push_back(Result{std::filesystem::path(rom).stem().string(), rom});
+
+    std::filesystem::path syntheticDirectory;
+    if (synthetic)
+    {
+        const std::pair<const char *, void (*)(Assembler &)> mixes[] = {
+            {"alu", &aluMix}, {"branch", &branchMix}, {"memory", &memoryMix}, {"stack", &stackMix}};
+        syntheticDirectory = std::filesystem::temp_directory_path() / ("nes_benchmark_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+        std::filesystem::create_directories(syntheticDirectory);
+        for (const auto &mix : mixes)
+        {
+            const std::filesystem::path path = syntheticDirectory / (std::string(mix.first) + ".nes");
+            if (!writeSyntheticRom(path, mix.second))
+            {
+                std::cerr << "Failed to write " << path.string() << std::endl;
+                return 1;
+            }
+            results.push_back(Result{std::string("synthetic/") + mix.first, path.string(), true});
+        }
+    }
+
+    // Every ROM under every dispatch mode asked for
+    std::vector<Result> runs;
+    for (DispatchMode mode : settings.modes)
+    {
+        for (Result result : results)
+        {
+            result.mode = mode;
+            runs.push_back(result);
+        }
+    }
+
+    bool allLoaded = true;
+    std::cout << std::left << std::setw(24) << "rom" << std::setw(12) << "dispatch" << std::right << std::setw(10)
+              << "MIPS" << std::setw(10) << "ns/inst" << std::setw(14) << "cycles/s" << std::setw(10) << "x real"
+              << std::setw(10) << "restarts" << std::endl;
+    for (Result &result : runs)
+    {
+        run(result, settings);
+        allLoaded = allLoaded && result.loaded;
+        std::cout << std::left << std::setw(24) << result.name << std::setw(12) << dispatchName(result.mode) << std::right;
+        if (!result.loaded)
+        {
+            std::cout << "  not run" << std::endl;
+            continue;
+        }
+        std::cout << std::fixed << std::setprecision(2) << std::setw(10) << mips(result)
+                  << std::setw(10) << nsPerInstruction(result) << std::setprecision(0) << std::setw(14)
+                  << cyclesPerSecond(result) << std::setprecision(2) << std::setw(10) << realTime(result)
+                  << std::setw(10) << result.restarts << std::endl;
+    }
+
+    if (!syntheticDirectory.empty())
+    {
+        std::error_code ignored;
+        std::filesystem::remove_all(syntheticDirectory, ignored);
+    }
+    if (!jsonPath.empty() && !writeJson(jsonPath, label, settings, runs))
+    {
+        std::cerr << "Failed to write " << jsonPath << std::endl;
+        return 1;
+    }
+    return allLoaded ? 0 : 1;
+}
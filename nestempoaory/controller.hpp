@@ -0,0 +1,113 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Standard controller. The game writes 1 then 0 to $4016 to latch the buttons into a shift register
+// and reads them out one a time, A first; after the eighth read every read returns 1.
+class Controller
+{
+public:
+    enum Button : std::uint8_t
+    {
+        A = 0x01,
+        B = 0x02,
+        Select = 0x04,
+        Start = 0x08,
+        Up = 0x10,
+        Down = 0x20,
+        Left = 0x40,
+        Right = 0x80,
+    };
+
+private:
+    std::uint8_t _buttons = 0; // held right now
+    std::uint8_t _shift = 0;
+    bool _strobe = false; // while set the shift register keeps reloading, so reads return A
+
+public:
+    void reset()
+    {
+        _shift = 0;
+        _strobe = false;
+    }
+
+    void setButtons(std::uint8_t buttons)
+    {
+        _buttons = buttons;
+        if (_strobe)
+            _shift = buttons;
+    }
+
+    std::uint8_t buttons() const { return _buttons; }
+
+    void write(std::uint8_t value)
+    {
+        _strobe = (value & 0x01) != 0;
+        if (_strobe)
+            _shift = _buttons;
+    }
+
+    // Bit 0 of the $4016/$4017 read
+    std::uint8_t read()
+    {
+        if (_strobe)
+            return _buttons & 0x01;
+        const std::uint8_t bit = _shift & 0x01;
+        _shift = static_cast<std::uint8_t>((_shift >> 1) | 0x80);
+        return bit;
+    }
+
+    template <typename Self, typename Visitor>
+    static void visitState(Self &controller, Visitor &visitor)
+    {
+        visitor.value(controller._buttons);
+        visitor.value(controller._shift);
+        visitor.value(controller._strobe);
+    }
+};
+
+struct InputEvent
+{
+    std::uint8_t port;    // 0 or 1
+    std::uint8_t buttons; // Controller::Button bits held from now on
+    std::chrono::steady_clock::time_point time{}; // when it happened, to measure latency from
+};
+
+// Controller changes on their way from the window thread to the emulator thread. Single producer,
+// single consumer, and neither side waits: a push onto a full queue fails instead.
+class InputQueue
+{
+private:
+    static constexpr std::size_t kCapacity = 64;
+
+    std::array<InputEvent, kCapacity> _events{};
+    alignas(64) std::atomic<std::size_t> _written{0};
+    alignas(64) std::atomic<std::size_t> _read{0};
+
+public:
+    // Producer side
+    bool push(InputEvent event)
+    {
+        const std::size_t written = _written.load(std::memory_order_relaxed);
+        if (written - _read.load(std::memory_order_acquire) == kCapacity)
+            return false;
+        _events[written % kCapacity] = event;
+        _written.store(written + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side; false when the queue is empty
+    bool pop(InputEvent &event)
+    {
+        const std::size_t read = _read.load(std::memory_order_relaxed);
+        if (read == _written.load(std::memory_order_acquire))
+            return false;
+        event = _events[read % kCapacity];
+        _read.store(read + 1, std::memory_order_release);
+        return true;
+    }
+};
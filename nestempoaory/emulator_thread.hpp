@@ -0,0 +1,140 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+#include "controller.hpp"
+#include "frame_mailbox.hpp"
+#include "nesemulator.hpp"
+#include "pacer.hpp"
+#include "run_ahead.hpp"
+
+// Runs an emulator on a thread of its own, so that nothing the presenting thread waits on, vsync or
+// window events, shifts emulation timing. Frames go out through a FrameMailbox, drawn by the PPU
+// straight into its buffers, and controller changes come in through an InputQueue, applied between
+// frames. Paced at the given frame rate, or as fast as the host allows while fast-forwarding; with
+// audio attached a Pacer keeps the sound in step, and with run-ahead each frame shown is one from a
+// few frames on. While it runs, the emulator belongs to the thread.
+class EmulatorThread
+{
+private:
+    NESemulator &_emulator;
+    FrameMailbox &_frames;
+    InputQueue &_input;
+    std::chrono::steady_clock::duration _period;
+    std::uint64_t _frameLimit;
+    AudioRing *_audio = nullptr;
+    Pacer *_pacer = nullptr;
+    RunAhead _runAhead{0};
+
+    std::thread _thread;
+    std::atomic<bool> _stop{false};
+    std::atomic<bool> _fastForward{false};
+    std::atomic<bool> _finished{false};
+    std::atomic<std::uint64_t> _frameCount{0};
+
+    double periodSeconds() const { return std::chrono::duration<double>(_period).count(); }
+
+    void loop()
+    {
+        _emulator.setFramebuffer(_frames.back().pixels.data());
+        auto next = std::chrono::steady_clock::now();
+        std::uint64_t frames = 0;
+        std::uint64_t inputs = 0;
+        std::chrono::steady_clock::time_point lastInput{};
+        while (!_stop.load(std::memory_order_relaxed) && !_emulator.cpuState().halted &&
+               (!_frameLimit || frames < _frameLimit))
+        {
+            InputEvent event;
+            while (_input.pop(event))
+            {
+                _emulator.setButtons(event.port, event.buttons);
+                inputs++;
+                lastInput = event.time;
+            }
+            if (_pacer)
+                _emulator.setAudioRate(_pacer->frameStarting(_audio->available()));
+
+            _runAhead.runFrame(_emulator);
+            FrameMailbox::Frame &frame = _frames.back();
+            frame.number = ++frames;
+            frame.inputs = inputs;
+            frame.lastInput = lastInput;
+            _frames.publish();
+            _emulator.setFramebuffer(_frames.back().pixels.data());
+            _frameCount.store(frames, std::memory_order_relaxed);
+
+            // Falling more than a frame behind starts the schedule over rather than rushing to catch up
+            const auto now = std::chrono::steady_clock::now();
+            next += _period;
+            const bool fastForward = _fastForward.load(std::memory_order_relaxed);
+            if (fastForward || now > next + _period)
+                next = now;
+            // Having just added its samples, the ring should hold the pacer's target and a frame. A
+            // frame more than that means the clocks are further apart than the pacer can correct, and
+            // the next frame waits for the device to catch up instead.
+            if (_pacer && !fastForward)
+            {
+                const double frameSamples = audio::kSampleRate * periodSeconds();
+                const double excess = static_cast<double>(_audio->available()) - _pacer->targetSamples() - 2 * frameSamples;
+                if (excess > 0)
+                    next += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(excess / audio::kSampleRate));
+            }
+            std::this_thread::sleep_until(next);
+        }
+        _emulator.setFramebuffer(nullptr);
+        _finished.store(true, std::memory_order_release);
+    }
+
+public:
+    // frameLimit stops the thread after that many frames; 0 runs it until stop or the CPU halts
+    EmulatorThread(NESemulator &emulator, FrameMailbox &frames, InputQueue &input, double frameRate,
+                   std::uint64_t frameLimit = 0)
+        : _emulator(emulator), _frames(frames), _input(input),
+          _period(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / frameRate))),
+          _frameLimit(frameLimit)
+    {
+    }
+
+    EmulatorThread(const EmulatorThread &) = delete;
+    EmulatorThread &operator=(const EmulatorThread &) = delete;
+    ~EmulatorThread() { stop(); }
+
+    // Sends the sound to the ring, paced by pacer, from the next start on; call while stopped
+    void setAudio(AudioRing *ring, Pacer *pacer)
+    {
+        _audio = ring;
+        _pacer = ring ? pacer : nullptr;
+        _emulator.setAudioOutput(ring);
+    }
+
+    // Shows every frame the given number of frames ahead, 0 for none, from the next start on
+    void setRunAhead(int frames) { _runAhead = RunAhead(frames); }
+
+    // Host time run-ahead took, once stopped
+    const RunAhead::Stats &runAheadStats() const { return _runAhead.stats(); }
+
+    void start()
+    {
+        _stop = false;
+        _finished = false;
+        _thread = std::thread(&EmulatorThread::loop, this);
+    }
+
+    // Waits for the frame being run to finish
+    void stop()
+    {
+        _stop = true;
+        if (_thread.joinable())
+            _thread.join();
+    }
+
+    void setFastForward(bool on) { _fastForward.store(on, std::memory_order_relaxed); }
+
+    // Set once the thread has run its frame limit or the CPU has halted
+    bool finished() const { return _finished.load(std::memory_order_acquire); }
+
+    std::uint64_t frameCount() const { return _frameCount.load(std::memory_order_relaxed); }
+};
@@ -0,0 +1,271 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "nesemulator.hpp"
+#include "work_stealing.hpp"
+
+// Runs many ROMs, or many copies of one, side by side on a work-stealing pool. Each worker keeps one
+// emulator and loads every job's ROM into it; each job's messages go to its own buffer and are printed
+// in job order once the batch is done. With --scaling the batch is run on 1, 2, 4 ... N workers to show
+// how the aggregate instruction rate grows with the cores.
+
+namespace
+{
+    enum class Budget
+    {
+        Instructions,
+        Frames,
+    };
+
+    struct Job
+    {
+        std::string rom;
+        bool loaded = false;
+        std::size_t instructions = 0;
+        std::uint64_t cycles = 0;
+        std::uint64_t frames = 0;
+        CpuState state{};
+        std::string output{};
+    };
+
+    struct Settings
+    {
+        Budget budget = Budget::Frames;
+        std::uint64_t amount = 600;
+        DispatchMode mode = DispatchMode::Tiered;
+    };
+
+    int usage()
+    {
+        std::cerr << "Usage: nes_farm [--jobs N] [--copies K] [--instructions N | --frames N]\n"
+                     "                [--dispatch table|threaded|predecoded|tiered] [--scaling] [--quiet]\n"
+                     "                (--all DIR | <rom> [<rom> ...])\n"
+                     "Runs every ROM K times (once by default) for 600 frames unless a budget is given.\n"
+                     "--all takes every DIR/*.nes; --jobs defaults to one worker per core."
+                  << std::endl;
+        return 2;
+    }
+
+    bool parseCount(const std::string &text, std::uint64_t &value)
+    {
+        char *end = nullptr;
+        value = std::strtoull(text.c_str(), &end, 10);
+        return !text.empty() && *end == '\0';
+    }
+
+    bool parseDispatch(const std::string &name, DispatchMode &mode)
+    {
+        if (name == "table")
+            mode = DispatchMode::Table;
+        else if (name == "threaded")
+            mode = DispatchMode::Threaded;
+        else if (name == "predecoded")
+            mode = DispatchMode::Predecoded;
+        else if (name == "tiered")
+            mode = DispatchMode::Tiered;
+        else
+            return false;
+        return true;
+    }
+
+    void addRoms(const std::filesystem::path &directory, std::vector<std::string> &roms)
+    {
+        std::vector<std::string> found;
+        for (const auto &entry : std::filesystem::directory_iterator(directory))
+        {
+            if (entry.path().extension() == ".nes")
+                found.push_back(entry.path().string());
+        }
+        std::sort(found.begin(), found.end());
+        roms.insert(roms.end(), found.begin(), found.end());
+    }
+
+    void runJob(Job &job, std::unique_ptr<NESemulator> &emulator, const Settings &settings)
+    {
+        std::ostringstream output;
+        if (!emulator)
+            emulator = std::make_unique<NESemulator>(job.rom);
+        emulator->setOutput(output, output);
+        emulator->setDispatchMode(settings.mode);
+        job.loaded = emulator->load(job.rom);
+        if (job.loaded)
+        {
+            const std::uint64_t startCycles = emulator->cpuState().cycles;
+            if (settings.budget == Budget::Frames)
+                job.instructions = emulator->runFrames(settings.amount);
+            else
+                job.instructions = emulator->runInstructions(static_cast<std::size_t>(settings.amount));
+            job.state = emulator->cpuState();
+            job.cycles = job.state.cycles - startCycles;
+            job.frames = emulator->frameCount();
+        }
+        emulator->setOutput(std::cout, std::cerr);
+        job.output = output.str();
+    }
+
+    // Runs every job once on the given number of workers; returns the wall time in seconds
+    double runBatch(std::vector<Job> &jobs, unsigned workers, const Settings &settings, std::size_t &stolen)
+    {
+        for (Job &job : jobs)
+            job = Job{job.rom};
+
+        WorkStealingPool pool(workers);
+        std::vector<std::unique_ptr<NESemulator>> emulators(pool.workers());
+        const auto start = std::chrono::steady_clock::now();
+        pool.run(jobs.size(), [&](std::size_t index, unsigned worker)
+                 { runJob(jobs[index], emulators[worker], settings); });
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        stolen = pool.stolen();
+        return seconds;
+    }
+
+    std::size_t totalInstructions(const std::vector<Job> &jobs)
+    {
+        std::size_t total = 0;
+        for (const Job &job : jobs)
+            total += job.instructions;
+        return total;
+    }
+
+    bool sameRun(const Job &a, const Job &b)
+    {
+        return a.loaded == b.loaded && a.instructions == b.instructions && a.cycles == b.cycles &&
+               a.state.pc == b.state.pc && a.state.a == b.state.a && a.state.x == b.state.x && a.state.y == b.state.y &&
+               a.state.sp == b.state.sp && a.state.status == b.state.status && a.state.halted == b.state.halted;
+    }
+
+    void printJob(const Job &job)
+    {
+        if (!job.loaded)
+            std::cout << job.rom << ": not loaded" << std::endl;
+        else
+        {
+            std::cout << job.rom << (job.state.halted ? ": halted after " : ": ") << job.instructions << " instructions, "
+                      << job.cycles << " cycles, " << job.frames << " frames, "
+                      << std::hex << std::uppercase << std::setfill('0')
+                      << "PC:" << std::setw(4) << job.state.pc
+                      << " A:" << std::setw(2) << static_cast<int>(job.state.a)
+                      << " X:" << std::setw(2) << static_cast<int>(job.state.x)
+                      << " Y:" << std::setw(2) << static_cast<int>(job.state.y)
+                      << " SP:" << std::setw(2) << static_cast<int>(job.state.sp)
+                      << " P:" << std::setw(2) << static_cast<int>(job.state.status)
+                      << std::dec << std::nouppercase << std::setfill(' ') << std::endl;
+        }
+        std::istringstream lines(job.output);
+        for (std::string line; std::getline(lines, line);)
+            std::cout << "  | " << line << std::endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> roms;
+    Settings settings;
+    unsigned workers = std::max(1u, std::thread::hardware_concurrency());
+    std::uint64_t copies = 1;
+    bool scaling = false;
+    bool quiet = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        std::uint64_t value = 0;
+        if (option == "--jobs" && hasValue)
+        {
+            if (!parseCount(argv[++i], value) || value == 0)
+                return usage();
+            workers = static_cast<unsigned>(value);
+        }
+        else if (option == "--copies" && hasValue)
+        {
+            if (!parseCount(argv[++i], copies) || copies == 0)
+                return usage();
+        }
+        else if ((option == "--instructions" || option == "--frames") && hasValue)
+        {
+            settings.budget = option == "--instructions" ? Budget::Instructions : Budget::Frames;
+            if (!parseCount(argv[++i], settings.amount))
+                return usage();
+        }
+        else if (option == "--dispatch" && hasValue)
+        {
+            if (!parseDispatch(argv[++i], settings.mode))
+                return usage();
+        }
+        else if (option == "--all" && hasValue)
+            addRoms(argv[++i], roms);
+        else if (option == "--scaling")
+            scaling = true;
+        else if (option == "--quiet")
+            quiet = true;
+        else if (option.rfind("--", 0) != 0)
+            roms.push_back(option);
+        else
+            return usage();
+    }
+    if (roms.empty())
+        return usage();
+
+    // Copies of a ROM are spread through the batch rather than bunched, so each shard gets a mix
+    std::vector<Job> jobs;
+    for (std::uint64_t copy = 0; copy < copies; copy++)
+    {
+        for (const std::string &rom : roms)
+            jobs.push_back(Job{rom});
+    }
+
+    std::size_t stolen = 0;
+    if (scaling)
+    {
+        double baseline = 0;
+        for (unsigned count = 1;; count = std::min(count * 2, workers))
+        {
+            const double seconds = runBatch(jobs, count, settings, stolen);
+            const double mips = seconds > 0 ? totalInstructions(jobs) / seconds / 1e6 : 0.0;
+            if (count == 1)
+                baseline = mips;
+            std::cout << std::setw(3) << count << " workers: " << std::fixed << std::setprecision(3) << seconds << " s, "
+                      << std::setprecision(2) << mips << " MIPS, "
+                      << (baseline > 0 ? mips / baseline : 0.0) << "x one worker, " << stolen << " jobs stolen" << std::endl;
+            if (count == workers)
+                break;
+        }
+    }
+    else
+    {
+        const double seconds = runBatch(jobs, workers, settings, stolen);
+        if (!quiet)
+        {
+            for (const Job &job : jobs)
+                printJob(job);
+        }
+        std::cout << jobs.size() << " runs on " << workers << " workers, " << stolen << " jobs stolen: "
+                  << std::fixed << std::setprecision(3) << seconds << " s, " << std::setprecision(2)
+                  << (seconds > 0 ? totalInstructions(jobs) / seconds / 1e6 : 0.0) << " MIPS aggregate" << std::endl;
+    }
+
+    // Copies of the same ROM have to end up in the same place, whichever worker ran them
+    bool agree = true;
+    for (std::size_t i = roms.size(); i < jobs.size(); i++)
+    {
+        if (!sameRun(jobs[i], jobs[i % roms.size()]))
+        {
+            std::cout << jobs[i].rom << ": copy " << i / roms.size() << " disagrees with the first run" << std::endl;
+            agree = false;
+        }
+    }
+    bool loaded = std::all_of(jobs.begin(), jobs.end(), [](const Job &job)
+                              { return job.loaded; });
+    return agree && loaded ? 0 : 1;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Hands finished frames from the emulator thread to the one presenting them, with no copying and no
+// waiting on either side. Of three buffers, the producer draws into one, the consumer reads another
+// and the third holds the newest finished frame between them. Publishing and taking each swap a
+// buffer with that middle one in a single exchange. A frame not taken before the next one is
+// published is overwritten, so the consumer always gets the latest.
+class FrameMailbox
+{
+public:
+    static constexpr std::size_t kWidth = 256;
+    static constexpr std::size_t kHeight = 240;
+
+    struct alignas(64) Frame
+    {
+        std::array<std::uint8_t, kWidth * kHeight> pixels{}; // NES color indices
+        std::uint64_t number = 0;                             // as counted by the producer
+        std::uint64_t inputs = 0;                             // input events applied before it, in all
+        std::chrono::steady_clock::time_point lastInput{};    // when the latest of them happened
+    };
+
+private:
+    static constexpr std::uint8_t kIndexMask = 0x03;
+    static constexpr std::uint8_t kFresh = 0x04; // the middle buffer holds a frame not yet taken
+
+    std::unique_ptr<Frame[]> _frames{new Frame[3]};
+    std::uint8_t _back = 0;
+    alignas(64) std::atomic<std::uint8_t> _middle{1};
+    alignas(64) std::uint8_t _front = 2;
+
+public:
+    // Producer side: the frame being drawn, then published once it is complete. After publish the
+    // producer has another buffer to draw into, with an older frame in it.
+    Frame &back() { return _frames[_back]; }
+
+    void publish()
+    {
+        _back = _middle.exchange(static_cast<std::uint8_t>(_back | kFresh), std::memory_order_acq_rel) & kIndexMask;
+    }
+
+    // Consumer side: the newest frame if one was published since the last take, else nullptr. It
+    // stays the consumer's, unchanged, until the next successful take.
+    const Frame *take()
+    {
+        // Only the producer changes the middle in between, and only ever to a fresh frame
+        if (!(_middle.load(std::memory_order_relaxed) & kFresh))
+            return nullptr;
+        _front = _middle.exchange(_front, std::memory_order_acq_rel) & kIndexMask;
+        return &_frames[_front];
+    }
+};
@@ -0,0 +1,460 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "audio.hpp"
+#include "emulator_thread.hpp"
+#include "nesemulator.hpp"
+#include "pacer.hpp"
+#include "profiler.hpp"
+#include "rewind.hpp"
+#include "run_ahead.hpp"
+
+// Runs a ROM for a fixed budget with no window, and no trace unless --trace asks for one, then prints
+// where the CPU ended up and how fast it got there. For regression runs and benchmarks on machines
+// without a display.
+
+namespace
+{
+    // NTSC 2A03: 21.477272 MHz master clock divided by 12
+    constexpr double kCpuClockHz = 1789772.7;
+    constexpr double kFrameRate = kCpuClockHz / 29780.5;
+
+    enum class Budget
+    {
+        Instructions,
+        Cycles,
+        Frames,
+    };
+
+    int usage()
+    {
+        std::cerr << "Usage: nes_headless <rom> [--instructions N | --cycles N | --frames N]\n"
+                     "                    [--dispatch table|threaded|predecoded|tiered] [--no-jit] [--lockstep-ppu]\n"
+                     "                    [--trace FILE] [--rewind MB] [--wav FILE] [--perf FILE] [--opcodes FILE]\n"
+                     "                    [--paced PPM] [--run-ahead N]\n"
+                     "Runs 600 frames unless a budget is given; stops early if the CPU halts.\n"
+                     "--rewind keeps every frame in a rewind buffer of MB megabytes (frame budgets only),\n"
+                     "then reports its size and how long going back to the oldest frame takes.\n"
+                     "--wav writes the sound as 48 kHz float samples to FILE (frame budgets only).\n"
+                     "--perf writes the host's hardware counters for every frame to FILE as CSV (frame budgets only).\n"
+                     "--opcodes writes how often each opcode ran and the host time it took to FILE as CSV;\n"
+                     "instructions then run one at a time through the handler table.\n"
+                     "--paced runs the frames in real time on an emulator thread, with a simulated audio device\n"
+                     "whose clock is PPM parts per million fast (or slow, if negative) and a 60 Hz display that\n"
+                     "changes a button every half second, then reports audio and input latency (frame budgets only).\n"
+                     "--run-ahead runs every frame N frames ahead and back, and reports the host time per frame, to set\n"
+                     "against a run without it (frame budgets only)."
+                  << std::endl;
+        return 2;
+    }
+
+    bool parseCount(const std::string &text, std::uint64_t &value)
+    {
+        char *end = nullptr;
+        value = std::strtoull(text.c_str(), &end, 10);
+        return !text.empty() && *end == '\0';
+    }
+
+    bool parseNumber(const std::string &text, double &value)
+    {
+        char *end = nullptr;
+        value = std::strtod(text.c_str(), &end);
+        return !text.empty() && *end == '\0';
+    }
+
+    bool parseDispatch(const std::string &name, DispatchMode &mode)
+    {
+        if (name == "table")
+            mode = DispatchMode::Table;
+        else if (name == "threaded")
+            mode = DispatchMode::Threaded;
+        else if (name == "predecoded")
+            mode = DispatchMode::Predecoded;
+        else if (name == "tiered")
+            mode = DispatchMode::Tiered;
+        else
+            return false;
+        return true;
+    }
+
+    // The pacing loop end to end without a window or a sound card: the emulator thread with a Pacer,
+    // a thread taking samples off the ring the way an audio callback would, and this one standing in
+    // for the display
+    int runPaced(NESemulator &emulator, std::uint64_t frames, double driftPpm)
+    {
+        constexpr std::size_t kCallbackSamples = 256;
+        constexpr double kDisplayRate = 60.0;
+
+        FrameMailbox mailbox;
+        InputQueue input;
+        AudioRing ring(1 << 14);
+        Pacer pacer;
+        pacer.setDeviceLatency(kCallbackSamples / static_cast<double>(audio::kSampleRate));
+        EmulatorThread emulation(emulator, mailbox, input, kFrameRate, frames);
+        emulation.setAudio(&ring, &pacer);
+
+        // Starts once the ring holds a frame past its target, as a stream opened on the first frame
+        // would, then takes a callback's worth per period of its own clock; a callback finding too few
+        // samples is an underrun, heard as a click
+        std::atomic<bool> stop{false};
+        std::uint64_t underruns = 0;
+        std::thread device([&]
+                           {
+            std::vector<float> buffer(kCallbackSamples);
+            while (!stop && ring.available() < pacer.targetSamples() + audio::kSampleRate / kFrameRate)
+                std::this_thread::sleep_for(std::chrono::microseconds(500));
+            const auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(kCallbackSamples / (audio::kSampleRate * (1.0 + driftPpm * 1e-6))));
+            auto next = std::chrono::steady_clock::now();
+            while (!stop && !emulation.finished())
+            {
+                if (ring.read(buffer.data(), kCallbackSamples) < kCallbackSamples)
+                    underruns++;
+                next += period;
+                std::this_thread::sleep_until(next);
+            } });
+
+        const auto start = std::chrono::steady_clock::now();
+        emulation.start();
+        const auto vsync = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / kDisplayRate));
+        auto next = start;
+        std::uint64_t ticks = 0, presented = 0;
+        std::uint8_t buttons = 0;
+        LatencyStats audioLatency;
+        double minScale = 2, maxScale = 0;
+        while (!emulation.finished())
+        {
+            next += vsync;
+            std::this_thread::sleep_until(next);
+            if (const FrameMailbox::Frame *frame = mailbox.take())
+            {
+                presented++;
+                pacer.framePresented(*frame);
+            }
+            if (++ticks % 30 == 0)
+            {
+                buttons ^= Controller::A;
+                input.push({0, buttons, std::chrono::steady_clock::now()});
+            }
+            // The first second is the ring filling and the rate settling
+            if (ticks > kDisplayRate)
+            {
+                audioLatency.add(pacer.audioLatency());
+                minScale = std::min(minScale, pacer.rateScale());
+                maxScale = std::max(maxScale, pacer.rateScale());
+            }
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        emulation.stop();
+        stop = true;
+        device.join();
+
+        const LatencyStats &inputToPhoton = pacer.inputToPhoton();
+        std::cout << std::fixed << std::setprecision(2)
+                  << "paced: " << emulation.frameCount() << " frames in " << seconds << " s ("
+                  << emulation.frameCount() / seconds << " fps), " << presented << " presented at "
+                  << kDisplayRate << " Hz" << std::endl
+                  << "audio: " << underruns << " underruns, " << ring.dropped() << " dropped, latency "
+                  << audioLatency.mean << " ms mean, " << audioLatency.max << " ms max, rate scale "
+                  << std::setprecision(4) << minScale << " to " << maxScale << std::endl
+                  << std::setprecision(2) << "input to photon: " << inputToPhoton.mean << " ms mean, "
+                  << inputToPhoton.max << " ms max over " << inputToPhoton.count << " changes" << std::endl;
+        return 0;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+        return usage();
+
+    std::string romPath = argv[1];
+    Budget budget = Budget::Frames;
+    std::uint64_t amount = 600;
+    DispatchMode mode = DispatchMode::Tiered;
+    bool jit = true;
+    bool lockstep = false;
+    std::string tracePath;
+    std::uint64_t rewindMegabytes = 0;
+    std::string wavPath;
+    std::string perfPath;
+    std::string opcodesPath;
+    bool paced = false;
+    double driftPpm = 0;
+    std::uint64_t runAheadFrames = 0;
+
+    for (int i = 2; i < argc; i++)
+    {
+        std::string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if ((option == "--instructions" || option == "--cycles" || option == "--frames") && hasValue)
+        {
+            budget = option == "--instructions" ? Budget::Instructions : option == "--cycles" ? Budget::Cycles : Budget::Frames;
+            if (!parseCount(argv[++i], amount))
+                return usage();
+        }
+        else if (option == "--dispatch" && hasValue)
+        {
+            if (!parseDispatch(argv[++i], mode))
+                return usage();
+        }
+        else if (option == "--trace" && hasValue)
+            tracePath = argv[++i];
+        else if (option == "--rewind" && hasValue)
+        {
+            if (!parseCount(argv[++i], rewindMegabytes) || rewindMegabytes == 0)
+                return usage();
+        }
+        else if (option == "--wav" && hasValue)
+            wavPath = argv[++i];
+        else if (option == "--perf" && hasValue)
+            perfPath = argv[++i];
+        else if (option == "--opcodes" && hasValue)
+            opcodesPath = argv[++i];
+        else if (option == "--paced" && hasValue)
+        {
+            paced = true;
+            if (!parseNumber(argv[++i], driftPpm))
+                return usage();
+        }
+        else if (option == "--run-ahead" && hasValue)
+        {
+            if (!parseCount(argv[++i], runAheadFrames) || runAheadFrames == 0 || runAheadFrames > 8)
+                return usage();
+        }
+        else if (option == "--no-jit")
+            jit = false;
+        else if (option == "--lockstep-ppu")
+            lockstep = true;
+        else
+            return usage();
+    }
+    if ((rewindMegabytes || !wavPath.empty() || !perfPath.empty() || paced || runAheadFrames) && budget != Budget::Frames)
+        return usage();
+    if (paced && (rewindMegabytes || !wavPath.empty() || !perfPath.empty() || !opcodesPath.empty() || runAheadFrames))
+        return usage();
+
+    NESemulator emulator(romPath);
+    emulator.setDispatchMode(mode);
+    emulator.setJitEnabled(jit);
+    if (lockstep)
+        emulator.setPpuSync(PpuSync::Lockstep);
+    if (!tracePath.empty() && !emulator.startTrace(tracePath))
+        return 1;
+    if (!emulator.init())
+        return 1;
+    if (paced)
+        return runPaced(emulator, amount, driftPpm);
+    std::unique_ptr<RewindBuffer> rewind;
+    if (rewindMegabytes)
+        rewind = std::make_unique<RewindBuffer>(static_cast<std::size_t>(rewindMegabytes));
+
+    // Drained into the file after every frame, so the ring never has to hold more than one
+    WavWriter wav;
+    std::unique_ptr<AudioRing> audio;
+    std::vector<float> samples;
+    std::uint64_t sampleCount = 0;
+    if (!wavPath.empty())
+    {
+        if (!wav.open(wavPath))
+        {
+            std::cerr << "Failed to open WAV file: " << wavPath << std::endl;
+            return 1;
+        }
+        audio = std::make_unique<AudioRing>(1 << 14);
+        samples.resize(audio->capacity());
+        emulator.setAudioOutput(audio.get());
+    }
+    auto drainAudio = [&]
+    {
+        if (!audio)
+            return;
+        const std::size_t count = audio->read(samples.data(), samples.size());
+        wav.write(samples.data(), count);
+        sampleCount += count;
+    };
+
+    // Host counters read around every frame, one CSV line each; without counters the host time is still there
+    std::ofstream perfFile;
+    PerfCounters counters;
+    if (!perfPath.empty())
+    {
+        perfFile.open(perfPath, std::ios::trunc);
+        if (!perfFile)
+        {
+            std::cerr << "Failed to open perf file: " << perfPath << std::endl;
+            return 1;
+        }
+        counters.open(std::cerr);
+        perfFile << "frame,cpu_cycles,cpu_instructions,host_ns";
+        for (std::size_t i = 0; i < PerfCounters::kCount; i++)
+            perfFile << ',' << PerfCounters::name(static_cast<PerfCounter>(i));
+        perfFile << '\n';
+    }
+    std::unique_ptr<OpcodeProfile> opcodes;
+    if (!opcodesPath.empty())
+    {
+        opcodes = std::make_unique<OpcodeProfile>();
+        emulator.setOpcodeProfile(opcodes.get());
+    }
+    std::unique_ptr<RunAhead> runAhead;
+    if (runAheadFrames)
+        runAhead = std::make_unique<RunAhead>(static_cast<int>(runAheadFrames));
+
+    const std::uint64_t startCycles = emulator.cpuState().cycles;
+    const auto start = std::chrono::steady_clock::now();
+    std::size_t instructions = 0;
+    switch (budget)
+    {
+    case Budget::Instructions:
+        instructions = emulator.runInstructions(static_cast<std::size_t>(amount));
+        break;
+    case Budget::Cycles:
+        instructions = emulator.runCycles(amount);
+        break;
+    case Budget::Frames:
+        if (!rewind && !audio && !perfFile.is_open() && !runAhead)
+        {
+            instructions = emulator.runFrames(amount);
+            break;
+        }
+        for (std::uint64_t frame = 0; frame < amount && !emulator.cpuState().halted; frame++)
+        {
+            const std::uint64_t frameCycles = emulator.cpuState().cycles;
+            const auto frameStart = std::chrono::steady_clock::now();
+            const PerfCounters::Sample before = counters.read();
+            const std::size_t executed = runAhead ? runAhead->runFrame(emulator) : emulator.runFrames(1);
+            const PerfCounters::Sample after = counters.read();
+            instructions += executed;
+            if (perfFile.is_open())
+            {
+                perfFile << emulator.frameCount() << ',' << emulator.cpuState().cycles - frameCycles << ',' << executed << ','
+                         << std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - frameStart).count();
+                for (std::size_t i = 0; i < PerfCounters::kCount; i++)
+                {
+                    perfFile << ',';
+                    if (counters.available(static_cast<PerfCounter>(i)))
+                        perfFile << after[i] - before[i];
+                }
+                perfFile << '\n';
+            }
+            drainAudio();
+            if (rewind && !rewind->push(emulator))
+            {
+                std::cerr << "Rewind buffer cannot hold a single state" << std::endl;
+                return 1;
+            }
+        }
+        break;
+    }
+    emulator.stopTrace();
+    emulator.setOpcodeProfile(nullptr);
+    if (audio)
+    {
+        emulator.setAudioOutput(nullptr);
+        drainAudio();
+        if (!wav.close())
+        {
+            std::cerr << "Failed to write WAV file: " << wavPath << std::endl;
+            return 1;
+        }
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    const CpuState state = emulator.cpuState();
+    const double cycles = static_cast<double>(state.cycles - startCycles);
+    const double emulatedSeconds = cycles / kCpuClockHz;
+
+    std::cout << romPath << (state.halted ? ": halted after " : ": ") << instructions << " instructions, "
+              << state.cycles - startCycles << " cycles, " << emulator.frameCount() << " frames" << std::endl;
+
+    std::cout << std::hex << std::uppercase << std::setfill('0')
+              << "PC:" << std::setw(4) << state.pc
+              << " A:" << std::setw(2) << static_cast<int>(state.a)
+              << " X:" << std::setw(2) << static_cast<int>(state.x)
+              << " Y:" << std::setw(2) << static_cast<int>(state.y)
+              << " SP:" << std::setw(2) << static_cast<int>(state.sp)
+              << " P:" << std::setw(2) << static_cast<int>(state.status)
+              << std::dec << std::nouppercase << std::setfill(' ') << std::endl;
+
+    std::cout << std::fixed << std::setprecision(3) << seconds << " s, "
+              << std::setprecision(2) << (seconds > 0 ? instructions / seconds / 1e6 : 0.0) << " MIPS, "
+              << (seconds > 0 ? emulatedSeconds / seconds : 0.0) << "x real time ("
+              << std::setprecision(3) << emulatedSeconds << " s emulated)" << std::endl;
+
+    if (audio)
+        std::cout << "audio: " << sampleCount << " samples (" << std::setprecision(3)
+                  << static_cast<double>(sampleCount) / audio::kSampleRate << " s), " << audio->dropped()
+                  << " dropped, to " << wavPath << std::endl;
+
+    if (runAhead)
+    {
+        const RunAhead::Stats &stats = runAhead->stats();
+        const double frames = static_cast<double>(std::max<std::uint64_t>(stats.frames, 1));
+        std::cout << "run-ahead " << runAhead->frames() << ": " << std::setprecision(1)
+                  << stats.microsecondsPerFrame() << " us per frame (" << stats.realNs / frames / 1e3
+                  << " the frame undrawn, " << stats.aheadNs / frames / 1e3 << " ahead, "
+                  << stats.saveLoadNs / frames / 1e3 << " saving and loading) for "
+                  << runAhead->frames() * 1000.0 / kFrameRate << " ms less lag";
+        if (stats.failed)
+            std::cout << ", " << stats.failed << " frames not restored";
+        std::cout << std::endl;
+    }
+
+    if (perfFile.is_open())
+    {
+        perfFile.close();
+        if (!perfFile)
+        {
+            std::cerr << "Failed to write perf file: " << perfPath << std::endl;
+            return 1;
+        }
+        std::cout << "perf: " << emulator.frameCount() << " frames to " << perfPath << " (";
+        const char *separator = "";
+        for (std::size_t i = 0; i < PerfCounters::kCount; i++)
+        {
+            if (counters.available(static_cast<PerfCounter>(i)))
+            {
+                std::cout << separator << PerfCounters::name(static_cast<PerfCounter>(i));
+                separator = ", ";
+            }
+        }
+        std::cout << (*separator ? ")" : "host time only)") << std::endl;
+    }
+
+    if (opcodes)
+    {
+        std::ofstream file(opcodesPath, std::ios::trunc);
+        opcodes->writeCsv(file);
+        if (!file)
+        {
+            std::cerr << "Failed to write opcode profile: " << opcodesPath << std::endl;
+            return 1;
+        }
+        int distinct = 0;
+        for (int opcode = 0; opcode < 256; opcode++)
+            distinct += opcodes->count(static_cast<std::uint8_t>(opcode)) != 0;
+        std::cout << "opcodes: " << distinct << " different opcodes to " << opcodesPath << std::endl;
+    }
+
+    if (rewind && rewind->frames())
+    {
+        const std::size_t frames = rewind->frames(), bytes = rewind->bytesUsed();
+        const auto rewindStart = std::chrono::steady_clock::now();
+        const bool restored = rewind->rewind(emulator, frames - 1);
+        const double rewindSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - rewindStart).count();
+        std::cout << "rewind: " << frames << " frames in " << std::setprecision(2) << bytes / 1048576.0 << " MB of "
+                  << rewindMegabytes << ", back " << frames - 1 << " frames "
+                  << (restored ? "in " : "failed after ") << std::setprecision(1) << rewindSeconds * 1e6 << " us" << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// The JIT emits x86-64 System V code; everywhere else the block cache runs without it
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define NES_JIT_AVAILABLE 1
+#include <sys/mman.h>
+#else
+#define NES_JIT_AVAILABLE 0
+#endif
+
+// Condition codes for jcc/setcc, low nibble of the opcode
+enum class X64Cond : std::uint8_t
+{
+    Overflow = 0x0,
+    Carry = 0x2,
+    NotCarry = 0x3,
+    Zero = 0x4,
+    NotZero = 0x5,
+};
+
+// Minimal x86-64 encoder. Every memory operand is [rbx + disp32], rbx holding the emulator instance.
+class X64Emitter
+{
+private:
+    std::vector<std::uint8_t> _code;
+
+    void byte(std::uint8_t value) { _code.push_back(value); }
+
+    void dword(std::uint32_t value)
+    {
+        for (int i = 0; i < 4; i++)
+            byte(static_cast<std::uint8_t>(value >> (8 * i)));
+    }
+
+    // ModRM for [rbx + disp32] with the given reg / opcode extension
+    void rbxOperand(std::uint8_t reg, std::int32_t disp)
+    {
+        byte(static_cast<std::uint8_t>(0x80 | (reg << 3) | 0x03));
+        dword(static_cast<std::uint32_t>(disp));
+    }
+
+public:
+    const std::vector<std::uint8_t> &code() const { return _code; }
+    std::size_t size() const { return _code.size(); }
+
+    void prologue()
+    {
+        byte(0x53);                         // push rbx
+        byte(0x48), byte(0x89), byte(0xFB); // mov rbx, rdi
+    }
+
+    void epilogue()
+    {
+        byte(0x5B); // pop rbx
+        byte(0xC3); // ret
+    }
+
+    void loadAl(std::int32_t disp) { byte(0x8A), rbxOperand(0, disp); }  // mov al, [rbx+disp]
+    void loadCl(std::int32_t disp) { byte(0x8A), rbxOperand(1, disp); }  // mov cl, [rbx+disp]
+    void storeAl(std::int32_t disp) { byte(0x88), rbxOperand(0, disp); } // mov [rbx+disp], al
+
+    void storeAlZeroExtended16(std::int32_t disp) // movzx eax, al; mov [rbx+disp], ax
+    {
+        byte(0x0F), byte(0xB6), byte(0xC0);
+        byte(0x66), byte(0x89), rbxOperand(0, disp);
+    }
+
+    void storeImm8(std::int32_t disp, std::uint8_t value) // mov byte [rbx+disp], imm8
+    {
+        byte(0xC6), rbxOperand(0, disp), byte(value);
+    }
+
+    void storeImm16(std::int32_t disp, std::uint16_t value) // mov word [rbx+disp], imm16
+    {
+        byte(0x66), byte(0xC7), rbxOperand(0, disp);
+        byte(static_cast<std::uint8_t>(value)), byte(static_cast<std::uint8_t>(value >> 8));
+    }
+
+    void incByte(std::int32_t disp) { byte(0xFE), rbxOperand(0, disp); } // inc byte [rbx+disp]
+    void decByte(std::int32_t disp) { byte(0xFE), rbxOperand(1, disp); } // dec byte [rbx+disp]
+
+    void addQwordImm8(std::int32_t disp, std::int8_t value) // add qword [rbx+disp], imm8
+    {
+        byte(0x48), byte(0x83), rbxOperand(0, disp), byte(static_cast<std::uint8_t>(value));
+    }
+
+    void movEaxImm32(std::uint32_t value) { byte(0xB8), dword(value); } // mov eax, imm32
+
+    void cmpByteZero(std::int32_t disp) { byte(0x80), rbxOperand(7, disp), byte(0x00); } // cmp byte [rbx+disp], 0
+
+    void testByteImm(std::int32_t disp, std::uint8_t mask) // test byte [rbx+disp], imm8
+    {
+        byte(0xF6), rbxOperand(0, disp), byte(mask);
+    }
+
+    void testWordImm(std::int32_t disp, std::uint16_t mask) // test word [rbx+disp], imm16
+    {
+        byte(0x66), byte(0xF7), rbxOperand(0, disp);
+        byte(static_cast<std::uint8_t>(mask)), byte(static_cast<std::uint8_t>(mask >> 8));
+    }
+
+    void setcc(X64Cond cond, std::int32_t disp) { byte(0x0F), byte(0x90 | static_cast<std::uint8_t>(cond)), rbxOperand(0, disp); }
+
+    void andAl(std::uint8_t value) { byte(0x24), byte(value); }
+    void orAl(std::uint8_t value) { byte(0x0C), byte(value); }
+    void xorAl(std::uint8_t value) { byte(0x34), byte(value); }
+    void adcAl(std::uint8_t value) { byte(0x14), byte(value); }
+    void subAl(std::uint8_t value) { byte(0x2C), byte(value); }
+    void addClImm(std::uint8_t value) { byte(0x80), byte(0xC1), byte(value); }
+
+    // Calls handler(rbx, argument)
+    void callWithInstance(const void *handler, std::uint32_t argument)
+    {
+        byte(0x48), byte(0x89), byte(0xDF); // mov rdi, rbx
+        byte(0xBE), dword(argument);        // mov esi, imm32
+        byte(0x48), byte(0xB8);             // mov rax, imm64
+        std::uint64_t target = reinterpret_cast<std::uint64_t>(handler);
+        for (int i = 0; i < 8; i++)
+            byte(static_cast<std::uint8_t>(target >> (8 * i)));
+        byte(0xFF), byte(0xD0); // call rax
+    }
+
+    // Emits a forward jcc with a 32-bit displacement and returns the patch location
+    std::size_t jccForward(X64Cond cond)
+    {
+        byte(0x0F), byte(0x80 | static_cast<std::uint8_t>(cond));
+        dword(0);
+        return _code.size();
+    }
+
+    void bindForward(std::size_t patch)
+    {
+        std::uint32_t rel = static_cast<std::uint32_t>(_code.size() - patch);
+        std::memcpy(&_code[patch - 4], &rel, sizeof(rel));
+    }
+};
+
+// Executable memory for compiled blocks, kept W^X: writable only while code is copied in
+class ExecutableArena
+{
+private:
+    std::uint8_t *_base = nullptr;
+    std::size_t _capacity = 0;
+    std::size_t _used = 0;
+
+public:
+    explicit ExecutableArena(std::size_t capacity) : _capacity(capacity)
+    {
+#if NES_JIT_AVAILABLE
+        void *memory = mmap(nullptr, _capacity, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory != MAP_FAILED)
+            _base = static_cast<std::uint8_t *>(memory);
+#endif
+    }
+
+    ~ExecutableArena()
+    {
+#if NES_JIT_AVAILABLE
+        if (_base)
+            munmap(_base, _capacity);
+#endif
+    }
+
+    ExecutableArena(const ExecutableArena &) = delete;
+    ExecutableArena &operator=(const ExecutableArena &) = delete;
+
+    // Copies code in and returns its entry point, or nullptr once the arena is full
+    void *commit(const std::vector<std::uint8_t> &code)
+    {
+#if NES_JIT_AVAILABLE
+        if (!_base || _used + code.size() > _capacity)
+            return nullptr;
+
+        if (mprotect(_base, _capacity, PROT_READ | PROT_WRITE) != 0)
+            return nullptr;
+        std::uint8_t *entry = _base + _used;
+        std::memcpy(entry, code.data(), code.size());
+        _used += (code.size() + 15) & ~std::size_t{15};
+        mprotect(_base, _capacity, PROT_READ | PROT_EXEC);
+        return entry;
+#else
+        (void)code;
+        return nullptr;
+#endif
+    }
+
+    std::size_t used() const { return _used; }
+};
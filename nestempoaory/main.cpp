@@ -1,1347 +1,353 @@
 #include <iostream>
-#include <cstdint>
 #include <string>
-#include <fstream>
 #include <vector>
 #include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <random>
 
-class NESemulator
-{
-private:
-    bool _loggingEnabled = true;
-    std::string _filePath;
-
-    ushort _programCounter;
-    std::uint8_t _A;
-    std::uint8_t _X;
-    std::uint8_t _Y;
-
-    std::uint8_t _addressBus;
-
-    std::uint8_t _header[0x10];
-    std::uint8_t _ram[0x800];
-    std::uint8_t _rom[0x8000];
-
-    bool _flagCarry;
-    bool _flagZero;
-    bool _flagInterruptDisable;
-    bool _flagDecimal;
-    bool _flagOverflow;
-    bool _flagNegative;
+#include "nesemulator.hpp"
 
-    std::uint8_t _stackPointer = 0xFF;
-
-    bool _cpuHalted = false;
-    int _cycleCount = 0;
+namespace
+{
+    // Enough instructions for about 30 frames, so that NMIs, rendering and sprite 0 hits come up
+    constexpr std::size_t kVerifyInstructions = 300000;
 
-    std::uint8_t readMemory(ushort address)
+    // NROM-128 with the program at $C000, the NMI handler at $C800 and IRQ pointing at an RTI. CHR-ROM
+    // holds a pattern rather than zeros, so that sprite 0 can hit.
+    bool writeRom(const std::filesystem::path &path, const std::vector<std::uint8_t> &program, const std::vector<std::uint8_t> &nmi)
     {
-        if (address < 0x800)
-        {
-            return _ram[address % 0x800];
-        }
-        else if (address >= 0x8000)
-        {
-            return _rom[address - 0x8000];
-        }
-        else
-        {
-            std::cerr << "Invalid memory read at address: " << std::hex << address << std::dec << std::endl;
-            return 0;
-        }
+        std::vector<std::uint8_t> prg(0x4000, 0);
+        std::copy(program.begin(), program.end(), prg.begin());
+        std::copy(nmi.begin(), nmi.end(), prg.begin() + 0x0800);
+        prg[0x3FF0] = 0x40; // RTI
+        const std::uint16_t vectors[3] = {0xC800, 0xC000, 0xFFF0};
+        for (int i = 0; i < 3; i++)
+        {
+            prg[0x3FFA + 2 * i] = static_cast<std::uint8_t>(vectors[i] & 0xFF);
+            prg[0x3FFB + 2 * i] = static_cast<std::uint8_t>(vectors[i] >> 8);
+        }
+        std::vector<std::uint8_t> chr(0x2000);
+        for (std::size_t i = 0; i < chr.size(); i++)
+            chr[i] = static_cast<std::uint8_t>(i * 37 + (i >> 4));
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        const std::uint8_t header[16] = {'N', 'E', 'S', 0x1A, 1, 1};
+        file.write(reinterpret_cast<const char *>(header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(prg.data()), static_cast<std::streamsize>(prg.size()));
+        file.write(reinterpret_cast<const char *>(chr.data()), static_cast<std::streamsize>(chr.size()));
+        return static_cast<bool>(file);
     }
 
-    void writeMemory(ushort address, std::uint8_t value)
+    // Waits for vblank twice, loads the palette, then turns on NMI and rendering, sprites included
+    std::vector<std::uint8_t> startRendering()
     {
-        _ram[address % 0x800] = value;
+        return {
+            0x78, 0xD8, 0xA2, 0xFF, 0x9A,       // SEI; CLD; LDX #$FF; TXS
+            0x2C, 0x02, 0x20, 0x10, 0xFB,       // BIT $2002; BPL -5
+            0x2C, 0x02, 0x20, 0x10, 0xFB,       // BIT $2002; BPL -5
+            0xA9, 0x3F, 0x8D, 0x06, 0x20,       // LDA #$3F; STA $2006
+            0xA9, 0x00, 0x8D, 0x06, 0x20,       // LDA #$00; STA $2006
+            0xA2, 0x00, 0x8A, 0x8D, 0x07, 0x20, // LDX #0; TXA; STA $2007
+            0xE8, 0xE0, 0x20, 0xD0, 0xF7,       // INX; CPX #$20; BNE -9
+            0xA9, 0x80, 0x8D, 0x00, 0x20,       // LDA #$80; STA $2000
+            0xA9, 0x1E, 0x8D, 0x01, 0x20,       // LDA #$1E; STA $2001
+        };
     }
 
-    void reset()
+    // Scrolls, copies page 2 into OAM and counts frames in $10
+    std::vector<std::uint8_t> nmiHandler()
     {
-        _programCounter = 0;
-        _A = 0;
-        _X = 0;
-        _Y = 0;
-        _flagCarry = false;
-        _flagZero = false;
-        _flagInterruptDisable = true; // True on purpose
-        _flagDecimal = false;
-        _flagOverflow = false;
-        _flagNegative = false;
-
-        _stackPointer = 0xFD; // Stack Pointer starts at 0xFD on reset
-
-        std::ifstream romFile(_filePath, std::ios::binary | std::ios::ate);
-        if (!romFile)
-        {
-            std::cerr << "Failed to open ROM file: " << _filePath << std::endl;
-            return;
-        }
-
-        std::streamsize size = romFile.tellg();
-        romFile.seekg(0, std::ios::beg);
-
-        // storage as uint8_t
-        std::vector<std::uint8_t> headeredRom(size);
-
-        // cast only at the read boundary
-        if (!romFile.read(reinterpret_cast<char *>(headeredRom.data()), size))
-        {
-            std::cerr << "Failed to read ROM file: " << _filePath << std::endl;
-            return;
-        }
-        romFile.close();
-
-        // Copy header (first 0x10 bytes)
-        std::copy(headeredRom.begin(),
-                  headeredRom.begin() + 0x10,
-                  _header);
-
-        // Copy ROM (next 0x8000 bytes after header)
-        std::copy(headeredRom.begin() + 0x10,
-                  headeredRom.begin() + 0x10 + 0x8000,
-                  _rom);
+        return {
+            0x48, 0xE6, 0x10, 0xA5, 0x10,       // PHA; INC $10; LDA $10
+            0x8D, 0x05, 0x20, 0x8D, 0x05, 0x20, // STA $2005; STA $2005
+            0xA9, 0x02, 0x8D, 0x14, 0x40,       // LDA #$02; STA $4014
+            0x68, 0x40,                         // PLA; RTI
+        };
+    }
 
-        // Reset vector (little-endian: low at 0xFFFC, high at 0xFFFD)
-        std::uint8_t PCL = readMemory(0xFFFC);
-        std::uint8_t PCH = readMemory(0xFFFD);
-        _programCounter = static_cast<std::uint16_t>((PCH << 8) | PCL);
+    // A main loop of indexed loads and stores crossing pages, read-modify-writes on the sprite page and
+    // polls of the PPU status, running under the NMI
+    std::vector<std::uint8_t> renderingProgram()
+    {
+        std::vector<std::uint8_t> code = startRendering();
+        const std::uint16_t loop = static_cast<std::uint16_t>(0xC000 + code.size());
+        code.insert(code.end(), {
+                                    0xA0, 0x00,       // LDY #0
+                                    0xB9, 0xF0, 0x02, // LDA $02F0,Y
+                                    0x99, 0x80, 0x03, // STA $0380,Y
+                                    0xFE, 0x00, 0x02, // INC $0200,X
+                                    0xAD, 0x02, 0x20, // LDA $2002
+                                    0x2A, 0xE8, 0xC8, // ROL A; INX; INY
+                                    0xD0, 0xEF,       // BNE -17
+                                });
+        code.insert(code.end(), {0x4C, static_cast<std::uint8_t>(loop & 0xFF), static_cast<std::uint8_t>(loop >> 8)});
+        return code;
     }
 
-    void handleOpcode(std::uint8_t opcode)
+    // Official instructions with random operands after the rendering setup, looping back at the end.
+    // Jumps land anywhere, RAM included, and stores hit the PPU and APU as they come.
+    std::vector<std::uint8_t> randomProgram(std::uint32_t seed)
     {
-        switch (opcode)
+        std::vector<std::uint8_t> code = startRendering();
+        const std::uint16_t start = static_cast<std::uint16_t>(0xC000 + code.size());
+        std::vector<std::uint8_t> opcodes;
+        for (int opcode = 0; opcode < 0x100; opcode++)
         {
-        case 0x02: // HLT
-        {
-            _cpuHalted = true;
+            if (kOpcodeTable[opcode].op != Op::ILL && kOpcodeTable[opcode].op != Op::HLT)
+                opcodes.push_back(static_cast<std::uint8_t>(opcode));
         }
-        break;
-        case 0xA0: // LDY Immediate
+        std::mt19937 random(seed);
+        while (code.size() < 0x7F0)
         {
-            _Y = readMemory(_programCounter);
-            _flagZero = (_Y == 0);
-            _flagNegative = (_Y > 127);
-
-            _programCounter++;
-            _cycleCount += 2;
+            const std::uint8_t opcode = opcodes[random() % opcodes.size()];
+            code.push_back(opcode);
+            for (int i = 0; i < operandSize(kOpcodeTable[opcode].mode); i++)
+                code.push_back(static_cast<std::uint8_t>(random()));
         }
-        break;
-        case 0xA2: // LDX Immediate
-        {
-            _X = readMemory(_programCounter);
-            _flagZero = (_X == 0);
-            _flagNegative = (_X > 127);
+        code.insert(code.end(), {0x4C, static_cast<std::uint8_t>(start & 0xFF), static_cast<std::uint8_t>(start >> 8)});
+        return code;
+    }
 
-            _programCounter++;
-            _cycleCount += 2;
-        }
-        break;
-        case 0xA5: // LDA Zero Page
-        {
-            std::uint8_t zp = readMemory(_programCounter);
-            _programCounter++;
-            _A = readMemory(zp);
-            _flagZero = (_A == 0);
-            _flagNegative = (_A & 0x80) != 0;
-            _cycleCount += 3;
-        }
-        break;
-        case 0xA9: // LDA Immediate
-        {
-            _A = readMemory(_programCounter);
-            _flagZero = (_A == 0);
-            _flagNegative = (_A > 127);
+    // Known access sequences, one instruction at a time: a load crossing a page, an indexed store, a
+    // read-modify-write, a branch crossing a page, the stack and a subroutine call
+    std::vector<std::uint8_t> busProgram()
+    {
+        std::vector<std::uint8_t> code(0x130, 0xEA);
+        const std::vector<std::uint8_t> start = {
+            0xA2, 0xFF, 0x9A, 0xA2, 0x10, // LDX #$FF; TXS; LDX #$10
+            0xBD, 0xF8, 0x02,             // LDA $02F8,X
+            0x9D, 0x00, 0x03,             // STA $0300,X
+            0xFE, 0x00, 0x04,             // INC $0400,X
+            0x4C, 0xFA, 0xC0,             // JMP $C0FA
+        };
+        std::copy(start.begin(), start.end(), code.begin());
+        code[0xFA] = 0xD0; // BNE +$10, to $C10C
+        code[0xFB] = 0x10;
+        const std::vector<std::uint8_t> end = {
+            0x48, 0x68,       // PHA; PLA
+            0x20, 0x20, 0xC1, // JSR $C120
+            0x02,             // halt
+        };
+        std::copy(end.begin(), end.end(), code.begin() + 0x10C);
+        code[0x120] = 0x60; // RTS
+        return code;
+    }
 
-            _programCounter++;
-            _cycleCount += 2;
-        }
-        break;
-        case 0xAD: // LDA Absolute
-        {
-            std::uint8_t low = readMemory(_programCounter);
-            _programCounter++;
-            std::uint8_t high = readMemory(_programCounter);
-            _programCounter++;
-            ushort addr = static_cast<ushort>((high << 8) | low);
-            _A = readMemory(addr);
-            _flagZero = (_A == 0);
-            _flagNegative = (_A & 0x80) != 0;
-            _cycleCount += 4;
-        }
-        break;
-        case 0x85: // STA Zero Page
-        {
-            std::uint8_t temp = readMemory(_programCounter);
-            _programCounter++;
-            writeMemory(temp, _A);
-            _cycleCount += 3;
-        }
-        break;
-        case 0x8D: // STA Absolute
-        {
-            std::uint8_t tempLow = readMemory(_programCounter);
-            _programCounter++;
-            std::uint8_t tempHigh = readMemory(_programCounter);
-            _programCounter++;
-            writeMemory((tempHigh << 8) | tempLow, _A);
-            _cycleCount += 4;
-        }
-        break;
-        case 0x86: // STX Zero Page
-        {
-            std::uint8_t temp = readMemory(_programCounter);
-            _programCounter++;
-            writeMemory(temp, _X);
-            _cycleCount += 3;
-        }
-        break;
-        case 0x8E: // STX Absolute
-        {
-            std::uint8_t tempLow = readMemory(_programCounter);
-            _programCounter++;
-            std::uint8_t tempHigh = readMemory(_programCounter);
-            _programCounter++;
-            writeMemory((tempHigh << 8) | tempLow, _X);
-            _cycleCount += 4;
-        }
-        break;
-        case 0x84: // STY Zero Page
-        {
-            std::uint8_t temp = readMemory(_programCounter);
-            _programCounter++;
-            writeMemory(temp, _Y);
-            _cycleCount += 3;
-        }
-        break;
-        case 0x8C: // STY Absolute
-        {
-            std::uint8_t tempLow = readMemory(_programCounter);
-            _programCounter++;
-            std::uint8_t tempHigh = readMemory(_programCounter);
-            _programCounter++;
-            writeMemory((tempHigh << 8) | tempLow, _Y);
-            _cycleCount += 4;
-        }
-        break;
-        case 0x10: // BPL Branch on Plus
-        {
-            std::uint8_t temp = readMemory(_programCounter);
-            _programCounter++;
-            _cycleCount += 2; // base cycles
-            if (!_flagNegative)
-            {
-                int signedVal = temp;
-                if (temp > 127)
-                {
-                    signedVal = temp - 256;
-                }
-                _programCounter = (ushort)(_programCounter + signedVal);
-                _cycleCount += 3; // Branch taken
-            }
-            else
-            {
-                _cycleCount += 2; // Branch not taken
-            }
-        }
-        break;
-        case 0x30: // BMI Branch on Minus
-        {
-            std::uint8_t temp = readMemory(_programCounter);
-            _programCounter++;
-            _cycleCount += 2;
-            if (_flagNegative)
-            {
-                int signedVal = temp;
-                if (temp > 127)
-                {
-                    signedVal = temp - 256;
-                }
-                _programCounter = (ushort)(_programCounter + signedVal);
-                _cycleCount += 3; // Branch taken
-            }
-            else
-            {
-                _cycleCount += 2; // Branch not taken
-            }
-        }
-        break;
-        // case 0x50: // BVC Branch on Overflow Clear
-        // {
-        // }
-        // break;
-        // case 0x70: // BVS Branch on Overflow Set
-        // {
-        // }
-        // break;
-        // case 0x90: // BCC Branch on Carry Clear
-        // {
-        // }
-        // break;
-        // case 0xB0: // BCS Branch on Carry Set
-        // {
-        // }
-        // break;
-        case 0xD0: // BNE Branch on Not Equal
-        {
-            std::uint8_t offset = readMemory(_programCounter);
-            _programCounter++;
-            _cycleCount += 2;
-            if (!_flagZero)
-            {
-                // Sign-extend 8-bit offset
-                int8_t rel = static_cast<int8_t>(offset);
-                ushort oldPC = _programCounter;
-                _programCounter = static_cast<ushort>(_programCounter + rel);
-                _cycleCount += 1;
-                if ((oldPC & 0xFF00) != (_programCounter & 0xFF00))
-                    _cycleCount += 1;
-            }
-        }
-        break;
-        case 0xF0: // BEQ Branch on Equal
-        {
-            std::uint8_t temp = readMemory(_programCounter);
-            _programCounter++;
-            _cycleCount += 2;
-            if (_flagZero)
-            {
-                int signedVal = temp;
-                if (temp > 127)
-                {
-                    signedVal = temp - 256;
-                }
-                _programCounter = (ushort)(_programCounter + signedVal);
-                _cycleCount += 3; // Branch taken
-            }
-            else
+    // Runs busProgram() with a bus hook and checks every access, its cycle counted from the first
+    bool verifyBus()
+    {
+        using Kind = BusAccess::Kind;
+        struct Expected
+        {
+            std::uint64_t cycle;
+            std::uint16_t address;
+            int value; // -1 for whatever an opcode or operand fetch reads
+            Kind kind;
+        };
+        const std::vector<Expected> expected = {
+            // LDA $02F8,X: the first read stays on page $02, the second one is paid for
+            {0, 0xC005, -1, Kind::Read}, {1, 0xC006, -1, Kind::Read}, {2, 0xC007, -1, Kind::Read},
+            {3, 0x0208, 0, Kind::DummyRead}, {4, 0x0308, 0, Kind::Read},
+            // STA $0300,X: the first read is made on the right page too
+            {5, 0xC008, -1, Kind::Read}, {6, 0xC009, -1, Kind::Read}, {7, 0xC00A, -1, Kind::Read},
+            {8, 0x0310, 0, Kind::DummyRead}, {9, 0x0310, 0, Kind::Write},
+            // INC $0400,X
+            {10, 0xC00B, -1, Kind::Read}, {11, 0xC00C, -1, Kind::Read}, {12, 0xC00D, -1, Kind::Read},
+            {13, 0x0410, 0, Kind::DummyRead}, {14, 0x0410, 0, Kind::Read},
+            {15, 0x0410, 0, Kind::DummyWrite}, {16, 0x0410, 1, Kind::Write},
+            // JMP $C0FA
+            {17, 0xC00E, -1, Kind::Read}, {18, 0xC00F, -1, Kind::Read}, {19, 0xC010, -1, Kind::Read},
+            // BNE taken to the next page: the next opcode, then the target on the old page
+            {20, 0xC0FA, -1, Kind::Read}, {21, 0xC0FB, -1, Kind::Read},
+            {22, 0xC0FC, -1, Kind::DummyRead}, {23, 0xC00C, -1, Kind::DummyRead},
+            // PHA
+            {24, 0xC10C, -1, Kind::Read}, {25, 0xC10D, -1, Kind::DummyRead}, {26, 0x01FF, 0, Kind::Write},
+            // PLA
+            {27, 0xC10D, -1, Kind::Read}, {28, 0xC10E, -1, Kind::DummyRead}, {29, 0x01FE, 0, Kind::DummyRead},
+            {30, 0x01FF, 0, Kind::Read},
+            // JSR $C120: the return address is pushed before the high byte of the target is read
+            {31, 0xC10E, -1, Kind::Read}, {32, 0xC10F, -1, Kind::Read}, {33, 0x01FF, 0, Kind::DummyRead},
+            {34, 0x01FF, 0xC1, Kind::Write}, {35, 0x01FE, 0x10, Kind::Write}, {36, 0xC110, -1, Kind::Read},
+            // RTS
+            {37, 0xC120, -1, Kind::Read}, {38, 0xC121, -1, Kind::DummyRead}, {39, 0x01FD, 0, Kind::DummyRead},
+            {40, 0x01FE, 0x10, Kind::Read}, {41, 0x01FF, 0xC1, Kind::Read}, {42, 0xC110, -1, Kind::DummyRead},
+            // the halt
+            {43, 0xC111, 0x02, Kind::Read},
+        };
+
+        const std::filesystem::path rom = std::filesystem::temp_directory_path() / ("nes_bus_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".nes");
+        if (!writeRom(rom, busProgram(), {0x40}))
+        {
+            std::cerr << "Failed to write " << rom.string() << std::endl;
+            return false;
+        }
+        NESemulator emulator(rom.string());
+        const bool loaded = emulator.init();
+        std::error_code ignored;
+        std::filesystem::remove(rom, ignored);
+        if (!loaded)
+            return false;
+
+        // Up to the first instruction checked, then every access after it
+        emulator.runInstructions(3);
+        std::vector<BusAccess> accesses;
+        emulator.setBusHook([&accesses](const BusAccess &access)
+                            { accesses.push_back(access); });
+        emulator.runInstructions(100);
+        emulator.setBusHook(nullptr);
+
+        bool ok = accesses.size() == expected.size();
+        for (std::size_t i = 0; ok && i < expected.size(); i++)
+        {
+            const BusAccess &access = accesses[i];
+            const Expected &want = expected[i];
+            if (access.cycle - accesses[0].cycle != want.cycle || access.address != want.address || access.kind != want.kind ||
+                (want.value >= 0 && access.value != want.value))
             {
-                _cycleCount += 2; // Branch not taken
+                std::cout << "Bus access " << i << " differs: cycle +" << access.cycle - accesses[0].cycle << std::hex
+                          << " address $" << access.address << " value $" << static_cast<int>(access.value) << std::dec
+                          << " kind " << static_cast<int>(access.kind) << std::endl;
+                return false;
             }
         }
-        break;
-        case 0x48: // PHA Push Accumulator
-        {
-            pushStack(_A);
-            _cycleCount += 3;
-        }
-        break;
-        case 0x68: // PLA Pull Accumulator
-        {
-            _A = pullStack();
-            _flagZero = (_A == 0);
-            _flagNegative = (_A > 127);
-            _cycleCount += 4;
-        }
-        break;
-        case 0x20: // JSR Jump to Subroutine
-        {
-            std::uint8_t low = readMemory(_programCounter);
-            _programCounter++;
-            std::uint8_t high = readMemory(_programCounter);
-            _programCounter++;
-            ushort target = static_cast<ushort>((high << 8) | low);
-
-            ushort returnAddr = static_cast<ushort>(_programCounter - 1);
-            pushStack(static_cast<std::uint8_t>(returnAddr >> 8));   // high
-            pushStack(static_cast<std::uint8_t>(returnAddr & 0xFF)); // low
+        if (!ok)
+            std::cout << "Bus accesses: " << accesses.size() << " instead of " << expected.size() << std::endl;
+        else
+            std::cout << "Bus accesses match" << std::endl;
+        return ok;
+    }
 
-            _programCounter = target;
-            _cycleCount += 6;
-        }
-        break;
-        case 0x60: // RTS Return from Subroutine
-        {
-            std::uint8_t tempLow = pullStack();
-            std::uint8_t tempHigh = pullStack();
-            _programCounter = (ushort)((tempHigh << 8) | tempLow);
-            _programCounter++;
-            _cycleCount += 6;
-        }
-        break;
-        case 0xEA: // NOP No Operation
-            _cycleCount += 2;
-            break;
-        case 0xE8: // INX Increment X
-        {
-            _X++;
-            _flagZero = (_X == 0);
-            _flagNegative = (_X > 127);
-            _cycleCount += 2;
-        }
-        break;
-        case 0xC8: // INY Increment Y
-        {
-            _Y++;
-            _flagZero = (_Y == 0);
-            _flagNegative = (_Y > 127);
-            _cycleCount += 2;
-        }
-        break;
-        case 0xCA: // DEX Decrement X
-        {
-            _X--;
-            _flagZero = (_X == 0);
-            _flagNegative = (_X > 127);
-            _cycleCount += 2;
-        }
-        break;
-        case 0x88: // DEY Decrement Y
-        {
-            _Y--;
-            _flagZero = (_Y == 0);
-            _flagNegative = (_Y > 127);
-            _cycleCount += 2;
-        }
-        break;
-        case 0xAA: // TAX Transfer Accumulator to X
-        {
-            _X = _A;
-            _flagZero = (_X == 0);
-            _flagNegative = (_X > 127);
-            _cycleCount += 2;
-        }
-        break;
-        case 0x8A: // TXA Transfer X to Accumulator
-        {
-            _A = _X;
-            _flagZero = (_A == 0);
-            _flagNegative = (_A > 127);
-            _cycleCount += 2;
-        }
-        break;
-        case 0xA8: // TAY Transfer Accumulator to Y
-        {
-            _Y = _A;
-            _flagZero = (_Y == 0);
-            _flagNegative = (_Y > 127);
-            _cycleCount += 2;
-        }
-        break;
-        case 0x98: // TYA Transfer Y to Accumulator
-        {
-            _A = _Y;
-            _flagZero = (_A == 0);
-            _flagNegative = (_A > 127);
-            _cycleCount += 2;
-        }
-        break;
-        case 0x9A: // TXS Transfer X to Stack Pointer
-        {
-            _stackPointer = _X;
-            _cycleCount += 2;
-        }
-        break;
-        case 0xBA: // TSX Transfer Stack Pointer to X
-        {
-            _X = _stackPointer;
-            _flagZero = (_X == 0);
-            _flagNegative = (_X > 127);
-            _cycleCount += 2;
+    const char *modeName(DispatchMode mode)
+    {
+        switch (mode)
+        {
+        case DispatchMode::Threaded:
+            return "threaded";
+        case DispatchMode::Predecoded:
+            return "predecoded";
+        case DispatchMode::Tiered:
+            return "tiered";
+        default:
+            return "table";
         }
-        break;
-        case 0x38: // SEC Set Carry Flag
-            _flagCarry = true;
-            _cycleCount += 2;
-            break;
-        case 0x18: // CLC Clear Carry Flag
-            _flagCarry = false;
-            _cycleCount += 2;
-            break;
-        case 0xB8: // CLV Clear Overflow Flag
-            _flagOverflow = false;
-            _cycleCount += 2;
-            break;
-        case 0x78: // SEI Set Interrupt Disable
-            _flagInterruptDisable = true;
-            _cycleCount += 2;
-            break;
-        case 0x58: // CLI Clear Interrupt Disable
-            _flagInterruptDisable = false;
-            _cycleCount += 2;
-            break;
-        case 0xF8: // SED Set Decimal Flag
-            _flagDecimal = true;
-            _cycleCount += 2;
-            break;
-        case 0xD8: // CLD Clear Decimal Flag
-            _flagDecimal = false;
-            _cycleCount += 2;
-            break;
-        case 0x08: // PHP Push Processor Status
-        {
-            std::uint8_t status =
-                (_flagNegative << 7) |
-                (_flagOverflow << 6) |
-                (1 << 5) |
-                (1 << 4) |
-                (_flagDecimal << 3) |
-                (_flagInterruptDisable << 2) |
-                (_flagZero << 1) |
-                _flagCarry;
+    }
 
-            pushStack(status);
-            _cycleCount += 3;
-        }
-        break;
-        case 0x28: // PLP Pull Processor Status
-        {
-            std::uint8_t status = pullStack();
-            _flagNegative = (status & 0x80) != 0;
-            _flagOverflow = (status & 0x40) != 0;
-            // Bit 5 ignored
-            // Bit 4 (Break) ignored internally
-            _flagDecimal = (status & 0x08) != 0;
-            _flagInterruptDisable = (status & 0x04) != 0;
-            _flagZero = (status & 0x02) != 0;
-            _flagCarry = (status & 0x01) != 0;
-            _cycleCount += 4;
-        }
-        break;
-        case 0x0A: // ASL Accumulator
-        {
-            _flagCarry = (_A > 127);
-            _A <<= 1;
-            _flagZero = (_A == 0);
-            _flagNegative = (_A > 127);
-            _cycleCount += 2;
-        }
-        break;
-        case 0x06: // ASL Zero Page
-        {
-            std::uint8_t zp = readMemory(_programCounter);
-            _programCounter++;
-            std::uint8_t v = readMemory(zp);
-            _flagCarry = (v & 0x80) != 0;
-            v <<= 1;
-            writeMemory(zp, v);
-            _flagZero = (v == 0);
-            _flagNegative = (v & 0x80) != 0;
-            _cycleCount += 5;
-        }
-        break;
-        case 0x0E: // ASL Absolute
-        {
-            std::uint8_t low = readMemory(_programCounter);
-            _programCounter++;
-            std::uint8_t high = readMemory(_programCounter);
-            _programCounter++;
-            ushort addr = static_cast<ushort>((high << 8) | low);
-            std::uint8_t v = readMemory(addr);
-            _flagCarry = (v & 0x80) != 0;
-            v <<= 1;
-            writeMemory(addr, v);
-            _flagZero = (v == 0);
-            _flagNegative = (v & 0x80) != 0;
-            _cycleCount += 6;
-        }
-        break;
-        case 0x26: // ROL Zero Page
-        {
-            std::uint8_t zp = readMemory(_programCounter);
-            _programCounter++;
-            std::uint8_t v = readMemory(zp);
-            bool oldCarry = _flagCarry;
-            _flagCarry = (v & 0x80) != 0;
-            v = static_cast<std::uint8_t>((v << 1) | (oldCarry ? 1 : 0));
-            writeMemory(zp, v);
-            _flagZero = (v == 0);
-            _flagNegative = (v & 0x80) != 0;
-            _cycleCount += 5;
-        }
-        break;
-        case 0x2E: // ROL Absolute
-        {
-            readOperandsAbsoluteAddress();
-            opROL(_addressBus, readMemory(_addressBus));
-            _cycleCount += 6;
-        }
-        break;
-        case 0x4A: // LSR Accumulator
-        {
-            _flagCarry = (_A & 0x01) != 0;
-            _A >>= 1;
-            _flagZero = (_A == 0);
-            _flagNegative = false;
-            _cycleCount += 2;
-        }
-        break;
-        case 0x46: // LSR Zero Page
-        {
-            std::uint8_t zpAddr = readMemory(_programCounter);
-            _programCounter++;
-            std::uint8_t value = readMemory(zpAddr);
-            _flagCarry = (value & 1) != 0;
-            value >>= 1;
-            writeMemory(zpAddr, value);
-            _flagZero = (value == 0);
-            _flagNegative = false; // LSR always clears negative
-            _cycleCount += 5;
-        }
-        break;
-        case 0x4E: // LSR Absolute
-        {
-            readOperandsAbsoluteAddress();
-            std::uint8_t value = readMemory(_addressBus);
-            _flagCarry = (value & 1) != 0;
-            value >>= 1;
-            writeMemory(_addressBus, value);
-            _cycleCount += 6;
-        }
-        break;
-        case 0x6A: // ROR Accumulator
-        {
-            bool oldCarry = _flagCarry;
-            _flagCarry = (_A & 0x01) != 0;
-            _A >>= 1;
-            if (oldCarry)
-                _A |= 0x80;
-            _flagZero = (_A == 0);
-            _flagNegative = (_A & 0x80) != 0;
-            _cycleCount += 2;
-        }
-        break;
-        case 0x66: // ROR Zero Page
-        {
-            std::uint8_t zpAddr = readMemory(_programCounter);
-            _programCounter++;
-            std::uint8_t value = readMemory(zpAddr);
-            bool futureFlagCarry = (value & 1) != 0;
-            value >>= 1;
-            if (_flagCarry)
-            {
-                value |= 0x80;
-            }
-            writeMemory(zpAddr, value);
-            _flagCarry = futureFlagCarry;
-            _flagZero = (value == 0);
-            _flagNegative = (value > 127);
-            _cycleCount += 5;
-        }
-        break;
-        case 0x6E: // ROR Absolute
-        {
-            readOperandsAbsoluteAddress();
-            std::uint8_t value = readMemory(_addressBus);
-            bool futureFlagCarry = (value & 1) != 0;
-            value >>= 1;
-            if (_flagCarry)
-            {
-                value |= 0x80;
-            }
-            writeMemory(_addressBus, value);
-            _flagCarry = futureFlagCarry;
-            _flagZero = (value == 0);
-            _flagNegative = (value > 127);
-            _cycleCount += 6;
-        }
-        break;
-        case 0x09: // ORA Immediate
-        {
-            std::uint8_t value = readMemory(_programCounter);
-            opORA(value);
-            _programCounter++;
-            _cycleCount += 2;
-        }
-        break;
-        case 0x05: // ORA Zero Page
-        {
-            std::uint8_t address = readMemory(_programCounter);
-            std::uint8_t value = readMemory(address);
-            opORA(value);
-            _programCounter++;
-            _cycleCount += 3;
-        }
-        break;
-        case 0x0D: // ORA Absolute
-        {
-            readOperandsAbsoluteAddress();
-            opORA(readMemory(_addressBus));
-            _cycleCount += 4;
-        }
-        break;
-        case 0x29: // AND Immediate
-        {
-            std::uint8_t value = readMemory(_programCounter);
-            opAND(value);
-            _programCounter++;
-            _cycleCount += 2;
-        }
-        break;
-        case 0x25: // AND Zero Page
-        {
-            std::uint8_t address = readMemory(_programCounter);
-            std::uint8_t value = readMemory(address);
-            opAND(value);
-            _programCounter++;
-            _cycleCount += 3;
-        }
-        break;
-        case 0x2D: // AND Absolute
-        {
-            readOperandsAbsoluteAddress();
-            opAND(readMemory(_addressBus));
-            _cycleCount += 4;
-        }
-        break;
-        case 0x49: // EOR Immediate
-        {
-            std::uint8_t value = readMemory(_programCounter);
-            opEOR(value);
-            _programCounter++;
-            _cycleCount += 2;
-        }
-        break;
-        case 0x45: // EOR Zero Page
-        {
-            std::uint8_t address = readMemory(_programCounter);
-            std::uint8_t value = readMemory(address);
-            opEOR(value);
-            _programCounter++;
-            _cycleCount += 3;
-        }
-        break;
-        case 0x4D: // EOR Absolute
-        {
-            readOperandsAbsoluteAddress();
-            opEOR(readMemory(_addressBus));
-            _cycleCount += 4;
-        }
-        break;
-        case 0xE6: // INC Zero Page
-        {
-            readOperandsAbsoluteAddress();
-            opINC(_addressBus, readMemory(_addressBus));
-            _cycleCount += 5;
-        }
-        break;
-        case 0xEE: // INC Absolute
-        {
-            readOperandsAbsoluteAddress();
-            opINC(_addressBus, readMemory(_addressBus));
-            _cycleCount += 6;
-        }
-        break;
-        case 0xC6: // DEC Zero Page
-        {
-            readOperandsAbsoluteAddress();
-            opDEC(_addressBus, readMemory(_addressBus));
-            _cycleCount += 5;
-        }
-        break;
-        case 0xCE: // DEC Absolute
-        {
-            readOperandsAbsoluteAddress();
-            opDEC(_addressBus, readMemory(_addressBus));
-            _cycleCount += 6;
-        }
-        break;
-        case 0x69: // ADC Immediate
-        {
-            std::uint8_t value = readMemory(_programCounter);
-            opADC(value);
-            _programCounter++;
-            _cycleCount += 2;
-        }
-        break;
-        case 0x65: // ADC Zero Page
-        {
-            std::uint8_t address = readMemory(_programCounter);
-            std::uint8_t value = readMemory(address);
-            opADC(value);
-            _programCounter++;
-            _cycleCount += 3;
-        }
-        break;
-        case 0x6D: // ADC Absolute
-        {
-            readOperandsAbsoluteAddress();
-            opADC(readMemory(_addressBus));
-            _cycleCount += 4;
-        }
-        break;
-        case 0xE9: // SBC Immediate
-        {
-            std::uint8_t value = readMemory(_programCounter);
-            opSBC(value);
-            _programCounter++;
-            _cycleCount += 2;
-        }
-        break;
-        case 0xE5: // SBC Zero Page
-        {
-            std::uint8_t address = readMemory(_programCounter);
-            std::uint8_t value = readMemory(address);
-            opSBC(value);
-            _programCounter++;
-            _cycleCount += 3;
-        }
-        break;
-        case 0xED: // SBC Absolute
-        {
-            readOperandsAbsoluteAddress();
-            opSBC(readMemory(_addressBus));
-            _cycleCount += 4;
-        }
-        break;
-        case 0xC9: // CMP Immediate
-        {
-            std::uint8_t value = readMemory(_programCounter);
-            opCMP(value);
-            _programCounter++;
-            _cycleCount += 2;
-        }
-        break;
-        case 0xC5: // CMP Zero Page
-        {
-            std::uint8_t address = readMemory(_programCounter);
-            std::uint8_t value = readMemory(address);
-            opCMP(value);
-            _programCounter++;
-            _cycleCount += 3;
-        }
-        break;
-        case 0xCD: // CMP Absolute
-        {
-            readOperandsAbsoluteAddress();
-            opCMP(readMemory(_addressBus));
-            _cycleCount += 4;
-        }
-        break;
-        case 0xE0: // CPX Immediate
-        {
-            std::uint8_t value = readMemory(_programCounter);
-            _flagCarry = (_X >= value);
-            _flagZero = (_X == value);
-            _flagNegative = (_X - value > 127);
-            _programCounter++;
-            _cycleCount += 2;
-        }
-        break;
-        case 0xE4: // CPX Zero Page
-        {
-            std::uint8_t address = readMemory(_programCounter);
-            std::uint8_t value = readMemory(address);
-            _flagCarry = (_X >= value);
-            _flagZero = (_X == value);
-            _flagNegative = (_X - value > 127);
-            _programCounter++;
-            _cycleCount += 3;
-        }
-        break;
-        case 0xEC: // CPX Absolute
-        {
-            readOperandsAbsoluteAddress();
-            std::uint8_t value = readMemory(_addressBus);
-            _flagCarry = (_X >= value);
-            _flagZero = (_X == value);
-            _flagNegative = (_X - value > 127);
-            _cycleCount += 4;
-        }
-        break;
-        case 0xC0: // CPY Immediate
-        {
-            std::uint8_t value = readMemory(_programCounter);
-            _flagCarry = (_Y >= value);
-            _flagZero = (_Y == value);
-            _flagNegative = (_Y - value > 127);
-            _programCounter++;
-            _cycleCount += 2;
-        }
-        break;
-        case 0xC4: // CPY Zero Page
-        {
-            std::uint8_t address = readMemory(_programCounter);
-            std::uint8_t value = readMemory(address);
-            _flagCarry = (_Y >= value);
-            _flagZero = (_Y == value);
-            _flagNegative = (_Y - value > 127);
-            _programCounter++;
-            _cycleCount += 3;
-        }
-        break;
-        case 0xCC: // CPY Absolute
-        {
-            readOperandsAbsoluteAddress();
-            std::uint8_t value = readMemory(_addressBus);
-            _flagCarry = (_Y >= value);
-            _flagZero = (_Y == value);
-            _flagNegative = (_Y - value > 127);
-            _cycleCount += 4;
-        }
-        break;
-        case 0x24: // BIT Zero Page
-        {
-            std::uint8_t address = readMemory(_programCounter);
-            std::uint8_t value = readMemory(address);
-            opBIT(value);
-            _programCounter++;
-            _cycleCount += 3;
-        }
-        break;
-        case 0x2C: // BIT Absolute
+    // Every ROM in the directory and the generated programs, in every dispatch mode, against the
+    // handler table in lockstep
+    bool verifyAllDispatch(const std::string &directory)
+    {
+        std::vector<std::string> roms;
+        for (const auto &entry : std::filesystem::directory_iterator(directory))
         {
-            readOperandsAbsoluteAddress();
-            std::uint8_t value = readMemory(_addressBus);
-            opBIT(value);
-            _cycleCount += 4;
+            if (entry.path().extension() == ".nes")
+                roms.push_back(entry.path().string());
         }
-        break;
-        case 0x00: // BRK Force Interrupt
-        {
-            _programCounter++;
-
-            std::uint16_t returnPC = _programCounter;
-
-            pushStack(static_cast<std::uint8_t>(returnPC >> 8));
-            pushStack(static_cast<std::uint8_t>(returnPC & 0xFF));
-
-            std::uint8_t status =
-                (_flagNegative << 7) |
-                (_flagOverflow << 6) |
-                (1 << 5) | // unused, always 1
-                (1 << 4) | // Break flag set
-                (_flagDecimal << 3) |
-                (_flagInterruptDisable << 2) |
-                (_flagZero << 1) |
-                _flagCarry;
+        std::sort(roms.begin(), roms.end());
 
-            pushStack(status);
-
-            // Set Interrupt Disable
-            _flagInterruptDisable = true;
-
-            std::uint8_t pcl = readMemory(0xFFFE);
-            std::uint8_t pch = readMemory(0xFFFF);
-            _programCounter = static_cast<ushort>((pch << 8) | pcl);
-
-            _cycleCount += 7;
-        }
-        break;
-        case 0x40: // RTI Return from Interrupt
-        {
-            std::uint8_t status = pullStack();
-            _flagNegative = (status & 0x80) != 0;
-            _flagOverflow = (status & 0x40) != 0;
-            // Bit 5 is ignored
-            // Bit 4 is ignored
-            _flagDecimal = (status & 0x08) != 0;
-            _flagInterruptDisable = (status & 0x04) != 0;
-            _flagZero = (status & 0x02) != 0;
-            _flagCarry = (status & 0x01) != 0;
-
-            std::uint8_t tempLow = pullStack();
-            std::uint8_t tempHigh = pullStack();
-            _programCounter = (ushort)((tempHigh << 8) | tempLow);
-            _cycleCount += 6;
-        }
-        break;
-        case 0x4C: // JMP Absolute
-        {
-            std::uint8_t tempLow = readMemory(_programCounter);
-            _programCounter++;
-            std::uint8_t tempHigh = readMemory(_programCounter);
-            _programCounter++;
-            _programCounter = (ushort)((tempHigh << 8) | tempLow);
-            _cycleCount += 3;
-        }
-        break;
-        case 0x70: // BVS Branch on Overflow Set
-        {
-            std::uint8_t temp = readMemory(_programCounter);
-            _programCounter++;
-            _cycleCount += 2;
-            if (_flagOverflow)
-            {
-                int signedVal = temp;
-                if (temp > 127)
-                {
-                    signedVal = temp - 256;
-                }
-                _programCounter = (ushort)(_programCounter + signedVal);
-                _cycleCount += 3; // Branch taken
-            }
-            else
-            {
-                _cycleCount += 2; // Branch not taken
-            }
-        }
-        break;
-        case 0xB0: // BCS Branch on Carry Set
-        {
-            std::uint8_t temp = readMemory(_programCounter);
-            _programCounter++;
-            _cycleCount += 2;
-            if (_flagCarry)
-            {
-                int signedVal = temp;
-                if (temp > 127)
-                {
-                    signedVal = temp - 256;
-                }
-                _programCounter = (ushort)(_programCounter + signedVal);
-                _cycleCount += 3; // Branch taken
-            }
-            else
-            {
-                _cycleCount += 2; // Branch not taken
-            }
-        }
-        break;
-        case 0x90: // BCC Branch on Carry Clear
-        {
-            std::uint8_t temp = readMemory(_programCounter);
-            _programCounter++;
-            _cycleCount += 2;
-            if (!_flagCarry)
-            {
-                int signedVal = temp;
-                if (temp > 127)
-                {
-                    signedVal = temp - 256;
-                }
-                _programCounter = (ushort)(_programCounter + signedVal);
-                _cycleCount += 3; // Branch taken
-            }
-            else
-            {
-                _cycleCount += 2; // Branch not taken
-            }
-        }
-        break;
-        case 0x50: // BVC Branch on Overflow Clear
+        const std::filesystem::path generated = std::filesystem::temp_directory_path() / ("nes_verify_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+        std::filesystem::create_directories(generated);
+        bool ok = writeRom(generated / "rendering.nes", renderingProgram(), nmiHandler());
+        roms.push_back((generated / "rendering.nes").string());
+        for (std::uint32_t seed = 1; seed <= 16; seed++)
         {
-            std::uint8_t temp = readMemory(_programCounter);
-            _programCounter++;
-            _cycleCount += 2;
-            if (!_flagOverflow)
-            {
-                int signedVal = temp;
-                if (temp > 127)
-                {
-                    signedVal = temp - 256;
-                }
-                _programCounter = (ushort)(_programCounter + signedVal);
-                _cycleCount += 3; // Branch taken
-            }
-            else
-            {
-                _cycleCount += 2; // Branch not taken
-            }
+            const std::filesystem::path path = generated / ("random" + std::to_string(seed) + ".nes");
+            ok = writeRom(path, randomProgram(seed), nmiHandler()) && ok;
+            roms.push_back(path.string());
         }
-        break;
-        case 0xB9: // LDA Absolute,Y
-        {
-            std::uint8_t low = readMemory(_programCounter);
-            _programCounter++;
-            std::uint8_t high = readMemory(_programCounter);
-            _programCounter++;
+        if (!ok)
+            std::cerr << "Failed to write the generated programs to " << generated.string() << std::endl;
 
-            ushort baseAddr = static_cast<ushort>((high << 8) | low);
-            ushort addr = static_cast<ushort>(baseAddr + _Y);
-
-            _A = readMemory(addr);
-            _flagZero = (_A == 0);
-            _flagNegative = (_A & 0x80) != 0;
-
-            _cycleCount += 4;
-            if ((baseAddr & 0xFF00) != (addr & 0xFF00))
-                _cycleCount += 1; // page boundary penalty
-        }
-        break;
-        case 0xBD: // LDA Absolute,X
+        for (const std::string &rom : roms)
         {
-            std::uint8_t low = readMemory(_programCounter);
-            _programCounter++;
-            std::uint8_t high = readMemory(_programCounter);
-            _programCounter++;
-
-            ushort baseAddr = static_cast<ushort>((high << 8) | low);
-            ushort addr = static_cast<ushort>(baseAddr + _X);
-
-            _A = readMemory(addr);
-            _flagZero = (_A == 0);
-            _flagNegative = (_A & 0x80) != 0;
-
-            _cycleCount += 4;
-            if ((baseAddr & 0xFF00) != (addr & 0xFF00))
-                _cycleCount += 1; // page boundary penalty
-        }
-        break;
-        case 0x6C: // JMP Indirect
-        {
-            std::uint8_t ptrLow = readMemory(_programCounter);
-            _programCounter++;
-            std::uint8_t ptrHigh = readMemory(_programCounter);
-            _programCounter++;
-            std::uint16_t ptr = (ptrHigh << 8) | ptrLow;
-
-            std::uint8_t targetLow = readMemory(ptr);
-            std::uint8_t targetHigh;
-            if ((ptr & 0x00FF) == 0x00FF)
+            for (DispatchMode mode : {DispatchMode::Table, DispatchMode::Threaded, DispatchMode::Predecoded, DispatchMode::Tiered})
             {
-                targetHigh = readMemory(ptr & 0xFF00);
+                std::cout << std::filesystem::path(rom).filename().string() << ", " << modeName(mode) << ": " << std::flush;
+                ok = NESemulator::verifyDispatch(rom, mode, kVerifyInstructions) && ok;
             }
-            else
-            {
-                targetHigh = readMemory(ptr + 1);
-            }
-            _programCounter = (ushort)((targetHigh << 8) | targetLow);
-            _cycleCount += 5;
-        }
-        break;
-        case 0x95: // STA Zero Page,X
-        {
-            std::uint8_t zpAddr = readMemory(_programCounter);
-            _programCounter++;
-            writeMemory((zpAddr + _X) & 0x00FF, _A);
-            _cycleCount += 4;
-        }
-        break;
-        case 0xb5: // LDA Zero Page,X
-        {
-            std::uint8_t zp = readMemory(_programCounter);
-            _programCounter++;
-            std::uint8_t addr = static_cast<std::uint8_t>(zp + _X);
-            _A = readMemory(addr);
-            _flagZero = (_A == 0);
-            _flagNegative = (_A & 0x80) != 0;
-            _cycleCount += 4;
-        }
-        break;
-        case 0x75: // ADC Zero Page,X
-        {
-            std::uint8_t zpAddr = readMemory(_programCounter);
-            _programCounter++;
-            std::uint8_t value = readMemory((zpAddr + _X) & 0x00FF);
-            opADC(value);
-            _cycleCount += 4;
-        }
-        break;
-        case 0x91: // STA Zero Page,Y
-        {
-            std::uint8_t zp = readMemory(_programCounter);
-            _programCounter++;
-            std::uint8_t ptrLow = readMemory(zp);
-            std::uint8_t ptrHigh = readMemory(static_cast<std::uint8_t>(zp + 1));
-            ushort base = static_cast<ushort>((ptrHigh << 8) | ptrLow);
-            ushort effective = static_cast<ushort>(base + _Y);
-            writeMemory(effective, _A);
-            _cycleCount += 6;
         }
-        break;
-        case 0x81: // STA (Indirect,X)
-        {
-            // Operand is zero-page base pointer
-            std::uint8_t zp = readMemory(_programCounter);
-            _programCounter++;
-
-            // Indexed zero-page pointer (wraps in zero page)
-            std::uint8_t ptrLow = readMemory(static_cast<std::uint8_t>(zp + _X));
-            std::uint8_t ptrHigh = readMemory(static_cast<std::uint8_t>(zp + _X + 1));
-
-            ushort effective = static_cast<ushort>((ptrHigh << 8) | ptrLow);
-            writeMemory(effective, _A);
 
-            _cycleCount += 6;
-        }
-        break;
-        default:
-            std::cerr << "Unknown opcode: " << std::hex << static_cast<int>(opcode) << std::dec << std::endl;
-            _cpuHalted = true; // Halt on unknown opcode for safety
-            break;
-        }
+        std::error_code ignored;
+        std::filesystem::remove_all(generated, ignored);
+        return ok;
     }
+}
 
-    void traceLog(std::uint8_t opcode)
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> options(argv + 1, argv + argc);
+    auto hasOption = [&options](const std::string &name)
     {
-        if (!_loggingEnabled)
-            return;
-        std::cout << "PC: " << std::hex << _programCounter
-                  << " Opcode: " << static_cast<int>(opcode)
-                  << " A: " << static_cast<int>(_A)
-                  << " X: " << static_cast<int>(_X)
-                  << " Y: " << static_cast<int>(_Y)
-                  << " SP: " << static_cast<int>(_stackPointer)
-                  << " Flags: "
-                  << (_flagNegative ? 'N' : 'n')
-                  << (_flagOverflow ? 'V' : 'v')
-                  << (_flagDecimal ? 'D' : 'd')
-                  << (_flagInterruptDisable ? 'I' : 'i')
-                  << (_flagZero ? 'Z' : 'z')
-                  << (_flagCarry ? 'C' : 'c')
-                  << std::dec
-                  << " Cycles: " << _cycleCount
-                  << std::endl;
-    }
+        return std::find(options.begin(), options.end(), name) != options.end();
+    };
+    auto optionValue = [&options](const std::string &name)
+    {
+        auto it = std::find(options.begin(), options.end(), name);
+        return it != options.end() && it + 1 != options.end() ? *(it + 1) : std::string();
+    };
 
-    void readOperandsAbsoluteAddress()
+    if (hasOption("--verify-dispatch"))
     {
-        std::uint8_t low = readMemory(_programCounter);
-        _programCounter++;
-        std::uint8_t high = readMemory(_programCounter);
-        _programCounter++;
-        _addressBus = static_cast<ushort>((high << 8) | low);
+        std::string directory = optionValue("--verify-dispatch");
+        if (directory.empty() || directory.rfind("--", 0) == 0)
+            directory = ".";
+        return verifyAllDispatch(directory) ? 0 : 1;
     }
 
-    void readOperandsIndirectAddressedXIndexed()
+    if (hasOption("--verify-bus"))
     {
-        std::uint8_t zpAddr = readMemory(_programCounter);
-        _programCounter++;
-        std::uint8_t effectiveAddrLow = readMemory((ushort)((zpAddr + _X) & 0x00FF));
-        std::uint8_t effectiveAddrHigh = readMemory((ushort)((zpAddr + _X + 1) & 0x00FF));
-        _addressBus = (ushort)((effectiveAddrHigh << 8) | effectiveAddrLow);
+        return verifyBus() ? 0 : 1;
     }
 
-    void opASL(ushort address, std::uint8_t input)
+    if (hasOption("--verify-tiles"))
     {
-        _flagCarry = (input > 127);
-        input <<= 1;
-        writeMemory(address, input);
-        _flagNegative = (input > 127);
-        _flagZero = input == 0;
+        return NESemulator::verifyTiles("7_Graphics.nes") ? 0 : 1;
     }
 
-    void opROL(ushort address, std::uint8_t input)
+    if (hasOption("--verify-audio"))
     {
-        bool futureFlagCarry = input > 127;
-        input <<= 1;
-        if (_flagCarry)
+        bool ok = true;
+        for (SimdLevel level : {SimdLevel::SSE2, SimdLevel::AVX2})
         {
-            input |= 1;
+            if (static_cast<int>(level) > static_cast<int>(tile::detectSimdLevel()))
+                break;
+            bool match = verifyStepSynth(level);
+            std::cout << (level == SimdLevel::AVX2 ? "AVX2" : "SSE2") << " step synthesizer "
+                      << (match ? "matches" : "differs from") << " the scalar one" << std::endl;
+            ok = ok && match;
         }
-
-        writeMemory(address, input);
-        _flagCarry = futureFlagCarry;
-        _flagNegative = input > 127;
-        _flagZero = input == 0;
+        return ok ? 0 : 1;
     }
 
-    void opINC(ushort address, std::uint8_t input)
-    {
-        input++;
-        writeMemory(address, input);
-        _flagNegative = (input > 127);
-        _flagZero = (input == 0);
-    }
-
-    void opDEC(ushort address, std::uint8_t input)
-    {
-        input--;
-        writeMemory(address, input);
-        _flagNegative = (input > 127);
-        _flagZero = (input == 0);
-    }
-
-    void opORA(std::uint8_t input)
-    {
-        _A |= input;
-        _flagNegative = (_A > 127);
-        _flagZero = (_A == 0);
-    }
-
-    void opAND(std::uint8_t input)
-    {
-        _A &= input;
-        _flagNegative = (_A > 127);
-        _flagZero = (_A == 0);
-    }
-
-    void opEOR(std::uint8_t input)
-    {
-        _A ^= input;
-        _flagNegative = (_A > 127);
-        _flagZero = (_A == 0);
-    }
-
-    void opADC(std::uint8_t input)
-    {
-        int sum = _A + input + (_flagCarry ? 1 : 0);
-        _flagCarry = (sum > 0xFF);
-        _flagOverflow = (~(_A ^ input) & (_A ^ sum) & 0x80) != 0;
-        _A = static_cast<std::uint8_t>(sum);
-        _flagNegative = (_A > 127);
-        _flagZero = (_A == 0);
-    }
-
-    void opSBC(std::uint8_t input)
-    {
-        uint16_t intermediate = (uint16_t)_A + ((uint16_t)(~input) & 0xFF) + (_flagCarry ? 1 : 0);
-        uint8_t result = (uint8_t)(intermediate & 0xFF);
-
-        _flagCarry = (intermediate & 0x100) != 0;
-        _flagOverflow = (((_A ^ result) & (_A ^ input) & 0x80) != 0);
-
-        _A = result;
-        _flagNegative = (_A & 0x80) != 0;
-        _flagZero = (_A == 0);
-    }
-
-    void opCMP(std::uint8_t input)
-    {
-        std::uint8_t diff = static_cast<std::uint8_t>(_A - input);
-        _flagCarry = (_A >= input);
-        _flagZero = (_A == input);
-        _flagNegative = (diff & 0x80) != 0;
-    }
-
-    void opBIT(std::uint8_t input)
-    {
-        _flagZero = (_A & input) == 0;
-        _flagNegative = (input & 0x80) != 0;
-        _flagOverflow = (input & 0x40) != 0;
-    }
-
-    void pushStack(std::uint8_t value)
+    NESemulator emulator("5_Instructions1.nes");
+    if (hasOption("--threaded"))
     {
-        writeMemory((ushort)(0x0100 + _stackPointer), value);
-        _stackPointer--;
+        emulator.setDispatchMode(DispatchMode::Threaded);
     }
-
-    std::uint8_t pullStack()
+    else if (hasOption("--predecoded"))
     {
-        _stackPointer++;
-        return readMemory((ushort)(0x0100 + _stackPointer));
+        emulator.setDispatchMode(DispatchMode::Predecoded);
     }
-
-    void emulateCPU()
+    else if (hasOption("--tiered"))
     {
-        std::uint8_t opcode = readMemory(_programCounter);
-        _programCounter++;
-        handleOpcode(opcode);
+        emulator.setDispatchMode(DispatchMode::Tiered);
     }
-
-public:
-    NESemulator(std::string filePath) : _filePath(filePath), _programCounter(0), _A(0), _X(0), _Y(0)
+    if (hasOption("--no-jit"))
     {
-        std::fill(std::begin(_ram), std::end(_ram), 0);
-        std::fill(std::begin(_rom), std::end(_rom), 0);
+        emulator.setJitEnabled(false);
     }
-
-    void init()
+    if (hasOption("--lockstep-ppu"))
     {
-        reset();
+        emulator.setPpuSync(PpuSync::Lockstep);
     }
-
-    void run()
+    std::string tracePath = optionValue("--trace");
+    if (!tracePath.empty() && !emulator.startTrace(tracePath))
     {
-        std::cout << "Starting Emulator..." << std::endl;
-
-        int i = 0;
-        while (!_cpuHalted && i < 1000)
-        {
-            traceLog(readMemory(_programCounter));
-            emulateCPU();
-            i++;
-        }
+        return 1;
     }
-};
-
-int main()
-{
-    NESemulator emulator("5_Instructions1.nes");
     emulator.init();
     emulator.run();
+    emulator.stopTrace();
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,377 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+
+#include "ppu.hpp"
+
+// Where a mapper has the cartridge's memory showing: PRG-ROM in four 8KB windows at $8000, $A000,
+// $C000 and $E000, CHR in eight 1KB pattern table windows, plus the nametable mirroring. The emulator
+// applies a layout by pointing its memory map and the PPU at these offsets; nothing is copied.
+struct BankLayout
+{
+    std::array<std::size_t, 4> prg{};
+    std::array<std::size_t, 8> chr{};
+    Mirroring mirroring = Mirroring::Horizontal;
+};
+
+// Cartridge bank switching. A mapper only keeps its registers and works out the layout they select;
+// the emulator hands it CPU writes to $8000-$FFFF and asks for the layout afterwards.
+class Mapper
+{
+protected:
+    std::size_t _prgSize;
+    std::size_t _chrSize; // CHR-ROM, or CHR-RAM when the cartridge has none
+    Mirroring _mirroring; // from the header, for mappers that leave it fixed
+
+    // Offset of the given bank, wrapped around the memory there is as the unused address lines do
+    static std::size_t bank(std::size_t number, std::size_t bankSize, std::size_t memorySize)
+    {
+        return number * bankSize % memorySize;
+    }
+
+    void setPrg16(BankLayout &layout, int window, std::size_t number) const
+    {
+        layout.prg[window] = bank(number * 2, 0x2000, _prgSize);
+        layout.prg[window + 1] = bank(number * 2 + 1, 0x2000, _prgSize);
+    }
+
+    void setChr4(BankLayout &layout, int window, std::size_t number) const
+    {
+        for (int i = 0; i < 4; i++)
+            layout.chr[window + i] = bank(number * 4 + i, 0x400, _chrSize);
+    }
+
+    void setChr8(BankLayout &layout, std::size_t number) const
+    {
+        setChr4(layout, 0, number * 2);
+        setChr4(layout, 4, number * 2 + 1);
+    }
+
+public:
+    Mapper(std::size_t prgSize, std::size_t chrSize, Mirroring mirroring)
+        : _prgSize(prgSize), _chrSize(chrSize), _mirroring(mirroring)
+    {
+    }
+
+    virtual ~Mapper() = default;
+
+    // Registers as at power-on
+    virtual void reset() = 0;
+
+    virtual void write(std::uint16_t address, std::uint8_t value) = 0;
+
+    virtual BankLayout layout() const = 0;
+
+    // The registers as raw bytes, for save-states
+    virtual std::uint8_t *registers() = 0;
+    virtual std::size_t registersSize() const = 0;
+
+    // Mappers with a scanline counter are clocked once per rendered line, and tell how many more
+    // clocks it takes for them to raise IRQ (0 when they will not)
+    virtual bool countsScanlines() const { return false; }
+    virtual void clockScanlines(std::uint32_t) {}
+    virtual std::uint32_t scanlinesUntilIrq() const { return 0; }
+    virtual bool irq() const { return false; }
+
+    static std::unique_ptr<Mapper> create(unsigned number, std::size_t prgSize, std::size_t chrSize, Mirroring mirroring);
+};
+
+template <typename Registers>
+class MapperWith : public Mapper
+{
+protected:
+    Registers _registers{};
+
+public:
+    using Mapper::Mapper;
+
+    void reset() override { _registers = Registers{}; }
+
+    std::uint8_t *registers() override { return reinterpret_cast<std::uint8_t *>(&_registers); }
+    // An empty struct still has a byte, one that is never written; mappers without registers save none
+    std::size_t registersSize() const override { return std::is_empty<Registers>::value ? 0 : sizeof(Registers); }
+};
+
+// Mapper 0: 16KB or 32KB of PRG, a 16KB image showing at both $8000 and $C000
+struct NromRegisters
+{
+};
+
+class NromMapper : public MapperWith<NromRegisters>
+{
+public:
+    using MapperWith::MapperWith;
+
+    void write(std::uint16_t, std::uint8_t) override {}
+
+    BankLayout layout() const override
+    {
+        BankLayout layout;
+        for (int window = 0; window < 4; window++)
+            layout.prg[window] = bank(window, 0x2000, _prgSize);
+        setChr8(layout, 0);
+        layout.mirroring = _mirroring;
+        return layout;
+    }
+};
+
+// Mapper 1: MMC1. Registers are loaded a bit at a time through a 5-bit shift register; the address
+// of the fifth write picks the register
+struct Mmc1Registers
+{
+    std::uint8_t shift = 0;
+    std::uint8_t shiftCount = 0;
+    std::uint8_t control = 0x0C; // PRG mode 3: last bank fixed at $C000
+    std::uint8_t chr0 = 0;
+    std::uint8_t chr1 = 0;
+    std::uint8_t prg = 0;
+};
+
+class Mmc1Mapper : public MapperWith<Mmc1Registers>
+{
+public:
+    using MapperWith::MapperWith;
+
+    void write(std::uint16_t address, std::uint8_t value) override
+    {
+        Mmc1Registers &r = _registers;
+        if (value & 0x80)
+        {
+            r.shift = r.shiftCount = 0;
+            r.control |= 0x0C;
+            return;
+        }
+        r.shift |= static_cast<std::uint8_t>((value & 0x01) << r.shiftCount);
+        if (++r.shiftCount < 5)
+            return;
+
+        switch ((address >> 13) & 0x03)
+        {
+        case 0:
+            r.control = r.shift;
+            break;
+        case 1:
+            r.chr0 = r.shift;
+            break;
+        case 2:
+            r.chr1 = r.shift;
+            break;
+        case 3:
+            r.prg = r.shift & 0x0F;
+            break;
+        }
+        r.shift = r.shiftCount = 0;
+    }
+
+    BankLayout layout() const override
+    {
+        static constexpr Mirroring mirroring[] = {Mirroring::SingleScreenLow, Mirroring::SingleScreenHigh,
+                                                  Mirroring::Vertical, Mirroring::Horizontal};
+        const Mmc1Registers &r = _registers;
+        BankLayout layout;
+        switch ((r.control >> 2) & 0x03)
+        {
+        case 0:
+        case 1:
+            setPrg16(layout, 0, r.prg & ~1);
+            setPrg16(layout, 2, r.prg | 1);
+            break;
+        case 2:
+            setPrg16(layout, 0, 0);
+            setPrg16(layout, 2, r.prg);
+            break;
+        case 3:
+            setPrg16(layout, 0, r.prg);
+            setPrg16(layout, 2, _prgSize / 0x4000 - 1);
+            break;
+        }
+        if (r.control & 0x10)
+        {
+            setChr4(layout, 0, r.chr0);
+            setChr4(layout, 4, r.chr1);
+        }
+        else
+            setChr8(layout, r.chr0 >> 1);
+        layout.mirroring = mirroring[r.control & 0x03];
+        return layout;
+    }
+};
+
+// Mapper 2: UxROM. Any write picks the 16KB bank at $8000; the last bank stays at $C000
+struct UxromRegisters
+{
+    std::uint8_t prg = 0;
+};
+
+class UxromMapper : public MapperWith<UxromRegisters>
+{
+public:
+    using MapperWith::MapperWith;
+
+    void write(std::uint16_t, std::uint8_t value) override { _registers.prg = value; }
+
+    BankLayout layout() const override
+    {
+        BankLayout layout;
+        setPrg16(layout, 0, _registers.prg);
+        setPrg16(layout, 2, _prgSize / 0x4000 - 1);
+        setChr8(layout, 0);
+        layout.mirroring = _mirroring;
+        return layout;
+    }
+};
+
+// Mapper 3: CNROM. Any write picks the 8KB CHR bank
+struct CnromRegisters
+{
+    std::uint8_t chr = 0;
+};
+
+class CnromMapper : public MapperWith<CnromRegisters>
+{
+public:
+    using MapperWith::MapperWith;
+
+    void write(std::uint16_t, std::uint8_t value) override { _registers.chr = value; }
+
+    BankLayout layout() const override
+    {
+        BankLayout layout;
+        for (int window = 0; window < 4; window++)
+            layout.prg[window] = bank(window, 0x2000, _prgSize);
+        setChr8(layout, _registers.chr);
+        layout.mirroring = _mirroring;
+        return layout;
+    }
+};
+
+// Mapper 4: MMC3. Eight bank registers picked through $8000, mirroring at $A000, and a scanline
+// counter at $C000-$E001 that raises IRQ when it reaches zero
+struct Mmc3Registers
+{
+    std::uint8_t bankSelect = 0;
+    std::array<std::uint8_t, 8> banks{};
+    std::uint8_t mirroring = 0;
+    std::uint8_t irqLatch = 0;
+    std::uint8_t irqCounter = 0;
+    bool irqReload = false;
+    bool irqEnabled = false;
+    bool irqAsserted = false;
+};
+
+class Mmc3Mapper : public MapperWith<Mmc3Registers>
+{
+public:
+    using MapperWith::MapperWith;
+
+    void write(std::uint16_t address, std::uint8_t value) override
+    {
+        Mmc3Registers &r = _registers;
+        const bool odd = address & 0x01;
+        switch (address & 0xE000)
+        {
+        case 0x8000:
+            if (odd)
+                r.banks[r.bankSelect & 0x07] = value;
+            else
+                r.bankSelect = value;
+            break;
+        case 0xA000:
+            if (!odd)
+                r.mirroring = value & 0x01; // odd: PRG-RAM protect, not emulated
+            break;
+        case 0xC000:
+            if (odd)
+            {
+                r.irqCounter = 0;
+                r.irqReload = true;
+            }
+            else
+                r.irqLatch = value;
+            break;
+        case 0xE000:
+            r.irqEnabled = odd;
+            if (!odd)
+                r.irqAsserted = false;
+            break;
+        }
+    }
+
+    BankLayout layout() const override
+    {
+        const Mmc3Registers &r = _registers;
+        const std::size_t secondLast = _prgSize / 0x2000 - 2;
+        BankLayout layout;
+        const bool prgSwap = r.bankSelect & 0x40;
+        layout.prg[0] = bank(prgSwap ? secondLast : r.banks[6], 0x2000, _prgSize);
+        layout.prg[1] = bank(r.banks[7], 0x2000, _prgSize);
+        layout.prg[2] = bank(prgSwap ? r.banks[6] : secondLast, 0x2000, _prgSize);
+        layout.prg[3] = bank(secondLast + 1, 0x2000, _prgSize);
+
+        // R0 and R1 are 2KB banks, R2-R5 1KB; inversion swaps the two halves of the pattern tables
+        const int inverted = (r.bankSelect & 0x80) ? 4 : 0;
+        for (int i = 0; i < 2; i++)
+        {
+            layout.chr[inverted + 2 * i] = bank(r.banks[i] & 0xFE, 0x400, _chrSize);
+            layout.chr[inverted + 2 * i + 1] = bank(r.banks[i] | 0x01, 0x400, _chrSize);
+        }
+        for (int i = 0; i < 4; i++)
+            layout.chr[(inverted ^ 4) + i] = bank(r.banks[2 + i], 0x400, _chrSize);
+        layout.mirroring = r.mirroring ? Mirroring::Horizontal : Mirroring::Vertical;
+        return layout;
+    }
+
+    bool countsScanlines() const override { return true; }
+
+    void clockScanlines(std::uint32_t count) override
+    {
+        Mmc3Registers &r = _registers;
+        for (; count; count--)
+        {
+            if (r.irqCounter == 0 || r.irqReload)
+            {
+                r.irqCounter = r.irqLatch;
+                r.irqReload = false;
+            }
+            else
+                r.irqCounter--;
+            if (r.irqCounter == 0 && r.irqEnabled)
+                r.irqAsserted = true;
+        }
+    }
+
+    std::uint32_t scanlinesUntilIrq() const override
+    {
+        const Mmc3Registers &r = _registers;
+        if (!r.irqEnabled || r.irqAsserted)
+            return 0;
+        if (r.irqCounter == 0 || r.irqReload)
+            return r.irqLatch + 1u;
+        return r.irqCounter;
+    }
+
+    bool irq() const override { return _registers.irqAsserted; }
+};
+
+inline std::unique_ptr<Mapper> Mapper::create(unsigned number, std::size_t prgSize, std::size_t chrSize, Mirroring mirroring)
+{
+    switch (number)
+    {
+    case 0:
+        return std::make_unique<NromMapper>(prgSize, chrSize, mirroring);
+    case 1:
+        return std::make_unique<Mmc1Mapper>(prgSize, chrSize, mirroring);
+    case 2:
+        return std::make_unique<UxromMapper>(prgSize, chrSize, mirroring);
+    case 3:
+        return std::make_unique<CnromMapper>(prgSize, chrSize, mirroring);
+    case 4:
+        return std::make_unique<Mmc3Mapper>(prgSize, chrSize, mirroring);
+    default:
+        return nullptr;
+    }
+}
@@ -0,0 +1,2403 @@
+#pragma once
+
+#include <iostream>
+#include <cstdint>
+#include <string>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <utility>
+#include <limits>
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+#include "apu.hpp"
+#include "controller.hpp"
+#include "jit_x64.hpp"
+#include "mapper.hpp"
+#include "opcodes.hpp"
+#include "ppu.hpp"
+#include "profiler.hpp"
+#include "rom_image.hpp"
+#include "savestate.hpp"
+#include "trace.hpp"
+
+// Labels-as-values is a GCC/Clang extension; build with -DNES_THREADED_DISPATCH=0 to leave it out
+#ifndef NES_THREADED_DISPATCH
+#if defined(__GNUC__) || defined(__clang__)
+#define NES_THREADED_DISPATCH 1
+#else
+#define NES_THREADED_DISPATCH 0
+#endif
+#endif
+
+enum class PpuSync
+{
+    Lockstep, // PPU caught up after every instruction
+    CatchUp,  // PPU only runs when the CPU touches it or an NMI comes due
+};
+
+// Registers and counters between instructions, for callers outside the emulator
+struct CpuState
+{
+    std::uint16_t pc;
+    std::uint8_t a, x, y, sp, status;
+    std::uint64_t cycles;
+    bool halted;
+};
+
+// One CPU bus access, as a bus hook sees it. The cycle is the one the access takes on the bus: an
+// instruction starting at cycle n fetches its opcode at n, and the cycles the 6502 spends inside come
+// as dummy reads, so every cycle of an instruction has one access. The emulation still runs the PPU
+// and APU to the end of the instruction before any register access; DMC sample reads do not stall
+// the CPU, so one can share its cycle with a CPU access.
+struct BusAccess
+{
+    enum class Kind : std::uint8_t
+    {
+        Read,
+        Write,
+        DummyRead,  // a read thrown away: the indexed address before its high byte is fixed up, or an internal cycle
+        DummyWrite, // read-modify-write storing the old value back before the new one
+    };
+
+    std::uint64_t cycle;
+    std::uint16_t address;
+    std::uint8_t value;
+    Kind kind;
+};
+
+using BusHook = std::function<void(const BusAccess &access)>;
+
+enum class DispatchMode
+{
+    Table,      // one indirect call per instruction through the handler table
+    Threaded,   // computed goto, every handler jumps straight to the next one
+    Predecoded, // basic blocks decoded once and replayed from the block cache
+    Tiered,     // block cache, with hot PRG-ROM blocks compiled to native x86-64
+};
+
+class NESemulator
+{
+private:
+    bool _loggingEnabled = false; // set while a trace is being recorded
+    std::unique_ptr<TraceRecorder> _trace;
+    OpcodeProfile *_opcodeProfile = nullptr; // set while opcodes are being profiled
+    BusHook _busHook;                        // set while bus accesses are being watched
+    DispatchMode _dispatchMode = DispatchMode::Table;
+    std::string _filePath;
+    std::ostream *_out = &std::cout;    // per instance, so emulators on other threads keep their output apart
+    std::ostream *_errors = &std::cerr;
+
+    ushort _programCounter;
+    std::uint8_t _A;
+    std::uint8_t _X;
+    std::uint8_t _Y;
+
+    std::shared_ptr<const RomImage> _image; // shared with every other instance running the cartridge
+    std::uint64_t _romId = 0; // FNV-1a of the ROM file, tying save-states to it
+    std::unique_ptr<Mapper> _mapper;
+    BankLayout _bankLayout; // what the memory map and the PPU point at right now
+    bool _bankLayoutApplied = false;
+    std::uint8_t _ram[0x800];
+
+    // Z and N are derived on demand from the last result: Z when its low byte is zero, N when bit 7
+    // (or bit 8, which lets PLP/BIT express N and Z together) is set. V is set when _overflowBits is nonzero.
+    bool _flagCarry;
+    bool _flagInterruptDisable;
+    bool _flagDecimal;
+    std::uint16_t _nzResult;
+    std::uint8_t _overflowBits;
+
+    std::uint8_t _stackPointer = 0xFF;
+
+    bool _cpuHalted = false;
+    std::uint64_t _cycleCount = 0; // CPU cycles since reset, the clock the PPU and APU are run to
+    bool _nmiPending = false;
+    std::uint64_t _interruptCycle = std::numeric_limits<std::uint64_t>::max(); // when the last one was taken
+
+    PPU _ppu;
+    PpuSync _ppuSync = PpuSync::CatchUp;
+    std::uint64_t _ppuDeadline = 0; // CPU cycle at which the PPU has to be caught up next
+    std::vector<std::uint8_t> _chr; // CHR-RAM when the cartridge has no CHR-ROM, else empty
+    APU _apu;
+    std::array<Controller, 2> _controllers;
+
+    // The PPU runs 3 dots per CPU cycle. It starts at dot 7 at power-up and the 7-cycle reset
+    // sequence adds 21 more, as in the reference traces.
+    static constexpr std::uint64_t kResetCycles = 7;
+    static constexpr std::uint64_t kPpuDotsAtReset = 7 + 3 * kResetCycles;
+
+    using MicroOpHandler = void (*)(NESemulator &, std::uint16_t);
+    using JitBlock = std::uint32_t (*)(NESemulator *); // returns the number of ops it ran
+
+    // One instruction with its operand bytes already extracted
+    struct DecodedOp
+    {
+        MicroOpHandler handler;
+        std::uint16_t operand;
+        std::uint16_t nextPC;
+        std::uint8_t cycles;
+        std::uint8_t opcode;
+    };
+
+    // Straight-line run of instructions ending at the first control transfer
+    struct DecodedBlock
+    {
+        std::vector<DecodedOp> ops;
+        std::uint32_t cycles = 0; // summed base cycles of all ops
+
+        // Last two successors (taken / fall-through), valid while the cache generation matches
+        struct Exit
+        {
+            std::uint16_t pc = 0;
+            std::uint32_t generation = 0;
+            DecodedBlock *block = nullptr;
+        };
+        std::array<Exit, 2> exits;
+        std::uint8_t nextExit = 0;
+
+        std::uint16_t startPC = 0;
+        std::uint32_t executions = 0;
+        JitBlock native = nullptr;
+    };
+
+    // Blocks are looked up by start address through a two-level table, one lazily allocated page of 256 entries per CPU page
+    struct BlockPage
+    {
+        std::array<std::unique_ptr<DecodedBlock>, 0x100> blocks;
+    };
+
+    static constexpr std::size_t kMaxBlockBytes = 0x80; // keeps a block within two pages
+
+    std::array<std::unique_ptr<BlockPage>, 0x100> _blockPages;
+    std::vector<std::unique_ptr<BlockPage>> _retiredBlockPages;
+    std::uint8_t _ramCodePages = 0; // bit per 256-byte RAM page that has decoded code in it
+    bool _codeInvalidated = false;
+    bool _exitBlock = false; // set when the running block has to stop after the current op
+    std::uint32_t _blockGeneration = 1; // bumped on every invalidation so stale block links are never followed
+
+    static constexpr std::size_t kJitArenaBytes = 1 << 20;
+    std::unique_ptr<ExecutableArena> _jitArena;
+    std::uint32_t _jitThreshold = 64; // block executions before it is compiled
+    bool _jitEnabled = true;
+
+    using BusRead = std::uint8_t (*)(NESemulator &, std::uint16_t);
+    using BusWrite = void (*)(NESemulator &, std::uint16_t, std::uint8_t);
+
+    // One 256-byte page of the CPU address space. Plain memory is accessed through the direct pointers;
+    // a null pointer sends the access to the handler instead (I/O registers, ROM writes, RAM holding code).
+    struct MemoryPage
+    {
+        const std::uint8_t *read;
+        std::uint8_t *write;
+        BusRead readHandler;
+        BusWrite writeHandler;
+    };
+
+    std::array<MemoryPage, 0x100> _memoryMap;
+    std::array<MemoryPage, 0x100> _hookedMap; // the real map while a bus hook has _memoryMap to itself
+    bool _dummyAccess = false;                // set around a dummy read or write
+    std::uint64_t _busCycle = 0;              // the cycle the next hooked access is stamped with
+    std::uint8_t _prgRam[0x2000]; // cartridge RAM at $6000-$7FFF
+
+    // The map that says what is at each page, whether or not a bus hook is in front of it
+    std::array<MemoryPage, 0x100> &pageMap() { return _busHook ? _hookedMap : _memoryMap; }
+    const std::array<MemoryPage, 0x100> &pageMap() const { return _busHook ? _hookedMap : _memoryMap; }
+
+    std::uint8_t readMemory(ushort address)
+    {
+        const MemoryPage &page = _memoryMap[address >> 8];
+        if (page.read)
+            return page.read[address & 0xFF];
+        return page.readHandler(*this, address);
+    }
+
+    void writeMemory(ushort address, std::uint8_t value)
+    {
+        const MemoryPage &page = _memoryMap[address >> 8];
+        if (page.write)
+            page.write[address & 0xFF] = value;
+        else
+            page.writeHandler(*this, address, value);
+    }
+
+    // The PPU, APU and controller registers: the only addresses where a dummy access can be noticed,
+    // acknowledging vblank or the frame IRQ, stepping $2007 or a controller. RAM and ROM, with their
+    // direct pointers, skip it at the cost of one test.
+    static bool isRegister(std::uint16_t address)
+    {
+        return address >= 0x2000 && address < 0x4020;
+    }
+
+    void dummyRead(std::uint16_t address)
+    {
+        if (!_memoryMap[address >> 8].read && (isRegister(address) || _busHook))
+        {
+            _dummyAccess = true;
+            readMemory(address);
+            _dummyAccess = false;
+        }
+    }
+
+    void dummyWrite(std::uint16_t address, std::uint8_t value)
+    {
+        if (!_memoryMap[address >> 8].write && (isRegister(address) || _busHook))
+        {
+            _dummyAccess = true;
+            writeMemory(address, value);
+            _dummyAccess = false;
+        }
+    }
+
+    // What _memoryMap points every page at while a bus hook is attached: the access goes on to the
+    // real map in _hookedMap and is passed to the hook. Dummy accesses the hardware could not notice
+    // are only passed to the hook.
+    static std::uint8_t readHooked(NESemulator &nes, std::uint16_t address)
+    {
+        const bool dummy = std::exchange(nes._dummyAccess, false);
+        const MemoryPage &page = nes._hookedMap[address >> 8];
+        std::uint8_t value = 0;
+        if (page.read)
+            value = page.read[address & 0xFF];
+        else if (!dummy || isRegister(address))
+            value = page.readHandler(nes, address);
+        nes._busHook({nes._busCycle++, address, value, dummy ? BusAccess::Kind::DummyRead : BusAccess::Kind::Read});
+        return value;
+    }
+
+    // Writes are passed on before they land, so that what one sets off, an OAM DMA say, comes after it
+    static void writeHooked(NESemulator &nes, std::uint16_t address, std::uint8_t value)
+    {
+        const bool dummy = std::exchange(nes._dummyAccess, false);
+        nes._busHook({nes._busCycle++, address, value, dummy ? BusAccess::Kind::DummyWrite : BusAccess::Kind::Write});
+        if (dummy && !isRegister(address))
+            return;
+        const MemoryPage &page = nes._hookedMap[address >> 8];
+        if (page.write)
+            page.write[address & 0xFF] = value;
+        else
+            page.writeHandler(nes, address, value);
+    }
+
+    // PPU registers, mirrored every 8 bytes through $3FFF. The PPU is brought up to the current
+    // cycle first; handlers run with the accessing instruction's cycles already counted.
+    // Status flags like sprite 0 hit are only seen through here, so they need no deadline of their own.
+    static std::uint8_t readPPURegister(NESemulator &nes, std::uint16_t address)
+    {
+        nes.syncPPU();
+        return nes._ppu.readRegister(address);
+    }
+
+    // A write can move the next NMI, so a block running it stops here for the deadline to be checked
+    static void writePPURegister(NESemulator &nes, std::uint16_t address, std::uint8_t value)
+    {
+        nes.syncPPU();
+        nes._ppu.writeRegister(address, value);
+        nes.updatePpuDeadline();
+        nes._exitBlock = true;
+    }
+
+    // APU and controller registers at $4000-$401F; the rest of the page is unmapped
+    static std::uint8_t readIORegister(NESemulator &nes, std::uint16_t address)
+    {
+        if (address >= 0x4020)
+            return readUnmapped(nes, address);
+        if (address == 0x4015)
+        {
+            nes.syncAPU();
+            std::uint8_t status = nes._apu.readStatus();
+            nes.updatePpuDeadline();
+            return status;
+        }
+        // Only bit 0 is driven; the rest is open bus, which after an absolute read still holds the $40
+        // of the address
+        if (address == 0x4016 || address == 0x4017)
+            return static_cast<std::uint8_t>(0x40 | nes._controllers[address - 0x4016].read());
+        return 0;
+    }
+
+    // The APU is caught up before a write lands; writes that can move its IRQ stop the running block.
+    // $4016 strobes both controllers.
+    static void writeIORegister(NESemulator &nes, std::uint16_t address, std::uint8_t value)
+    {
+        if (address == 0x4014)
+            nes.oamDma(value);
+        else if (address == 0x4016)
+        {
+            nes._controllers[0].write(value);
+            nes._controllers[1].write(value);
+        }
+        else if (address < 0x4018)
+        {
+            nes.syncAPU();
+            nes._apu.writeRegister(address, value, [&nes](std::uint16_t sample)
+                                   { return nes.readSample(sample); });
+            if (address == 0x4010 || address == 0x4015 || address == 0x4017)
+            {
+                nes.updatePpuDeadline();
+                nes._exitBlock = true;
+            }
+        }
+    }
+
+    // Writes to $8000-$FFFF go to the mapper. The PPU is caught up first, as the write can switch
+    // CHR banks or mirroring under it, and a PRG switch may replace the code that is running.
+    static void writeMapper(NESemulator &nes, std::uint16_t address, std::uint8_t value)
+    {
+        nes.syncPPU();
+        nes._mapper->write(address, value);
+        nes.applyBankLayout();
+        nes.updatePpuDeadline();
+        nes._exitBlock = true;
+    }
+
+    // Points the memory map and the PPU at the banks the mapper selects, touching only what changed
+    void applyBankLayout()
+    {
+        const BankLayout layout = _mapper->layout();
+        for (int window = 0; window < 4; window++)
+        {
+            if (!_bankLayoutApplied || layout.prg[window] != _bankLayout.prg[window])
+                mapPrgBank(static_cast<std::uint16_t>(0x8000 + window * 0x2000), _image->prg() + layout.prg[window], 0x2000);
+        }
+        for (int window = 0; window < 8; window++)
+            _ppu.mapChr(window, layout.chr[window]);
+        if (!_bankLayoutApplied || layout.mirroring != _bankLayout.mirroring)
+            _ppu.setMirroring(layout.mirroring);
+        _bankLayout = layout;
+        _bankLayoutApplied = true;
+    }
+
+    // Copies a 256-byte CPU page into OAM; the CPU is stalled for 513 cycles, 514 from an odd cycle
+    void oamDma(std::uint8_t page)
+    {
+        syncPPU();
+        // After a halt cycle, and one more to line up with a read cycle, every byte is read, then
+        // written to $2004
+        _busCycle = _cycleCount + 1 + (_cycleCount & 1);
+        for (int i = 0; i < 0x100; i++)
+        {
+            const std::uint8_t value = readMemory(static_cast<std::uint16_t>((page << 8) | i));
+            if (_busHook)
+                _busHook({_busCycle++, 0x2004, value, BusAccess::Kind::Write});
+            _ppu.writeOam(value);
+        }
+        _cycleCount += 513 + (_cycleCount & 1);
+        _exitBlock = true;
+    }
+
+    // IRQ is one line shared by the mapper and the APU
+    bool irqAsserted() const
+    {
+        return (_mapper && _mapper->irq()) || _apu.irq();
+    }
+
+    // Sets the cycle the PPU next needs to run by: right away once an NMI is raised, while IRQ is held
+    // with interrupts enabled, or in lockstep; otherwise the first cycle at which the next NMI, mapper
+    // IRQ or APU IRQ is due, as long as nothing writes a register before then
+    void updatePpuDeadline()
+    {
+        if (_ppu.takeNmi())
+            _nmiPending = true;
+        if (_nmiPending || (irqAsserted() && !_flagInterruptDisable) || _ppuSync == PpuSync::Lockstep)
+        {
+            _ppuDeadline = 0;
+            return;
+        }
+
+        std::uint64_t clock = _ppu.nextNmiClock();
+        if (std::uint32_t lines = _mapper ? _mapper->scanlinesUntilIrq() : 0)
+            clock = std::min(clock, _ppu.scanlineClockAfter(lines));
+        std::uint64_t cycle = _apu.nextIrqCycle();
+        if (clock != std::numeric_limits<std::uint64_t>::max())
+            cycle = std::min(cycle, (clock - kPpuDotsAtReset + 2) / 3);
+        _ppuDeadline = cycle;
+    }
+
+    void syncPPU()
+    {
+        _ppu.run(kPpuDotsAtReset + 3 * _cycleCount);
+        if (std::uint32_t lines = _ppu.takeScanlineClocks())
+            _mapper->clockScanlines(lines);
+        updatePpuDeadline();
+    }
+
+    // DMC sample bytes are read over the CPU bus; the CPU is not stalled for them
+    void syncAPU()
+    {
+        _apu.run(_cycleCount, [this](std::uint16_t address)
+                 { return readSample(address); });
+    }
+
+    // A DMC sample byte, stamped for a bus hook with the cycle the APU reads it at
+    std::uint8_t readSample(std::uint16_t address)
+    {
+        if (!_busHook)
+            return readMemory(address);
+        const std::uint64_t cycle = std::exchange(_busCycle, _apu.sampleFetchCycle());
+        const std::uint8_t value = readMemory(address);
+        _busCycle = cycle;
+        return value;
+    }
+
+    // Runs the PPU and APU up to the CPU and takes an NMI the PPU raised, or an IRQ the mapper or APU
+    // holds while interrupts are enabled; only called between instructions. The first instruction of
+    // a handler runs before another interrupt is taken, however often this is called in between.
+    void clockPPU()
+    {
+        syncAPU();
+        syncPPU();
+        if (_cycleCount == _interruptCycle)
+            return;
+        if (_nmiPending)
+        {
+            _nmiPending = false;
+            serviceInterrupt(0xFFFA);
+            _interruptCycle = _cycleCount;
+            updatePpuDeadline();
+        }
+        else if (irqAsserted() && !_flagInterruptDisable)
+        {
+            serviceInterrupt(0xFFFE);
+            _interruptCycle = _cycleCount;
+            updatePpuDeadline();
+        }
+    }
+
+    // Called between instructions
+    void pollPPU()
+    {
+        if (_cycleCount >= _ppuDeadline)
+            clockPPU();
+    }
+
+    // Same sequence as BRK, with the break flag clear: $FFFA for NMI, $FFFE for IRQ
+    void serviceInterrupt(std::uint16_t vector)
+    {
+        if (_busHook)
+        {
+            _busCycle = _cycleCount;
+            idleRead(_programCounter);
+            idleRead(_programCounter);
+        }
+        pushStack(static_cast<std::uint8_t>(_programCounter >> 8));
+        pushStack(static_cast<std::uint8_t>(_programCounter & 0xFF));
+        pushStack(packStatus(false));
+        _flagInterruptDisable = true;
+
+        std::uint8_t pcl = readMemory(vector);
+        std::uint8_t pch = readMemory(static_cast<std::uint16_t>(vector + 1));
+        _programCounter = static_cast<std::uint16_t>((pch << 8) | pcl);
+        _cycleCount += 7;
+    }
+
+    // CLI, PLP and RTI can let a held IRQ through; the deadline ignored it while interrupts were disabled
+    void setInterruptDisable(bool disable)
+    {
+        _flagInterruptDisable = disable;
+        if (!disable && irqAsserted())
+        {
+            _ppuDeadline = 0;
+            _exitBlock = true;
+        }
+    }
+
+    // Whether the PPU deadline could come up within the next `cycles` CPU cycles
+    bool ppuDeadlineWithin(std::uint32_t cycles) const
+    {
+        return _cycleCount + cycles >= _ppuDeadline;
+    }
+
+    static std::uint8_t readUnmapped(NESemulator &nes, std::uint16_t address)
+    {
+        *nes._errors << "Invalid memory read at address: " << std::hex << address << std::dec << std::endl;
+        return 0;
+    }
+
+    static void writeIgnored(NESemulator &, std::uint16_t, std::uint8_t)
+    {
+    }
+
+    // Taken instead of the direct pointer while a RAM page holds decoded code
+    static void writeRamCode(NESemulator &nes, std::uint16_t address, std::uint8_t value)
+    {
+        nes._ram[address & 0x7FF] = value;
+        nes.invalidateRamCode(static_cast<std::uint8_t>((address & 0x7FF) >> 8));
+    }
+
+    // Points the write side of a RAM page, and its three mirrors, at memory or at writeRamCode
+    void setRamPageWritable(std::uint8_t ramPage, bool writable)
+    {
+        for (int page = ramPage; page < 0x20; page += 0x08)
+            pageMap()[page].write = writable ? &_ram[ramPage << 8] : nullptr;
+    }
+
+    // Maps PRG-ROM at a CPU address; a bank switch only swaps these pointers, plus dropping
+    // whatever blocks were decoded from the old bank or run into it from the page before
+    void mapPrgBank(std::uint16_t address, const std::uint8_t *bank, std::size_t size)
+    {
+        retireBlockPage(static_cast<std::uint8_t>((address >> 8) - 1));
+        for (std::size_t offset = 0; offset < size; offset += 0x100)
+        {
+            std::uint8_t page = static_cast<std::uint8_t>((address + offset) >> 8);
+            pageMap()[page].read = bank + offset;
+            retireBlockPage(page);
+        }
+    }
+
+    void initMemoryMap()
+    {
+        std::array<MemoryPage, 0x100> &map = pageMap();
+        for (int page = 0; page < 0x100; page++)
+            map[page] = {nullptr, nullptr, &NESemulator::readUnmapped, &NESemulator::writeIgnored};
+
+        for (int page = 0x00; page < 0x20; page++)
+            map[page] = {&_ram[(page & 0x07) << 8], &_ram[(page & 0x07) << 8], nullptr, &NESemulator::writeRamCode};
+        for (int page = 0x20; page < 0x40; page++)
+            map[page] = {nullptr, nullptr, &NESemulator::readPPURegister, &NESemulator::writePPURegister};
+        map[0x40] = {nullptr, nullptr, &NESemulator::readIORegister, &NESemulator::writeIORegister};
+        for (int page = 0x60; page < 0x80; page++)
+            map[page] = {&_prgRam[(page - 0x60) << 8], &_prgRam[(page - 0x60) << 8], nullptr, nullptr};
+        // PRG-ROM is mapped by reset(), once the cartridge is loaded; writes there go to the mapper
+        for (int page = 0x80; page < 0x100; page++)
+            map[page].writeHandler = &NESemulator::writeMapper;
+    }
+
+    bool reset()
+    {
+        _programCounter = 0;
+        _A = 0;
+        _X = 0;
+        _Y = 0;
+        _flagCarry = false;
+        _flagInterruptDisable = true; // True on purpose
+        _flagDecimal = false;
+        setZeroNegative(false, false);
+        _overflowBits = 0;
+
+        _stackPointer = 0xFD; // Stack Pointer starts at 0xFD on reset
+
+        // The cartridge is mapped and parsed once; later resets do no file I/O
+        if (!_image)
+        {
+            std::shared_ptr<const RomImage> image = RomCache::acquire(_filePath, *_errors);
+            if (!image)
+                return false;
+            // Four-screen boards carry 2KB more VRAM, which is not emulated; they get vertical mirroring
+            const Mirroring mirroring = image->mirroring() == HeaderMirroring::Horizontal ? Mirroring::Horizontal : Mirroring::Vertical;
+            _mapper = Mapper::create(image->mapper(), image->prgSize(), image->chrSize() ? image->chrSize() : image->chrRamSize(), mirroring);
+            if (!_mapper)
+            {
+                *_errors << "Unsupported mapper " << image->mapper() << ": " << _filePath << std::endl;
+                return false;
+            }
+            _image = image;
+            _romId = _image->id();
+            if (_image->hasTrainer())
+                std::copy(_image->trainer(), _image->trainer() + RomImage::kTrainerSize, _prgRam + 0x1000);
+        }
+        _chr.assign(_image->chrRamSize(), 0);
+
+        _ppu.reset();
+        _ppu.setSimdLevel(tile::detectSimdLevel());
+        if (_chr.empty())
+            _ppu.attachChr(_image->chr(), _image->chrSize(), nullptr);
+        else
+            _ppu.attachChr(_chr.data(), _chr.size(), _chr.data());
+        _ppu.setScanlineCounter(_mapper->countsScanlines());
+        _mapper->reset();
+        applyBankLayout();
+        _ppu.run(kPpuDotsAtReset);
+        _apu.setSimdLevel(tile::detectSimdLevel());
+        _apu.reset(_cycleCount);
+        updatePpuDeadline();
+        for (Controller &controller : _controllers)
+            controller.reset();
+
+        // Reset vector (little-endian: low at 0xFFFC, high at 0xFFFD)
+        std::uint8_t PCL = readMemory(0xFFFC);
+        std::uint8_t PCH = readMemory(0xFFFD);
+        _programCounter = static_cast<std::uint16_t>((PCH << 8) | PCL);
+
+        if (_loggingEnabled)
+        {
+            // The reset line of the reference traces: registers cleared, PPU at its power-up dot
+            TraceRecord record{};
+            record.kind = TraceKind::Reset;
+            record.ppuClock = kPpuDotsAtReset - 3 * kResetCycles;
+            record.dot = static_cast<std::uint16_t>(record.ppuClock);
+            _trace->record(record);
+        }
+        return true;
+    }
+
+    using OpcodeHandler = void (NESemulator::*)();
+
+    // Reads the operand bytes that follow the opcode and advances the program counter past them
+    template <AddrMode M>
+    std::uint16_t fetchOperand()
+    {
+        if constexpr (operandSize(M) == 0)
+        {
+            return 0;
+        }
+        else if constexpr (operandSize(M) == 1)
+        {
+            std::uint8_t value = readMemory(_programCounter);
+            _programCounter++;
+            return value;
+        }
+        else
+        {
+            std::uint8_t low = readMemory(_programCounter);
+            _programCounter++;
+            std::uint8_t high = readMemory(_programCounter);
+            _programCounter++;
+            return static_cast<std::uint16_t>((high << 8) | low);
+        }
+    }
+
+    // Indexing first reads the address with the index added to its low byte only, the right one unless
+    // the index carried into the high byte. A read pays a cycle to read again when it did; stores and
+    // read-modify-writes always take that cycle, counted in the table, and always make the first read.
+    template <bool PagePenalty>
+    void indexedDummyRead(std::uint16_t base, std::uint16_t address)
+    {
+        const bool crossed = (base & 0xFF00) != (address & 0xFF00);
+        if (PagePenalty && !crossed)
+            return;
+        if (PagePenalty)
+            _cycleCount += 1;
+        dummyRead(static_cast<std::uint16_t>((base & 0xFF00) | (address & 0x00FF)));
+    }
+
+    // Turns a fetched operand into the effective address; read instructions pay +1 cycle on a page cross
+    template <AddrMode M, bool PagePenalty>
+    std::uint16_t effectiveAddress(std::uint16_t operand)
+    {
+        if constexpr (M == AddrMode::ZeroPage || M == AddrMode::Absolute)
+        {
+            return operand;
+        }
+        else if constexpr (M == AddrMode::ZeroPageX)
+        {
+            return static_cast<std::uint8_t>(operand + _X);
+        }
+        else if constexpr (M == AddrMode::ZeroPageY)
+        {
+            return static_cast<std::uint8_t>(operand + _Y);
+        }
+        else if constexpr (M == AddrMode::AbsoluteX || M == AddrMode::AbsoluteY)
+        {
+            std::uint16_t address = static_cast<std::uint16_t>(operand + (M == AddrMode::AbsoluteX ? _X : _Y));
+            indexedDummyRead<PagePenalty>(operand, address);
+            return address;
+        }
+        else if constexpr (M == AddrMode::Indirect)
+        {
+            // The 6502 never carries into the high byte of the pointer ($xxFF wraps to $xx00)
+            std::uint8_t low = readMemory(operand);
+            std::uint8_t high = readMemory(static_cast<std::uint16_t>((operand & 0xFF00) | ((operand + 1) & 0x00FF)));
+            return static_cast<std::uint16_t>((high << 8) | low);
+        }
+        else if constexpr (M == AddrMode::IndirectX)
+        {
+            std::uint8_t zp = static_cast<std::uint8_t>(operand + _X);
+            std::uint8_t low = readMemory(zp);
+            std::uint8_t high = readMemory(static_cast<std::uint8_t>(zp + 1));
+            return static_cast<std::uint16_t>((high << 8) | low);
+        }
+        else if constexpr (M == AddrMode::IndirectY)
+        {
+            std::uint8_t low = readMemory(static_cast<std::uint8_t>(operand));
+            std::uint8_t high = readMemory(static_cast<std::uint8_t>(operand + 1));
+            std::uint16_t base = static_cast<std::uint16_t>((high << 8) | low);
+            std::uint16_t address = static_cast<std::uint16_t>(base + _Y);
+            indexedDummyRead<PagePenalty>(base, address);
+            return address;
+        }
+        else
+        {
+            static_assert(M != M, "addressing mode has no effective address");
+        }
+    }
+
+    template <AddrMode M>
+    std::uint8_t loadOperand(std::uint16_t operand)
+    {
+        if constexpr (M == AddrMode::Immediate)
+            return static_cast<std::uint8_t>(operand);
+        else
+            return readMemory(effectiveAddress<M, true>(operand));
+    }
+
+    // Read-modify-write on either the accumulator or memory; memory gets the old value written back
+    // before the new one
+    template <AddrMode M, typename Modify>
+    void modifyOperand(std::uint16_t operand, Modify modify)
+    {
+        if constexpr (M == AddrMode::Accumulator)
+        {
+            _A = modify(_A);
+        }
+        else
+        {
+            std::uint16_t address = effectiveAddress<M, false>(operand);
+            std::uint8_t value = readMemory(address);
+            dummyWrite(address, value);
+            writeMemory(address, modify(value));
+        }
+    }
+
+    template <AddrMode M>
+    void storeOperand(std::uint16_t operand, std::uint8_t value)
+    {
+        writeMemory(effectiveAddress<M, false>(operand), value);
+    }
+
+    void branchIf(bool condition, std::uint16_t operand)
+    {
+        if (!condition)
+            return;
+
+        // Sign-extend 8-bit offset
+        std::int8_t rel = static_cast<std::int8_t>(operand);
+        std::uint16_t oldPC = _programCounter;
+        _programCounter = static_cast<std::uint16_t>(_programCounter + rel);
+        _cycleCount += 1;
+        if ((oldPC & 0xFF00) != (_programCounter & 0xFF00))
+            _cycleCount += 1;
+    }
+
+    // Executes one operation once its operand has been fetched; specialized per (mode, op) pair
+    template <AddrMode M, Op O>
+    void execute(std::uint16_t operand)
+    {
+        if constexpr (O == Op::LDA)
+        {
+            _A = loadOperand<M>(operand);
+            updateZeroNegative(_A);
+        }
+        else if constexpr (O == Op::LDX)
+        {
+            _X = loadOperand<M>(operand);
+            updateZeroNegative(_X);
+        }
+        else if constexpr (O == Op::LDY)
+        {
+            _Y = loadOperand<M>(operand);
+            updateZeroNegative(_Y);
+        }
+        else if constexpr (O == Op::STA)
+            storeOperand<M>(operand, _A);
+        else if constexpr (O == Op::STX)
+            storeOperand<M>(operand, _X);
+        else if constexpr (O == Op::STY)
+            storeOperand<M>(operand, _Y);
+        else if constexpr (O == Op::ADC)
+            opADC(loadOperand<M>(operand));
+        else if constexpr (O == Op::SBC)
+            opSBC(loadOperand<M>(operand));
+        else if constexpr (O == Op::AND)
+            opAND(loadOperand<M>(operand));
+        else if constexpr (O == Op::ORA)
+            opORA(loadOperand<M>(operand));
+        else if constexpr (O == Op::EOR)
+            opEOR(loadOperand<M>(operand));
+        else if constexpr (O == Op::CMP)
+            opCompare(_A, loadOperand<M>(operand));
+        else if constexpr (O == Op::CPX)
+            opCompare(_X, loadOperand<M>(operand));
+        else if constexpr (O == Op::CPY)
+            opCompare(_Y, loadOperand<M>(operand));
+        else if constexpr (O == Op::BIT)
+            opBIT(loadOperand<M>(operand));
+        else if constexpr (O == Op::ASL)
+            modifyOperand<M>(operand, [this](std::uint8_t v) { return opASL(v); });
+        else if constexpr (O == Op::LSR)
+            modifyOperand<M>(operand, [this](std::uint8_t v) { return opLSR(v); });
+        else if constexpr (O == Op::ROL)
+            modifyOperand<M>(operand, [this](std::uint8_t v) { return opROL(v); });
+        else if constexpr (O == Op::ROR)
+            modifyOperand<M>(operand, [this](std::uint8_t v) { return opROR(v); });
+        else if constexpr (O == Op::INC)
+            modifyOperand<M>(operand, [this](std::uint8_t v) { return opINC(v); });
+        else if constexpr (O == Op::DEC)
+            modifyOperand<M>(operand, [this](std::uint8_t v) { return opDEC(v); });
+        else if constexpr (O == Op::INX)
+            _X = opINC(_X);
+        else if constexpr (O == Op::INY)
+            _Y = opINC(_Y);
+        else if constexpr (O == Op::DEX)
+            _X = opDEC(_X);
+        else if constexpr (O == Op::DEY)
+            _Y = opDEC(_Y);
+        else if constexpr (O == Op::TAX)
+            updateZeroNegative(_X = _A);
+        else if constexpr (O == Op::TAY)
+            updateZeroNegative(_Y = _A);
+        else if constexpr (O == Op::TXA)
+            updateZeroNegative(_A = _X);
+        else if constexpr (O == Op::TYA)
+            updateZeroNegative(_A = _Y);
+        else if constexpr (O == Op::TSX)
+            updateZeroNegative(_X = _stackPointer);
+        else if constexpr (O == Op::TXS)
+            _stackPointer = _X;
+        else if constexpr (O == Op::BPL)
+            branchIf(!flagNegative(), operand);
+        else if constexpr (O == Op::BMI)
+            branchIf(flagNegative(), operand);
+        else if constexpr (O == Op::BVC)
+            branchIf(!flagOverflow(), operand);
+        else if constexpr (O == Op::BVS)
+            branchIf(flagOverflow(), operand);
+        else if constexpr (O == Op::BCC)
+            branchIf(!_flagCarry, operand);
+        else if constexpr (O == Op::BCS)
+            branchIf(_flagCarry, operand);
+        else if constexpr (O == Op::BNE)
+            branchIf(!flagZero(), operand);
+        else if constexpr (O == Op::BEQ)
+            branchIf(flagZero(), operand);
+        else if constexpr (O == Op::CLC)
+            _flagCarry = false;
+        else if constexpr (O == Op::SEC)
+            _flagCarry = true;
+        else if constexpr (O == Op::CLI)
+            setInterruptDisable(false);
+        else if constexpr (O == Op::SEI)
+            _flagInterruptDisable = true;
+        else if constexpr (O == Op::CLV)
+            _overflowBits = 0;
+        else if constexpr (O == Op::CLD)
+            _flagDecimal = false;
+        else if constexpr (O == Op::SED)
+            _flagDecimal = true;
+        else if constexpr (O == Op::PHA)
+            pushStack(_A);
+        else if constexpr (O == Op::PLA)
+            updateZeroNegative(_A = pullStack());
+        else if constexpr (O == Op::PHP)
+            pushStack(packStatus(true));
+        else if constexpr (O == Op::PLP)
+            unpackStatus(pullStack());
+        else if constexpr (O == Op::JMP)
+        {
+            if constexpr (M == AddrMode::Absolute)
+                _programCounter = operand;
+            else
+                _programCounter = effectiveAddress<M, false>(operand);
+        }
+        else if constexpr (O == Op::JSR)
+        {
+            std::uint16_t returnAddr = static_cast<std::uint16_t>(_programCounter - 1);
+            pushStack(static_cast<std::uint8_t>(returnAddr >> 8));   // high
+            pushStack(static_cast<std::uint8_t>(returnAddr & 0xFF)); // low
+            _programCounter = operand;
+        }
+        else if constexpr (O == Op::RTS)
+        {
+            std::uint8_t low = pullStack();
+            std::uint8_t high = pullStack();
+            _programCounter = static_cast<std::uint16_t>(((high << 8) | low) + 1);
+        }
+        else if constexpr (O == Op::BRK)
+        {
+            // BRK skips a padding byte, so the return address is opcode + 2
+            _programCounter++;
+            pushStack(static_cast<std::uint8_t>(_programCounter >> 8));
+            pushStack(static_cast<std::uint8_t>(_programCounter & 0xFF));
+            pushStack(packStatus(true));
+            _flagInterruptDisable = true;
+
+            std::uint8_t pcl = readMemory(0xFFFE);
+            std::uint8_t pch = readMemory(0xFFFF);
+            _programCounter = static_cast<std::uint16_t>((pch << 8) | pcl);
+        }
+        else if constexpr (O == Op::RTI)
+        {
+            unpackStatus(pullStack());
+            std::uint8_t low = pullStack();
+            std::uint8_t high = pullStack();
+            _programCounter = static_cast<std::uint16_t>((high << 8) | low);
+        }
+        else if constexpr (O == Op::NOP)
+        {
+        }
+        else if constexpr (O == Op::HLT)
+        {
+            _cpuHalted = true;
+        }
+        else
+        {
+            std::uint8_t opcode = peekMemory(static_cast<std::uint16_t>(_programCounter - 1));
+            *_errors << "Unknown opcode: " << std::hex << static_cast<int>(opcode) << std::dec << std::endl;
+            _cpuHalted = true; // Halt on unknown opcode for safety
+        }
+    }
+
+    template <std::uint8_t Opcode>
+    void step()
+    {
+        constexpr OpcodeInfo info = kOpcodeTable[Opcode];
+        _cycleCount += info.cycles; // counted first, so I/O handlers see the cycle the access lands on
+        execute<info.mode, info.op>(fetchOperand<info.mode>());
+    }
+
+    template <std::size_t... Opcodes>
+    static constexpr std::array<OpcodeHandler, 256> makeDispatchTable(std::index_sequence<Opcodes...>)
+    {
+        return {&NESemulator::step<static_cast<std::uint8_t>(Opcodes)>...};
+    }
+
+    static const std::array<OpcodeHandler, 256> &dispatchTable()
+    {
+        static constexpr std::array<OpcodeHandler, 256> table = makeDispatchTable(std::make_index_sequence<256>{});
+        return table;
+    }
+
+    template <std::uint8_t Opcode>
+    static void microOp(NESemulator &cpu, std::uint16_t operand)
+    {
+        cpu.execute<kOpcodeTable[Opcode].mode, kOpcodeTable[Opcode].op>(operand);
+    }
+
+    template <std::size_t... Opcodes>
+    static constexpr std::array<MicroOpHandler, 256> makeMicroOpTable(std::index_sequence<Opcodes...>)
+    {
+        return {&NESemulator::microOp<static_cast<std::uint8_t>(Opcodes)>...};
+    }
+
+    static const std::array<MicroOpHandler, 256> &microOpTable()
+    {
+        static constexpr std::array<MicroOpHandler, 256> table = makeMicroOpTable(std::make_index_sequence<256>{});
+        return table;
+    }
+
+    void handleOpcode(std::uint8_t opcode)
+    {
+        (this->*dispatchTable()[opcode])();
+    }
+
+    // A read the 6502 makes in a cycle it needs for itself; it only goes to the bus hook, as the
+    // emulation leaves out what it could set off
+    void idleRead(std::uint16_t address)
+    {
+        _busHook({_busCycle++, address, peekMemory(address), BusAccess::Kind::DummyRead});
+    }
+
+    // step() for a bus hook, with the internal cycles passed on as reads of what is on the address
+    // bus during them, so that each access gets its own cycle
+    template <std::uint8_t Opcode>
+    void stepHooked()
+    {
+        constexpr OpcodeInfo info = kOpcodeTable[Opcode];
+        _cycleCount += info.cycles;
+        if constexpr (info.op == Op::JSR)
+        {
+            // The return address goes on the stack between the two bytes of the target
+            std::uint8_t low = readMemory(_programCounter);
+            _programCounter++;
+            idleRead(static_cast<std::uint16_t>(0x0100 + _stackPointer));
+            pushStack(static_cast<std::uint8_t>(_programCounter >> 8));
+            pushStack(static_cast<std::uint8_t>(_programCounter & 0xFF));
+            std::uint8_t high = readMemory(_programCounter);
+            _programCounter = static_cast<std::uint16_t>((high << 8) | low);
+        }
+        else if constexpr (info.op == Op::HLT || info.op == Op::ILL)
+        {
+            execute<info.mode, info.op>(0);
+        }
+        else
+        {
+            if constexpr (operandSize(info.mode) == 0)
+                idleRead(_programCounter);
+            if constexpr (info.op == Op::PLA || info.op == Op::PLP || info.op == Op::RTS || info.op == Op::RTI)
+                idleRead(static_cast<std::uint16_t>(0x0100 + _stackPointer));
+            const std::uint16_t operand = fetchOperand<info.mode>();
+            if constexpr (info.mode == AddrMode::ZeroPageX || info.mode == AddrMode::ZeroPageY || info.mode == AddrMode::IndirectX)
+                idleRead(static_cast<std::uint8_t>(operand));
+
+            const std::uint64_t cycles = _cycleCount;
+            const std::uint16_t next = _programCounter;
+            execute<info.mode, info.op>(operand);
+            // A taken branch reads the next opcode, then on a page cross the target with the old page
+            if constexpr (info.mode == AddrMode::Relative)
+            {
+                if (_cycleCount != cycles)
+                    idleRead(next);
+                if (_cycleCount == cycles + 2)
+                    idleRead(static_cast<std::uint16_t>((next & 0xFF00) | (_programCounter & 0x00FF)));
+            }
+            if constexpr (info.op == Op::RTS)
+                idleRead(static_cast<std::uint16_t>(_programCounter - 1));
+        }
+    }
+
+    template <std::size_t... Opcodes>
+    static constexpr std::array<OpcodeHandler, 256> makeHookedDispatchTable(std::index_sequence<Opcodes...>)
+    {
+        return {&NESemulator::stepHooked<static_cast<std::uint8_t>(Opcodes)>...};
+    }
+
+    static const std::array<OpcodeHandler, 256> &hookedDispatchTable()
+    {
+        static constexpr std::array<OpcodeHandler, 256> table = makeHookedDispatchTable(std::make_index_sequence<256>{});
+        return table;
+    }
+
+    // Memory as the CPU would read it, minus the side effects: I/O registers read as 0
+    std::uint8_t peekMemory(std::uint16_t address) const
+    {
+        const MemoryPage &page = pageMap()[address >> 8];
+        return page.read ? page.read[address & 0xFF] : 0;
+    }
+
+    // The address the instruction at PC is going to use, worked out without executing it
+    std::uint16_t traceAddress(const OpcodeInfo &info, std::uint16_t operand) const
+    {
+        switch (info.mode)
+        {
+        case AddrMode::ZeroPageX:
+            return static_cast<std::uint8_t>(operand + _X);
+        case AddrMode::ZeroPageY:
+            return static_cast<std::uint8_t>(operand + _Y);
+        case AddrMode::AbsoluteX:
+            return static_cast<std::uint16_t>(operand + _X);
+        case AddrMode::AbsoluteY:
+            return static_cast<std::uint16_t>(operand + _Y);
+        case AddrMode::Indirect:
+            return static_cast<std::uint16_t>(peekMemory(operand) |
+                                              (peekMemory(static_cast<std::uint16_t>((operand & 0xFF00) | ((operand + 1) & 0x00FF))) << 8));
+        case AddrMode::IndirectX:
+        {
+            std::uint8_t zp = static_cast<std::uint8_t>(operand + _X);
+            return static_cast<std::uint16_t>(peekMemory(zp) | (peekMemory(static_cast<std::uint8_t>(zp + 1)) << 8));
+        }
+        case AddrMode::IndirectY:
+        {
+            std::uint16_t base = static_cast<std::uint16_t>(peekMemory(static_cast<std::uint8_t>(operand)) |
+                                                            (peekMemory(static_cast<std::uint8_t>(operand + 1)) << 8));
+            return static_cast<std::uint16_t>(base + _Y);
+        }
+        case AddrMode::Relative:
+            return static_cast<std::uint16_t>(_programCounter + 2 + static_cast<std::int8_t>(operand));
+        default:
+            return operand;
+        }
+    }
+
+    // Records the instruction at PC before it executes; the PPU is caught up first for its columns
+    void traceLog(std::uint8_t opcode)
+    {
+        if (!_loggingEnabled)
+            return;
+        syncPPU();
+
+        TraceRecord record{};
+        record.kind = TraceKind::Instruction;
+        record.cycle = kResetCycles + _cycleCount;
+        record.pc = _programCounter;
+        record.bytes[0] = opcode;
+        record.bytes[1] = peekMemory(static_cast<std::uint16_t>(_programCounter + 1));
+        record.bytes[2] = peekMemory(static_cast<std::uint16_t>(_programCounter + 2));
+        record.address = traceAddress(kOpcodeTable[opcode], static_cast<std::uint16_t>(record.bytes[1] | (record.bytes[2] << 8)));
+        record.a = _A;
+        record.x = _X;
+        record.y = _Y;
+        record.sp = _stackPointer;
+        record.status = packStatus(false);
+        fillTracePpu(record);
+        _trace->record(record);
+    }
+
+    void fillTracePpu(TraceRecord &record) const
+    {
+        record.ppuClock = _ppu.clock();
+        record.scanline = static_cast<std::uint16_t>(_ppu.scanline());
+        record.dot = static_cast<std::uint16_t>(_ppu.dot());
+        record.vramAddress = _ppu.vramAddress();
+        record.readBuffer = _ppu.readBuffer();
+    }
+
+    void updateZeroNegative(std::uint8_t value)
+    {
+        _nzResult = value;
+    }
+
+    void setZeroNegative(bool zero, bool negative)
+    {
+        if (negative)
+            _nzResult = zero ? 0x100 : 0x80;
+        else
+            _nzResult = zero ? 0x00 : 0x01;
+    }
+
+    bool flagZero() const
+    {
+        return (_nzResult & 0xFF) == 0;
+    }
+
+    bool flagNegative() const
+    {
+        return (_nzResult & 0x180) != 0;
+    }
+
+    bool flagOverflow() const
+    {
+        return _overflowBits != 0;
+    }
+
+    std::uint8_t packStatus(bool breakFlag) const
+    {
+        return (flagNegative() << 7) |
+               (flagOverflow() << 6) |
+               (1 << 5) | // unused, always 1
+               (breakFlag << 4) |
+               (_flagDecimal << 3) |
+               (_flagInterruptDisable << 2) |
+               (flagZero() << 1) |
+               _flagCarry;
+    }
+
+    void unpackStatus(std::uint8_t status)
+    {
+        setZeroNegative((status & 0x02) != 0, (status & 0x80) != 0);
+        _overflowBits = status & 0x40;
+        // Bit 5 ignored
+        // Bit 4 (Break) ignored internally
+        _flagDecimal = (status & 0x08) != 0;
+        _flagCarry = (status & 0x01) != 0;
+        setInterruptDisable((status & 0x04) != 0);
+    }
+
+    std::uint8_t opASL(std::uint8_t input)
+    {
+        _flagCarry = (input > 127);
+        input <<= 1;
+        updateZeroNegative(input);
+        return input;
+    }
+
+    std::uint8_t opLSR(std::uint8_t input)
+    {
+        _flagCarry = (input & 0x01) != 0;
+        input >>= 1;
+        updateZeroNegative(input);
+        return input;
+    }
+
+    std::uint8_t opROL(std::uint8_t input)
+    {
+        bool futureFlagCarry = input > 127;
+        input <<= 1;
+        if (_flagCarry)
+        {
+            input |= 1;
+        }
+
+        _flagCarry = futureFlagCarry;
+        updateZeroNegative(input);
+        return input;
+    }
+
+    std::uint8_t opROR(std::uint8_t input)
+    {
+        bool futureFlagCarry = (input & 0x01) != 0;
+        input >>= 1;
+        if (_flagCarry)
+        {
+            input |= 0x80;
+        }
+
+        _flagCarry = futureFlagCarry;
+        updateZeroNegative(input);
+        return input;
+    }
+
+    std::uint8_t opINC(std::uint8_t input)
+    {
+        input++;
+        updateZeroNegative(input);
+        return input;
+    }
+
+    std::uint8_t opDEC(std::uint8_t input)
+    {
+        input--;
+        updateZeroNegative(input);
+        return input;
+    }
+
+    void opORA(std::uint8_t input)
+    {
+        _A |= input;
+        updateZeroNegative(_A);
+    }
+
+    void opAND(std::uint8_t input)
+    {
+        _A &= input;
+        updateZeroNegative(_A);
+    }
+
+    void opEOR(std::uint8_t input)
+    {
+        _A ^= input;
+        updateZeroNegative(_A);
+    }
+
+    void opADC(std::uint8_t input)
+    {
+        int sum = _A + input + (_flagCarry ? 1 : 0);
+        _flagCarry = (sum > 0xFF);
+        _overflowBits = ~(_A ^ input) & (_A ^ sum) & 0x80;
+        _A = static_cast<std::uint8_t>(sum);
+        updateZeroNegative(_A);
+    }
+
+    void opSBC(std::uint8_t input)
+    {
+        // A - M - (1 - C) is A + ~M + C
+        opADC(static_cast<std::uint8_t>(~input));
+    }
+
+    void opCompare(std::uint8_t reg, std::uint8_t input)
+    {
+        _flagCarry = (reg >= input);
+        updateZeroNegative(static_cast<std::uint8_t>(reg - input));
+    }
+
+    void opBIT(std::uint8_t input)
+    {
+        setZeroNegative((_A & input) == 0, (input & 0x80) != 0);
+        _overflowBits = input & 0x40;
+    }
+
+    void pushStack(std::uint8_t value)
+    {
+        writeMemory((ushort)(0x0100 + _stackPointer), value);
+        _stackPointer--;
+    }
+
+    std::uint8_t pullStack()
+    {
+        _stackPointer++;
+        return readMemory((ushort)(0x0100 + _stackPointer));
+    }
+
+    void emulateCPU()
+    {
+        std::uint8_t opcode = readMemory(_programCounter);
+        _programCounter++;
+        handleOpcode(opcode);
+        pollPPU();
+    }
+
+    // The handler table loop with each handler timed; the PPU catching up is left out of the time
+    std::size_t runProfiled(std::size_t maxInstructions)
+    {
+        std::size_t executed = 0;
+        while (!_cpuHalted && executed < maxInstructions)
+        {
+            std::uint8_t opcode = readMemory(_programCounter);
+            traceLog(opcode);
+            _programCounter++;
+            const std::uint64_t start = profile::ticks();
+            handleOpcode(opcode);
+            _opcodeProfile->record(opcode, profile::ticks() - start);
+            pollPPU();
+            executed++;
+        }
+        return executed;
+    }
+
+    // The handler table loop while a bus hook is attached. Each instruction counts its bus cycles from
+    // the CPU clock, so DMA and interrupts in between need no bookkeeping of their own.
+    std::size_t runHooked(std::size_t maxInstructions)
+    {
+        std::size_t executed = 0;
+        while (!_cpuHalted && executed < maxInstructions)
+        {
+            if (_loggingEnabled)
+                traceLog(peekMemory(_programCounter));
+            _busCycle = _cycleCount;
+            std::uint8_t opcode = readMemory(_programCounter);
+            _programCounter++;
+            const std::uint64_t start = _opcodeProfile ? profile::ticks() : 0;
+            (this->*hookedDispatchTable()[opcode])();
+            if (_opcodeProfile)
+                _opcodeProfile->record(opcode, profile::ticks() - start);
+            pollPPU();
+            executed++;
+        }
+        return executed;
+    }
+
+    static constexpr bool endsBlock(Op op)
+    {
+        switch (op)
+        {
+        case Op::BCC:
+        case Op::BCS:
+        case Op::BEQ:
+        case Op::BMI:
+        case Op::BNE:
+        case Op::BPL:
+        case Op::BVC:
+        case Op::BVS:
+        case Op::JMP:
+        case Op::JSR:
+        case Op::RTS:
+        case Op::RTI:
+        case Op::BRK:
+        case Op::HLT:
+        case Op::ILL:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    static bool isCodeAddress(std::uint16_t address)
+    {
+        return address < 0x2000 || address >= 0x8000; // internal RAM with its mirrors, or PRG-ROM
+    }
+
+    std::unique_ptr<DecodedBlock> decodeBlock(std::uint16_t startPC)
+    {
+        auto block = std::make_unique<DecodedBlock>();
+        block->startPC = startPC;
+        std::uint16_t pc = startPC;
+
+        while (true)
+        {
+            const OpcodeInfo &info = kOpcodeTable[readMemory(pc)];
+            std::uint8_t length = 1 + operandSize(info.mode);
+            std::uint16_t last = static_cast<std::uint16_t>(pc + length - 1);
+            if (last < pc || !isCodeAddress(last) || (last >= 0x8000) != (pc >= 0x8000))
+                break; // operand would run off the end of ROM or RAM
+
+            DecodedOp op{};
+            op.opcode = readMemory(pc);
+            op.handler = microOpTable()[op.opcode];
+            op.nextPC = static_cast<std::uint16_t>(pc + length);
+            op.cycles = info.cycles;
+            if (length == 2)
+                op.operand = readMemory(static_cast<std::uint16_t>(pc + 1));
+            else if (length == 3)
+                op.operand = static_cast<std::uint16_t>((readMemory(static_cast<std::uint16_t>(pc + 2)) << 8) |
+                                                        readMemory(static_cast<std::uint16_t>(pc + 1)));
+            block->ops.push_back(op);
+            block->cycles += info.cycles;
+
+            if (pc < 0x2000)
+            {
+                for (std::uint16_t address : {pc, last})
+                {
+                    std::uint8_t ramPage = static_cast<std::uint8_t>((address & 0x7FF) >> 8);
+                    _ramCodePages |= 1 << ramPage;
+                    setRamPageWritable(ramPage, false);
+                }
+            }
+
+            pc = op.nextPC;
+            if (endsBlock(info.op) || static_cast<std::uint16_t>(pc - startPC) >= kMaxBlockBytes || !isCodeAddress(pc))
+                break;
+        }
+
+        if (block->ops.empty())
+            return nullptr;
+        return block;
+    }
+
+    DecodedBlock *lookupBlock(std::uint16_t pc)
+    {
+        std::unique_ptr<BlockPage> &page = _blockPages[pc >> 8];
+        if (page)
+        {
+            if (DecodedBlock *block = page->blocks[pc & 0xFF].get())
+                return block;
+        }
+        if (!isCodeAddress(pc))
+            return nullptr;
+
+        std::unique_ptr<DecodedBlock> block = decodeBlock(pc);
+        if (!block)
+            return nullptr;
+        if (!page)
+            page = std::make_unique<BlockPage>();
+        page->blocks[pc & 0xFF] = std::move(block);
+        return page->blocks[pc & 0xFF].get();
+    }
+
+    void retireBlockPage(std::uint8_t page)
+    {
+        if (!_blockPages[page])
+            return;
+        _retiredBlockPages.push_back(std::move(_blockPages[page])); // the running block may live here
+        _codeInvalidated = true;
+        _exitBlock = true;
+        _blockGeneration++;
+    }
+
+    // Drops every block that starts in, or runs into, a RAM page that was just written, at every mirror
+    void invalidateRamCode(std::uint8_t ramPage)
+    {
+        std::uint8_t previous = (ramPage - 1) & 0x07;
+        for (int mirror = 0; mirror < 0x20; mirror += 0x08)
+        {
+            retireBlockPage(static_cast<std::uint8_t>(mirror + ramPage));
+            retireBlockPage(static_cast<std::uint8_t>(mirror + previous));
+        }
+        _ramCodePages &= ~(1 << ramPage);
+        setRamPageWritable(ramPage, true);
+        _codeInvalidated = true;
+        _exitBlock = true;
+        _blockGeneration++;
+    }
+
+    // Finds the block that follows `from`, going through its cached exits before the block table
+    DecodedBlock *nextBlock(DecodedBlock *from, std::uint16_t pc)
+    {
+        if (!from)
+            return lookupBlock(pc);
+
+        for (const DecodedBlock::Exit &exit : from->exits)
+        {
+            if (exit.pc == pc && exit.generation == _blockGeneration)
+                return exit.block;
+        }
+
+        DecodedBlock *block = lookupBlock(pc);
+        if (block)
+        {
+            from->exits[from->nextExit] = {pc, _blockGeneration, block};
+            from->nextExit ^= 1;
+        }
+        return block;
+    }
+
+    // Runs the ops of one block; stops early if the block rewrote its own code
+    std::size_t runBlock(const DecodedBlock &block)
+    {
+        const DecodedOp *begin = block.ops.data();
+        const DecodedOp *end = begin + block.ops.size();
+        const DecodedOp *last = end - 1;
+
+        // Only the last op of a block can branch or read the program counter, so it is stored once
+        for (const DecodedOp *op = begin; op != last;)
+        {
+            _cycleCount += op->cycles;
+            op->handler(*this, op->operand);
+            op++;
+            if (_exitBlock)
+            {
+                // Self-modifying code, where the rest of this block may be stale, or a PPU write
+                _programCounter = op[-1].nextPC;
+                return op - begin;
+            }
+        }
+        _programCounter = last->nextPC;
+        _cycleCount += last->cycles;
+        last->handler(*this, last->operand);
+        return end - begin;
+    }
+
+    // Runs whole blocks from the cache; code that cannot be cached, a block that would overshoot
+    // maxInstructions, or one that could run into the PPU deadline goes through the handler table
+    // one instruction at a time
+    std::size_t runPredecoded(std::size_t maxInstructions)
+    {
+        std::size_t executed = 0;
+        DecodedBlock *block = nullptr;
+        while (!_cpuHalted && executed < maxInstructions)
+        {
+            pollPPU();
+            if (_codeInvalidated)
+            {
+                _retiredBlockPages.clear();
+                _codeInvalidated = false;
+                block = nullptr;
+            }
+            _exitBlock = false;
+
+            block = nextBlock(block, _programCounter);
+            // Page crossings and taken branches add at most 2 cycles per op
+            if (!block || block->ops.size() > maxInstructions - executed ||
+                ppuDeadlineWithin(block->cycles + 2 * static_cast<std::uint32_t>(block->ops.size())))
+            {
+                emulateCPU();
+                executed++;
+                block = nullptr;
+                continue;
+            }
+
+#if NES_JIT_AVAILABLE
+            if (!block->native && _dispatchMode == DispatchMode::Tiered && _jitEnabled &&
+                ++block->executions == _jitThreshold && block->startPC >= 0x8000)
+            {
+                block->native = compileBlock(*block); // RAM code is left to the block cache
+            }
+            if (block->native)
+            {
+                executed += block->native(this);
+                continue;
+            }
+#endif
+            executed += runBlock(*block);
+        }
+        pollPPU();
+        return executed;
+    }
+
+#if NES_JIT_AVAILABLE
+    std::int32_t offsetOf(const void *member) const
+    {
+        return static_cast<std::int32_t>(reinterpret_cast<const char *>(member) - reinterpret_cast<const char *>(this));
+    }
+
+    static void jitInvalidateRamCode(NESemulator &cpu, std::uint16_t ramPage)
+    {
+        cpu.invalidateRamCode(static_cast<std::uint8_t>(ramPage));
+    }
+
+    std::uint8_t *registerFor(Op op)
+    {
+        switch (op)
+        {
+        case Op::LDX:
+        case Op::STX:
+        case Op::CPX:
+            return &_X;
+        case Op::LDY:
+        case Op::STY:
+        case Op::CPY:
+            return &_Y;
+        default:
+            return &_A;
+        }
+    }
+
+    // Emits native code for the ops that only touch registers, flags and internal RAM at an address
+    // known at compile time; anything else (I/O registers, indexed or indirect modes) returns false
+    // and is handed back to the interpreter's handler
+    bool emitInline(X64Emitter &x, const DecodedOp &op)
+    {
+        const OpcodeInfo &info = kOpcodeTable[op.opcode];
+        const bool immediate = info.mode == AddrMode::Immediate;
+        const bool ramOperand = (info.mode == AddrMode::ZeroPage || info.mode == AddrMode::Absolute) && op.operand < 0x2000;
+        const std::int32_t ram = offsetOf(&_ram[0]) + (op.operand & 0x7FF);
+        const std::int32_t a = offsetOf(&_A), x_ = offsetOf(&_X), y = offsetOf(&_Y), sp = offsetOf(&_stackPointer);
+        const std::int32_t c = offsetOf(&_flagCarry), nz = offsetOf(&_nzResult), v = offsetOf(&_overflowBits);
+        const std::uint8_t value = static_cast<std::uint8_t>(op.operand);
+
+        auto updateZeroNegative = [&]
+        {
+            x.storeAlZeroExtended16(nz);
+        };
+        auto transfer = [&](std::int32_t from, std::int32_t to, bool flags)
+        {
+            x.loadAl(from);
+            x.storeAl(to);
+            if (flags)
+                updateZeroNegative();
+        };
+        // testFlag leaves ZF clear exactly when the 6502 flag is set
+        auto branch = [&](auto testFlag, bool branchIfSet)
+        {
+            std::uint16_t target = static_cast<std::uint16_t>(op.nextPC + static_cast<std::int8_t>(op.operand));
+            std::int8_t penalty = ((target & 0xFF00) != (op.nextPC & 0xFF00)) ? 2 : 1;
+            testFlag();
+            x.storeImm16(offsetOf(&_programCounter), op.nextPC);
+            std::size_t notTaken = x.jccForward(branchIfSet ? X64Cond::Zero : X64Cond::NotZero);
+            x.storeImm16(offsetOf(&_programCounter), target);
+            x.addQwordImm8(offsetOf(&_cycleCount), penalty);
+            x.bindForward(notTaken);
+        };
+
+        switch (info.op)
+        {
+        case Op::LDA:
+        case Op::LDX:
+        case Op::LDY:
+            if (immediate)
+            {
+                x.storeImm8(offsetOf(registerFor(info.op)), value);
+                x.storeImm16(nz, value);
+                return true;
+            }
+            if (!ramOperand)
+                return false;
+            transfer(ram, offsetOf(registerFor(info.op)), true);
+            return true;
+        case Op::STA:
+        case Op::STX:
+        case Op::STY:
+        {
+            if (!ramOperand)
+                return false;
+            transfer(offsetOf(registerFor(info.op)), ram, false);
+            // Stores into RAM that holds decoded code still have to retire those blocks
+            std::uint8_t ramPage = static_cast<std::uint8_t>((op.operand & 0x7FF) >> 8);
+            x.testByteImm(offsetOf(&_ramCodePages), static_cast<std::uint8_t>(1 << ramPage));
+            std::size_t noCode = x.jccForward(X64Cond::Zero);
+            x.callWithInstance(reinterpret_cast<const void *>(&NESemulator::jitInvalidateRamCode), ramPage);
+            x.bindForward(noCode);
+            return true;
+        }
+        case Op::AND:
+        case Op::ORA:
+        case Op::EOR:
+            if (!immediate)
+                return false;
+            x.loadAl(a);
+            if (info.op == Op::AND)
+                x.andAl(value);
+            else if (info.op == Op::ORA)
+                x.orAl(value);
+            else
+                x.xorAl(value);
+            x.storeAl(a);
+            updateZeroNegative();
+            return true;
+        case Op::ADC:
+        case Op::SBC:
+            if (!immediate)
+                return false;
+            // 6502 carry goes into CF, then x86 ADC produces the same carry and overflow; SBC adds ~M
+            x.loadCl(c);
+            x.addClImm(0xFF);
+            x.loadAl(a);
+            x.adcAl(info.op == Op::ADC ? value : static_cast<std::uint8_t>(~value));
+            x.setcc(X64Cond::Carry, c);
+            x.setcc(X64Cond::Overflow, v); // any nonzero value means V
+            x.storeAl(a);
+            updateZeroNegative();
+            return true;
+        case Op::CMP:
+        case Op::CPX:
+        case Op::CPY:
+            if (!immediate)
+                return false;
+            x.loadAl(offsetOf(registerFor(info.op)));
+            x.subAl(value);
+            x.setcc(X64Cond::NotCarry, c); // 6502 carry means "no borrow"
+            updateZeroNegative();
+            return true;
+        case Op::INX:
+        case Op::DEX:
+        case Op::INY:
+        case Op::DEY:
+        {
+            std::int32_t reg = (info.op == Op::INX || info.op == Op::DEX) ? x_ : y;
+            if (info.op == Op::INX || info.op == Op::INY)
+                x.incByte(reg);
+            else
+                x.decByte(reg);
+            x.loadAl(reg);
+            updateZeroNegative();
+            return true;
+        }
+        case Op::TAX:
+            transfer(a, x_, true);
+            return true;
+        case Op::TAY:
+            transfer(a, y, true);
+            return true;
+        case Op::TXA:
+            transfer(x_, a, true);
+            return true;
+        case Op::TYA:
+            transfer(y, a, true);
+            return true;
+        case Op::TSX:
+            transfer(sp, x_, true);
+            return true;
+        case Op::TXS:
+            transfer(x_, sp, false);
+            return true;
+        case Op::CLC:
+        case Op::SEC:
+            x.storeImm8(c, info.op == Op::SEC);
+            return true;
+        case Op::SEI:
+            x.storeImm8(offsetOf(&_flagInterruptDisable), 1);
+            return true;
+        case Op::CLD:
+        case Op::SED:
+            x.storeImm8(offsetOf(&_flagDecimal), info.op == Op::SED);
+            return true;
+        case Op::CLV:
+            x.storeImm8(v, 0);
+            return true;
+        case Op::NOP:
+            return true;
+        case Op::BPL:
+        case Op::BMI:
+            branch([&]
+                   { x.testWordImm(nz, 0x180); },
+                   info.op == Op::BMI);
+            return true;
+        case Op::BVC:
+        case Op::BVS:
+            branch([&]
+                   { x.cmpByteZero(v); },
+                   info.op == Op::BVS);
+            return true;
+        case Op::BCC:
+        case Op::BCS:
+            branch([&]
+                   { x.cmpByteZero(c); },
+                   info.op == Op::BCS);
+            return true;
+        case Op::BNE:
+        case Op::BEQ:
+            // Z is set when the low byte is zero, the inverse of the other flags
+            branch([&]
+                   { x.cmpByteZero(nz); },
+                   info.op == Op::BNE);
+            return true;
+        case Op::JMP:
+            if (info.mode != AddrMode::Absolute)
+                return false;
+            x.storeImm16(offsetOf(&_programCounter), op.operand);
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // Compiles a block to native code. Base cycles of inlined ops are summed and added before the next
+    // handler call, so handlers see the same cycle count as in the interpreter. After a handler call the
+    // block leaves early, with the program counter of the next op, if it was asked to stop.
+    JitBlock compileBlock(const DecodedBlock &block)
+    {
+        X64Emitter x;
+        x.prologue();
+        std::vector<std::pair<std::size_t, std::size_t>> earlyExits; // jcc patch, ops run
+        std::int8_t pendingCycles = 0;
+        auto flushCycles = [&]
+        {
+            if (pendingCycles)
+                x.addQwordImm8(offsetOf(&_cycleCount), pendingCycles);
+            pendingCycles = 0;
+        };
+        for (std::size_t i = 0; i < block.ops.size(); i++)
+        {
+            const DecodedOp &op = block.ops[i];
+            if (pendingCycles > 100)
+                flushCycles();
+            pendingCycles += op.cycles;
+            if (emitInline(x, op))
+                continue;
+
+            // Only the last op of a block reads the program counter
+            if (i + 1 == block.ops.size())
+                x.storeImm16(offsetOf(&_programCounter), op.nextPC);
+            flushCycles();
+            x.callWithInstance(reinterpret_cast<const void *>(op.handler), op.operand);
+            if (i + 1 != block.ops.size())
+            {
+                x.cmpByteZero(offsetOf(&_exitBlock));
+                earlyExits.emplace_back(x.jccForward(X64Cond::NotZero), i + 1);
+            }
+        }
+        flushCycles();
+        x.movEaxImm32(static_cast<std::uint32_t>(block.ops.size()));
+        x.epilogue();
+
+        for (const auto &[patch, ran] : earlyExits)
+        {
+            x.bindForward(patch);
+            x.storeImm16(offsetOf(&_programCounter), block.ops[ran - 1].nextPC);
+            x.movEaxImm32(static_cast<std::uint32_t>(ran));
+            x.epilogue();
+        }
+
+        if (!_jitArena)
+            _jitArena = std::make_unique<ExecutableArena>(kJitArenaBytes);
+        return reinterpret_cast<JitBlock>(_jitArena->commit(x.code()));
+    }
+#endif
+
+#if NES_THREADED_DISPATCH
+#define NES_OPCODE_ROW(X, h)                                                   \
+    X(0x##h##0) X(0x##h##1) X(0x##h##2) X(0x##h##3) X(0x##h##4) X(0x##h##5)     \
+    X(0x##h##6) X(0x##h##7) X(0x##h##8) X(0x##h##9) X(0x##h##A) X(0x##h##B)     \
+    X(0x##h##C) X(0x##h##D) X(0x##h##E) X(0x##h##F)
+#define NES_ALL_OPCODES(X)                                                     \
+    NES_OPCODE_ROW(X, 0) NES_OPCODE_ROW(X, 1) NES_OPCODE_ROW(X, 2)              \
+    NES_OPCODE_ROW(X, 3) NES_OPCODE_ROW(X, 4) NES_OPCODE_ROW(X, 5)              \
+    NES_OPCODE_ROW(X, 6) NES_OPCODE_ROW(X, 7) NES_OPCODE_ROW(X, 8)              \
+    NES_OPCODE_ROW(X, 9) NES_OPCODE_ROW(X, A) NES_OPCODE_ROW(X, B)              \
+    NES_OPCODE_ROW(X, C) NES_OPCODE_ROW(X, D) NES_OPCODE_ROW(X, E)              \
+    NES_OPCODE_ROW(X, F)
+
+    // Runs up to maxInstructions with computed-goto dispatch and returns how many were executed
+    std::size_t runThreaded(std::size_t maxInstructions)
+    {
+#define NES_LABEL_ADDRESS(n) &&op_##n,
+        static void *const labels[256] = {NES_ALL_OPCODES(NES_LABEL_ADDRESS)};
+#undef NES_LABEL_ADDRESS
+
+        std::size_t executed = 0;
+
+#define NES_DISPATCH()                                  \
+    do                                                  \
+    {                                                   \
+        if (_cpuHalted || executed == maxInstructions)  \
+            return executed;                            \
+        executed++;                                     \
+        std::uint8_t opcode = readMemory(_programCounter); \
+        if (_loggingEnabled)                            \
+            traceLog(opcode);                           \
+        _programCounter++;                              \
+        goto *labels[opcode];                           \
+    } while (0)
+
+        NES_DISPATCH();
+
+#define NES_HANDLER(n) \
+    op_##n:            \
+    step<n>();         \
+    pollPPU();         \
+    NES_DISPATCH();
+        NES_ALL_OPCODES(NES_HANDLER)
+#undef NES_HANDLER
+#undef NES_DISPATCH
+    }
+
+#undef NES_ALL_OPCODES
+#undef NES_OPCODE_ROW
+#endif
+
+    bool sameStateAs(const NESemulator &other) const
+    {
+        return _programCounter == other._programCounter &&
+               _A == other._A && _X == other._X && _Y == other._Y &&
+               _stackPointer == other._stackPointer &&
+               _flagCarry == other._flagCarry && flagZero() == other.flagZero() &&
+               _flagInterruptDisable == other._flagInterruptDisable &&
+               _flagDecimal == other._flagDecimal &&
+               flagOverflow() == other.flagOverflow() && flagNegative() == other.flagNegative() &&
+               _cycleCount == other._cycleCount && _interruptCycle == other._interruptCycle &&
+               _cpuHalted == other._cpuHalted &&
+               std::equal(std::begin(_ram), std::end(_ram), std::begin(other._ram));
+    }
+
+    // Lists the state a save-state keeps, for the savestate.hpp readers and writers. The ROM, the
+    // memory map and the block cache follow from the cartridge and are rebuilt rather than saved.
+    template <typename Self, typename Visitor>
+    static void visitState(Self &nes, Visitor &visitor)
+    {
+        visitor.value(nes._programCounter);
+        visitor.value(nes._A);
+        visitor.value(nes._X);
+        visitor.value(nes._Y);
+        visitor.value(nes._stackPointer);
+        visitor.value(nes._flagCarry);
+        visitor.value(nes._flagInterruptDisable);
+        visitor.value(nes._flagDecimal);
+        visitor.value(nes._nzResult);
+        visitor.value(nes._overflowBits);
+        visitor.value(nes._cpuHalted);
+        visitor.value(nes._cycleCount);
+        visitor.value(nes._nmiPending);
+        visitor.value(nes._interruptCycle);
+        visitor.block(nes._ram, sizeof(nes._ram));
+        visitor.block(nes._prgRam, sizeof(nes._prgRam));
+        if (!nes._chr.empty())
+            visitor.block(nes._chr.data(), nes._chr.size());
+        if (nes._mapper && nes._mapper->registersSize())
+            visitor.block(nes._mapper->registers(), nes._mapper->registersSize());
+        PPU::visitState(nes._ppu, visitor);
+        APU::visitState(nes._apu, visitor);
+        Controller::visitState(nes._controllers[0], visitor);
+        Controller::visitState(nes._controllers[1], visitor);
+    }
+
+    // Tells keyframes apart, so a delta is only ever applied to the one it was made from
+    static std::uint64_t nextKeyframeStamp()
+    {
+        static std::atomic<std::uint64_t> next{static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count())};
+        return next++;
+    }
+
+    void writeStateHeader(std::uint8_t *out, StateKind kind, std::uint64_t stamp, std::size_t size) const
+    {
+        StateHeader header{};
+        std::memcpy(header.magic, kStateMagic, sizeof(header.magic));
+        header.version = kStateVersion;
+        header.kind = kind;
+        header.romId = _romId;
+        header.stamp = stamp;
+        header.size = size;
+        std::memcpy(out, &header, sizeof(header));
+    }
+
+    // Reads the header of a state and checks it is one of this cartridge, of the given kind
+    bool readStateHeader(const std::uint8_t *data, std::size_t length, StateKind kind, StateHeader &header) const
+    {
+        if (length < sizeof(StateHeader))
+            return false;
+        std::memcpy(&header, data, sizeof(header));
+        return std::memcmp(header.magic, kStateMagic, sizeof(header.magic)) == 0 && header.version == kStateVersion &&
+               header.kind == kind && header.romId == _romId && header.size == length;
+    }
+
+    void stateLoaded()
+    {
+        if (_mapper)
+            applyBankLayout();
+        _ppu.stateLoaded(!_chr.empty());
+        _apu.stateLoaded();
+        // RAM may hold other code now than the blocks decoded from it
+        const std::uint8_t codePages = _ramCodePages;
+        for (std::uint8_t ramPage = 0; ramPage < 8; ramPage++)
+        {
+            if (codePages & (1 << ramPage))
+                invalidateRamCode(ramPage);
+        }
+        updatePpuDeadline();
+    }
+
+public:
+    NESemulator(std::string filePath) : _filePath(filePath), _programCounter(0), _A(0), _X(0), _Y(0)
+    {
+        std::fill(std::begin(_ram), std::end(_ram), 0);
+        std::fill(std::begin(_prgRam), std::end(_prgRam), 0);
+        initMemoryMap();
+    }
+
+    // The memory map points into this object
+    NESemulator(const NESemulator &) = delete;
+    NESemulator &operator=(const NESemulator &) = delete;
+
+    bool init()
+    {
+        return reset();
+    }
+
+    // Swaps in another cartridge and powers on from scratch, so one instance can run ROM after ROM
+    bool load(const std::string &filePath)
+    {
+        _filePath = filePath;
+        std::fill(std::begin(_ram), std::end(_ram), 0);
+        std::fill(std::begin(_prgRam), std::end(_prgRam), 0);
+        _cycleCount = 0;
+        _cpuHalted = false;
+        _nmiPending = false;
+        _interruptCycle = std::numeric_limits<std::uint64_t>::max();
+        _ppu = PPU(); // VRAM, OAM and palette as at power-on; reset() wires up the rest
+
+        // Nothing decoded or compiled from the old cartridge may survive
+        for (int page = 0; page < 0x100; page++)
+            retireBlockPage(static_cast<std::uint8_t>(page));
+        _retiredBlockPages.clear();
+        _codeInvalidated = false;
+        _exitBlock = false;
+        _ramCodePages = 0;
+        _jitArena.reset();
+        _image.reset();
+        _mapper.reset();
+        _bankLayoutApplied = false;
+        initMemoryMap();
+        return reset();
+    }
+
+    // Where this instance writes its messages; std::cout and std::cerr unless changed
+    void setOutput(std::ostream &out, std::ostream &errors)
+    {
+        _out = &out;
+        _errors = &errors;
+    }
+
+    // Size of a keyframe, and the most any delta can take
+    std::size_t keyframeSize() const
+    {
+        state::Sizer sizer;
+        visitState(*this, sizer);
+        return sizeof(StateHeader) + sizer.keyframe;
+    }
+
+    std::size_t maxDeltaSize() const
+    {
+        state::Sizer sizer;
+        visitState(*this, sizer);
+        return sizeof(StateHeader) + sizer.delta;
+    }
+
+    // Writes a keyframe into out and returns its size, or 0 when capacity is too small
+    std::size_t saveState(std::uint8_t *out, std::size_t capacity) const
+    {
+        if (capacity < sizeof(StateHeader))
+            return 0;
+        state::Writer writer(out + sizeof(StateHeader), capacity - sizeof(StateHeader));
+        visitState(*this, writer);
+        if (!writer.fits())
+            return 0;
+        writeStateHeader(out, StateKind::Keyframe, nextKeyframeStamp(), sizeof(StateHeader) + writer.size());
+        return sizeof(StateHeader) + writer.size();
+    }
+
+    // Writes the state as a delta against a keyframe saved earlier; returns its size, or 0 when
+    // capacity is too small or the keyframe is not one of this cartridge's
+    std::size_t saveDelta(const std::uint8_t *keyframe, std::size_t keyframeLength, std::uint8_t *out, std::size_t capacity) const
+    {
+        StateHeader base;
+        if (!readStateHeader(keyframe, keyframeLength, StateKind::Keyframe, base) || keyframeLength != keyframeSize() ||
+            capacity < sizeof(StateHeader))
+            return 0;
+        state::DeltaWriter writer(out + sizeof(StateHeader), capacity - sizeof(StateHeader), keyframe + sizeof(StateHeader));
+        visitState(*this, writer);
+        if (!writer.fits())
+            return 0;
+        writeStateHeader(out, StateKind::Delta, base.stamp, sizeof(StateHeader) + writer.size());
+        return sizeof(StateHeader) + writer.size();
+    }
+
+    // Restores a keyframe. Nothing changes unless the whole state checks out.
+    bool loadState(const std::uint8_t *data, std::size_t length)
+    {
+        StateHeader header;
+        if (!readStateHeader(data, length, StateKind::Keyframe, header))
+            return false;
+        state::Reader check(data + sizeof(StateHeader), length - sizeof(StateHeader), false);
+        visitState(*this, check);
+        if (!check.complete())
+            return false;
+
+        state::Reader reader(data + sizeof(StateHeader), length - sizeof(StateHeader), true);
+        visitState(*this, reader);
+        stateLoaded();
+        return true;
+    }
+
+    // Restores a delta on top of the keyframe it was saved against
+    bool loadDelta(const std::uint8_t *delta, std::size_t deltaLength, const std::uint8_t *keyframe, std::size_t keyframeLength)
+    {
+        StateHeader header, base;
+        if (!readStateHeader(delta, deltaLength, StateKind::Delta, header) ||
+            !readStateHeader(keyframe, keyframeLength, StateKind::Keyframe, base) || header.stamp != base.stamp)
+            return false;
+        const std::uint8_t *deltaBody = delta + sizeof(StateHeader), *keyframeBody = keyframe + sizeof(StateHeader);
+        const std::size_t deltaBodyLength = deltaLength - sizeof(StateHeader), keyframeBodyLength = keyframeLength - sizeof(StateHeader);
+
+        state::DeltaReader check(deltaBody, deltaBodyLength, keyframeBody, keyframeBodyLength, false);
+        visitState(*this, check);
+        if (!check.complete())
+            return false;
+
+        state::DeltaReader reader(deltaBody, deltaBodyLength, keyframeBody, keyframeBodyLength, true);
+        visitState(*this, reader);
+        stateLoaded();
+        return true;
+    }
+
+    void setDispatchMode(DispatchMode mode)
+    {
+#if !NES_THREADED_DISPATCH
+        if (mode == DispatchMode::Threaded)
+        {
+            *_errors << "Threaded dispatch not compiled in, using the handler table" << std::endl;
+            return;
+        }
+#endif
+#if !NES_JIT_AVAILABLE
+        if (mode == DispatchMode::Tiered)
+        {
+            *_errors << "No JIT for this platform, running from the block cache" << std::endl;
+            mode = DispatchMode::Predecoded;
+        }
+#endif
+        _dispatchMode = mode;
+    }
+
+    // Keeps the tiered engine on the block cache without compiling anything, to tell JIT bugs
+    // from block cache bugs; DispatchMode::Table stays the exact per-instruction reference path
+    void setJitEnabled(bool enabled)
+    {
+        _jitEnabled = enabled;
+    }
+
+    // Sends the sound as 48 kHz mono samples to the ring, or stops when it is null. The emulator
+    // writes to it from whichever thread runs it; one other thread may read at the same time.
+    void setAudioOutput(AudioRing *output)
+    {
+        syncAPU();
+        _apu.setOutput(output);
+    }
+
+    // Stretches or squeezes the sound from now on, making scale times 48000 samples per emulated
+    // second, so a pacer can keep the audio ring at its level without a separate resampler
+    void setAudioRate(double scale)
+    {
+        syncAPU();
+        _apu.setRateScale(scale);
+    }
+
+    // Counts and times every instruction into the profile, or stops when it is null. While profiling,
+    // instructions go through the handler table one at a time whatever the dispatch mode.
+    void setOpcodeProfile(OpcodeProfile *profile)
+    {
+        _opcodeProfile = profile;
+    }
+
+    // Passes every CPU bus access to the hook, DMA and DMC sample reads included, or stops when it is
+    // empty. While attached, every page goes through the hook's handlers, so the direct RAM and ROM
+    // pointers cost nothing when nothing is watching; instructions go through a handler table of their
+    // own one at a time whatever the dispatch mode, as the block cache fetches no operands.
+    void setBusHook(BusHook hook)
+    {
+        _busCycle = _cycleCount;
+        if (_busHook && !hook)
+            _memoryMap = _hookedMap;
+        else if (!_busHook && hook)
+        {
+            _hookedMap = _memoryMap;
+            for (MemoryPage &page : _memoryMap)
+                page = {nullptr, nullptr, &NESemulator::readHooked, &NESemulator::writeHooked};
+        }
+        _busHook = std::move(hook);
+    }
+
+    // Catch-up is the default; lockstep is the reference it is checked against
+    void setPpuSync(PpuSync sync)
+    {
+        _ppuSync = sync;
+        updatePpuDeadline();
+    }
+
+    // Steps an instance using the given backend, with the PPU caught up lazily, side by side with a
+    // table-dispatched lockstep instance of the same ROM and reports the first point where their state differs
+    static bool verifyDispatch(const std::string &filePath, DispatchMode mode, std::size_t maxInstructions)
+    {
+        NESemulator reference(filePath);
+        NESemulator candidate(filePath);
+        reference._loggingEnabled = false;
+        candidate._loggingEnabled = false;
+        reference.init();
+        candidate.init();
+        reference.setPpuSync(PpuSync::Lockstep);
+        candidate.setDispatchMode(mode);
+        candidate._jitThreshold = 1; // compile every block the first time it runs
+
+        std::size_t checked = 0;
+        while (checked < maxInstructions && !reference._cpuHalted)
+        {
+            ushort pc = reference._programCounter;
+            std::size_t stepped = 0;
+#if NES_THREADED_DISPATCH
+            if (candidate._dispatchMode == DispatchMode::Threaded)
+                stepped = candidate.runThreaded(1);
+#endif
+            if (candidate._dispatchMode == DispatchMode::Predecoded || candidate._dispatchMode == DispatchMode::Tiered)
+            {
+                // One block per step, so divergence is caught at block granularity
+                DecodedBlock *block = candidate.lookupBlock(candidate._programCounter);
+                stepped = block ? block->ops.size() : 1;
+                candidate.runPredecoded(stepped);
+            }
+            else if (candidate._dispatchMode == DispatchMode::Table)
+            {
+                candidate.emulateCPU();
+                stepped = 1;
+            }
+
+            for (std::size_t i = 0; i < stepped; i++)
+                reference.emulateCPU();
+            checked += stepped;
+
+            if (!reference.sameStateAs(candidate))
+            {
+                std::cerr << "Dispatch mismatch after instruction " << checked << " (step from PC " << std::hex << pc << std::dec << ")" << std::endl;
+                return false;
+            }
+        }
+
+        // The candidate's PPU is only caught up here, so a late catch-up shows as a CPU mismatch above
+        reference.syncPPU();
+        candidate.syncPPU();
+        if (!reference._ppu.sameStateAs(candidate._ppu))
+        {
+            std::cerr << "PPU state differs after " << checked << " instructions" << std::endl;
+            return false;
+        }
+        std::cout << "Dispatch matches the handler table over " << checked << " instructions" << std::endl;
+        return true;
+    }
+
+    // Runs every tile decoder this CPU supports over the ROM's CHR data against the scalar one
+    static bool verifyTiles(const std::string &filePath)
+    {
+        NESemulator emulator(filePath);
+        emulator._loggingEnabled = false;
+        if (!emulator.init())
+            return false;
+
+        bool ok = true;
+        const SimdLevel best = tile::detectSimdLevel();
+        for (SimdLevel level : {SimdLevel::SSE2, SimdLevel::AVX2})
+        {
+            if (static_cast<int>(level) > static_cast<int>(best))
+                break;
+            bool match = emulator._chr.empty() ? verifyTileDecoders(emulator._image->chr(), emulator._image->chrSize(), level)
+                                               : verifyTileDecoders(emulator._chr.data(), emulator._chr.size(), level);
+            std::cout << (level == SimdLevel::AVX2 ? "AVX2" : "SSE2") << " tile decoder "
+                      << (match ? "matches" : "differs from") << " the scalar one" << std::endl;
+            ok = ok && match;
+        }
+        return ok;
+    }
+
+    // Records every instruction executed from now on to a binary trace file, formatted offline with
+    // formatTrace(). Start it before init() to get the reset line as well. Tracing runs the predecoded
+    // and tiered modes through the handler table.
+    bool startTrace(const std::string &path)
+    {
+        auto recorder = std::make_unique<TraceRecorder>();
+        if (!recorder->open(path))
+            return false;
+        _trace = std::move(recorder);
+        _loggingEnabled = true;
+        return true;
+    }
+
+    // Streams the trace to a consumer instead, which runs on the recorder's drain thread
+    void startTrace(TraceRecorder::Consumer consumer)
+    {
+        _trace = std::make_unique<TraceRecorder>();
+        _trace->open(std::move(consumer));
+        _loggingEnabled = true;
+    }
+
+    // Waits until the consumer has had every record
+    void stopTrace()
+    {
+        _loggingEnabled = false;
+        _trace.reset();
+    }
+
+    // Runs up to maxInstructions with the selected backend and returns how many ran
+    std::size_t runInstructions(std::size_t maxInstructions)
+    {
+        if (_busHook)
+            return runHooked(maxInstructions);
+        if (_opcodeProfile)
+            return runProfiled(maxInstructions);
+#if NES_THREADED_DISPATCH
+        if (_dispatchMode == DispatchMode::Threaded)
+            return runThreaded(maxInstructions);
+#endif
+        if ((_dispatchMode == DispatchMode::Predecoded || _dispatchMode == DispatchMode::Tiered) && !_loggingEnabled)
+            return runPredecoded(maxInstructions);
+
+        std::size_t executed = 0;
+        while (!_cpuHalted && executed < maxInstructions)
+        {
+            if (_loggingEnabled)
+                traceLog(peekMemory(_programCounter));
+            emulateCPU();
+            executed++;
+        }
+        return executed;
+    }
+
+    // Runs until at least the given number of CPU cycles has passed. No instruction outside DMA takes
+    // more than 7 cycles, so each chunk stops at or short of the target and the last one overshoots by
+    // less than an instruction.
+    std::size_t runCycles(std::uint64_t cycles)
+    {
+        const std::uint64_t target = _cycleCount + cycles;
+        std::size_t executed = 0;
+        while (!_cpuHalted && _cycleCount < target)
+            executed += runInstructions(static_cast<std::size_t>(std::max<std::uint64_t>(1, (target - _cycleCount) / 7)));
+        return executed;
+    }
+
+    // Runs until the PPU has started vblank the given number of times
+    std::size_t runFrames(std::uint64_t frames)
+    {
+        clockPPU();
+        const std::uint64_t target = _ppu.frame() + frames;
+        std::size_t executed = 0;
+        while (!_cpuHalted && _ppu.frame() < target)
+        {
+            // First CPU cycle at which the PPU reaches the next vblank
+            const std::uint64_t vblankCycle = (_ppu.nextVblankClock() - kPpuDotsAtReset + 2) / 3;
+            executed += runCycles(vblankCycle - _cycleCount);
+            clockPPU();
+        }
+        return executed;
+    }
+
+    CpuState cpuState() const
+    {
+        return {_programCounter, _A, _X, _Y, _stackPointer, packStatus(false), _cycleCount, _cpuHalted};
+    }
+
+    // Frames the PPU has completed, caught up to the CPU first
+    std::uint64_t frameCount()
+    {
+        syncPPU();
+        return _ppu.frame();
+    }
+
+    // 256x240 NES color indices (0-63) of the last frame, complete once runFrames returns
+    const std::uint8_t *framebuffer() const
+    {
+        return _ppu.framebuffer();
+    }
+
+    // Frames after the current one are drawn into pixels, 256x240 bytes, or back into the PPU's own
+    // buffer for nullptr. Safe to call whenever runFrames has returned.
+    void setFramebuffer(std::uint8_t *pixels)
+    {
+        _ppu.setFramebuffer(pixels);
+    }
+
+    // For frames that are run but never shown, as run-ahead does: the PPU leaves the framebuffer alone
+    // except on lines where a sprite 0 hit can happen, so the game sees no difference
+    void setVideoSkipped(bool skipped)
+    {
+        syncPPU();
+        _ppu.setSkipDrawing(skipped);
+    }
+
+    // Stops making sound without disturbing the sound made so far. A state saved right after
+    // suspending can be loaded back before resuming, and the sound carries on as if the frames in
+    // between never ran.
+    void setAudioSuspended(bool suspended)
+    {
+        syncAPU();
+        if (suspended)
+            _apu.suspendOutput();
+        else
+            _apu.resumeOutput();
+    }
+
+    // Starts the sound over from silence at the current cycle
+    void restartAudio()
+    {
+        syncAPU();
+        _apu.restartOutput();
+    }
+
+    // Controller::Button bits held on controller 0 or 1 from now on
+    void setButtons(int port, std::uint8_t buttons)
+    {
+        _controllers[port & 1].setButtons(buttons);
+    }
+
+    void run()
+    {
+        *_out << "Starting Emulator..." << std::endl;
+        runInstructions(1000);
+    }
+};
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+// Addressing modes of the 6502, as they appear in the opcode matrix
+enum class AddrMode : std::uint8_t
+{
+    Implied,
+    Accumulator,
+    Immediate,
+    ZeroPage,
+    ZeroPageX,
+    ZeroPageY,
+    Absolute,
+    AbsoluteX,
+    AbsoluteY,
+    Indirect,
+    IndirectX,
+    IndirectY,
+    Relative,
+};
+
+// Operations; HLT covers the JAM/KIL opcodes the test ROMs use to stop, ILL everything unofficial
+enum class Op : std::uint8_t
+{
+    ADC, AND, ASL, BCC, BCS, BEQ, BIT, BMI, BNE, BPL, BRK, BVC, BVS, CLC,
+    CLD, CLI, CLV, CMP, CPX, CPY, DEC, DEX, DEY, EOR, INC, INX, INY, JMP,
+    JSR, LDA, LDX, LDY, LSR, NOP, ORA, PHA, PHP, PLA, PLP, ROL, ROR, RTI,
+    RTS, SBC, SEC, SED, SEI, STA, STX, STY, TAX, TAY, TSX, TXA, TXS, TYA,
+    HLT, ILL,
+};
+
+struct OpcodeInfo
+{
+    AddrMode mode = AddrMode::Implied;
+    Op op = Op::ILL;
+    std::uint8_t cycles = 0; // base cycles, without page-cross or branch-taken penalties
+};
+
+constexpr std::uint8_t operandSize(AddrMode mode)
+{
+    switch (mode)
+    {
+    case AddrMode::Implied:
+    case AddrMode::Accumulator:
+        return 0;
+    case AddrMode::Absolute:
+    case AddrMode::AbsoluteX:
+    case AddrMode::AbsoluteY:
+    case AddrMode::Indirect:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+constexpr const char *mnemonic(Op op)
+{
+    constexpr const char *names[] = {
+        "ADC", "AND", "ASL", "BCC", "BCS", "BEQ", "BIT", "BMI", "BNE", "BPL", "BRK", "BVC", "BVS", "CLC",
+        "CLD", "CLI", "CLV", "CMP", "CPX", "CPY", "DEC", "DEX", "DEY", "EOR", "INC", "INX", "INY", "JMP",
+        "JSR", "LDA", "LDX", "LDY", "LSR", "NOP", "ORA", "PHA", "PHP", "PLA", "PLP", "ROL", "ROR", "RTI",
+        "RTS", "SBC", "SEC", "SED", "SEI", "STA", "STX", "STY", "TAX", "TAY", "TSX", "TXA", "TXS", "TYA",
+        "HLT", "???"};
+    return names[static_cast<std::uint8_t>(op)];
+}
+
+constexpr const char *addrModeName(AddrMode mode)
+{
+    constexpr const char *names[] = {
+        "imp", "acc", "imm", "zp", "zpx", "zpy", "abs", "absx", "absy", "ind", "indx", "indy", "rel"};
+    return names[static_cast<std::uint8_t>(mode)];
+}
+
+constexpr std::array<OpcodeInfo, 256> buildOpcodeTable()
+{
+    using M = AddrMode;
+    std::array<OpcodeInfo, 256> t{};
+
+    t[0x69] = {M::Immediate, Op::ADC, 2};
+    t[0x65] = {M::ZeroPage, Op::ADC, 3};
+    t[0x75] = {M::ZeroPageX, Op::ADC, 4};
+    t[0x6D] = {M::Absolute, Op::ADC, 4};
+    t[0x7D] = {M::AbsoluteX, Op::ADC, 4};
+    t[0x79] = {M::AbsoluteY, Op::ADC, 4};
+    t[0x61] = {M::IndirectX, Op::ADC, 6};
+    t[0x71] = {M::IndirectY, Op::ADC, 5};
+
+    t[0x29] = {M::Immediate, Op::AND, 2};
+    t[0x25] = {M::ZeroPage, Op::AND, 3};
+    t[0x35] = {M::ZeroPageX, Op::AND, 4};
+    t[0x2D] = {M::Absolute, Op::AND, 4};
+    t[0x3D] = {M::AbsoluteX, Op::AND, 4};
+    t[0x39] = {M::AbsoluteY, Op::AND, 4};
+    t[0x21] = {M::IndirectX, Op::AND, 6};
+    t[0x31] = {M::IndirectY, Op::AND, 5};
+
+    t[0x0A] = {M::Accumulator, Op::ASL, 2};
+    t[0x06] = {M::ZeroPage, Op::ASL, 5};
+    t[0x16] = {M::ZeroPageX, Op::ASL, 6};
+    t[0x0E] = {M::Absolute, Op::ASL, 6};
+    t[0x1E] = {M::AbsoluteX, Op::ASL, 7};
+
+    t[0x90] = {M::Relative, Op::BCC, 2};
+    t[0xB0] = {M::Relative, Op::BCS, 2};
+    t[0xF0] = {M::Relative, Op::BEQ, 2};
+    t[0x30] = {M::Relative, Op::BMI, 2};
+    t[0xD0] = {M::Relative, Op::BNE, 2};
+    t[0x10] = {M::Relative, Op::BPL, 2};
+    t[0x50] = {M::Relative, Op::BVC, 2};
+    t[0x70] = {M::Relative, Op::BVS, 2};
+
+    t[0x24] = {M::ZeroPage, Op::BIT, 3};
+    t[0x2C] = {M::Absolute, Op::BIT, 4};
+
+    t[0x00] = {M::Implied, Op::BRK, 7};
+
+    t[0x18] = {M::Implied, Op::CLC, 2};
+    t[0xD8] = {M::Implied, Op::CLD, 2};
+    t[0x58] = {M::Implied, Op::CLI, 2};
+    t[0xB8] = {M::Implied, Op::CLV, 2};
+
+    t[0xC9] = {M::Immediate, Op::CMP, 2};
+    t[0xC5] = {M::ZeroPage, Op::CMP, 3};
+    t[0xD5] = {M::ZeroPageX, Op::CMP, 4};
+    t[0xCD] = {M::Absolute, Op::CMP, 4};
+    t[0xDD] = {M::AbsoluteX, Op::CMP, 4};
+    t[0xD9] = {M::AbsoluteY, Op::CMP, 4};
+    t[0xC1] = {M::IndirectX, Op::CMP, 6};
+    t[0xD1] = {M::IndirectY, Op::CMP, 5};
+
+    t[0xE0] = {M::Immediate, Op::CPX, 2};
+    t[0xE4] = {M::ZeroPage, Op::CPX, 3};
+    t[0xEC] = {M::Absolute, Op::CPX, 4};
+
+    t[0xC0] = {M::Immediate, Op::CPY, 2};
+    t[0xC4] = {M::ZeroPage, Op::CPY, 3};
+    t[0xCC] = {M::Absolute, Op::CPY, 4};
+
+    t[0xC6] = {M::ZeroPage, Op::DEC, 5};
+    t[0xD6] = {M::ZeroPageX, Op::DEC, 6};
+    t[0xCE] = {M::Absolute, Op::DEC, 6};
+    t[0xDE] = {M::AbsoluteX, Op::DEC, 7};
+
+    t[0xCA] = {M::Implied, Op::DEX, 2};
+    t[0x88] = {M::Implied, Op::DEY, 2};
+
+    t[0x49] = {M::Immediate, Op::EOR, 2};
+    t[0x45] = {M::ZeroPage, Op::EOR, 3};
+    t[0x55] = {M::ZeroPageX, Op::EOR, 4};
+    t[0x4D] = {M::Absolute, Op::EOR, 4};
+    t[0x5D] = {M::AbsoluteX, Op::EOR, 4};
+    t[0x59] = {M::AbsoluteY, Op::EOR, 4};
+    t[0x41] = {M::IndirectX, Op::EOR, 6};
+    t[0x51] = {M::IndirectY, Op::EOR, 5};
+
+    t[0xE6] = {M::ZeroPage, Op::INC, 5};
+    t[0xF6] = {M::ZeroPageX, Op::INC, 6};
+    t[0xEE] = {M::Absolute, Op::INC, 6};
+    t[0xFE] = {M::AbsoluteX, Op::INC, 7};
+
+    t[0xE8] = {M::Implied, Op::INX, 2};
+    t[0xC8] = {M::Implied, Op::INY, 2};
+
+    t[0x4C] = {M::Absolute, Op::JMP, 3};
+    t[0x6C] = {M::Indirect, Op::JMP, 5};
+
+    t[0x20] = {M::Absolute, Op::JSR, 6};
+
+    t[0xA9] = {M::Immediate, Op::LDA, 2};
+    t[0xA5] = {M::ZeroPage, Op::LDA, 3};
+    t[0xB5] = {M::ZeroPageX, Op::LDA, 4};
+    t[0xAD] = {M::Absolute, Op::LDA, 4};
+    t[0xBD] = {M::AbsoluteX, Op::LDA, 4};
+    t[0xB9] = {M::AbsoluteY, Op::LDA, 4};
+    t[0xA1] = {M::IndirectX, Op::LDA, 6};
+    t[0xB1] = {M::IndirectY, Op::LDA, 5};
+
+    t[0xA2] = {M::Immediate, Op::LDX, 2};
+    t[0xA6] = {M::ZeroPage, Op::LDX, 3};
+    t[0xB6] = {M::ZeroPageY, Op::LDX, 4};
+    t[0xAE] = {M::Absolute, Op::LDX, 4};
+    t[0xBE] = {M::AbsoluteY, Op::LDX, 4};
+
+    t[0xA0] = {M::Immediate, Op::LDY, 2};
+    t[0xA4] = {M::ZeroPage, Op::LDY, 3};
+    t[0xB4] = {M::ZeroPageX, Op::LDY, 4};
+    t[0xAC] = {M::Absolute, Op::LDY, 4};
+    t[0xBC] = {M::AbsoluteX, Op::LDY, 4};
+
+    t[0x4A] = {M::Accumulator, Op::LSR, 2};
+    t[0x46] = {M::ZeroPage, Op::LSR, 5};
+    t[0x56] = {M::ZeroPageX, Op::LSR, 6};
+    t[0x4E] = {M::Absolute, Op::LSR, 6};
+    t[0x5E] = {M::AbsoluteX, Op::LSR, 7};
+
+    t[0xEA] = {M::Implied, Op::NOP, 2};
+
+    t[0x09] = {M::Immediate, Op::ORA, 2};
+    t[0x05] = {M::ZeroPage, Op::ORA, 3};
+    t[0x15] = {M::ZeroPageX, Op::ORA, 4};
+    t[0x0D] = {M::Absolute, Op::ORA, 4};
+    t[0x1D] = {M::AbsoluteX, Op::ORA, 4};
+    t[0x19] = {M::AbsoluteY, Op::ORA, 4};
+    t[0x01] = {M::IndirectX, Op::ORA, 6};
+    t[0x11] = {M::IndirectY, Op::ORA, 5};
+
+    t[0x48] = {M::Implied, Op::PHA, 3};
+    t[0x08] = {M::Implied, Op::PHP, 3};
+    t[0x68] = {M::Implied, Op::PLA, 4};
+    t[0x28] = {M::Implied, Op::PLP, 4};
+
+    t[0x2A] = {M::Accumulator, Op::ROL, 2};
+    t[0x26] = {M::ZeroPage, Op::ROL, 5};
+    t[0x36] = {M::ZeroPageX, Op::ROL, 6};
+    t[0x2E] = {M::Absolute, Op::ROL, 6};
+    t[0x3E] = {M::AbsoluteX, Op::ROL, 7};
+
+    t[0x6A] = {M::Accumulator, Op::ROR, 2};
+    t[0x66] = {M::ZeroPage, Op::ROR, 5};
+    t[0x76] = {M::ZeroPageX, Op::ROR, 6};
+    t[0x6E] = {M::Absolute, Op::ROR, 6};
+    t[0x7E] = {M::AbsoluteX, Op::ROR, 7};
+
+    t[0x40] = {M::Implied, Op::RTI, 6};
+    t[0x60] = {M::Implied, Op::RTS, 6};
+
+    t[0xE9] = {M::Immediate, Op::SBC, 2};
+    t[0xE5] = {M::ZeroPage, Op::SBC, 3};
+    t[0xF5] = {M::ZeroPageX, Op::SBC, 4};
+    t[0xED] = {M::Absolute, Op::SBC, 4};
+    t[0xFD] = {M::AbsoluteX, Op::SBC, 4};
+    t[0xF9] = {M::AbsoluteY, Op::SBC, 4};
+    t[0xE1] = {M::IndirectX, Op::SBC, 6};
+    t[0xF1] = {M::IndirectY, Op::SBC, 5};
+
+    t[0x38] = {M::Implied, Op::SEC, 2};
+    t[0xF8] = {M::Implied, Op::SED, 2};
+    t[0x78] = {M::Implied, Op::SEI, 2};
+
+    t[0x85] = {M::ZeroPage, Op::STA, 3};
+    t[0x95] = {M::ZeroPageX, Op::STA, 4};
+    t[0x8D] = {M::Absolute, Op::STA, 4};
+    t[0x9D] = {M::AbsoluteX, Op::STA, 5};
+    t[0x99] = {M::AbsoluteY, Op::STA, 5};
+    t[0x81] = {M::IndirectX, Op::STA, 6};
+    t[0x91] = {M::IndirectY, Op::STA, 6};
+
+    t[0x86] = {M::ZeroPage, Op::STX, 3};
+    t[0x96] = {M::ZeroPageY, Op::STX, 4};
+    t[0x8E] = {M::Absolute, Op::STX, 4};
+
+    t[0x84] = {M::ZeroPage, Op::STY, 3};
+    t[0x94] = {M::ZeroPageX, Op::STY, 4};
+    t[0x8C] = {M::Absolute, Op::STY, 4};
+
+    t[0xAA] = {M::Implied, Op::TAX, 2};
+    t[0xA8] = {M::Implied, Op::TAY, 2};
+    t[0xBA] = {M::Implied, Op::TSX, 2};
+    t[0x8A] = {M::Implied, Op::TXA, 2};
+    t[0x9A] = {M::Implied, Op::TXS, 2};
+    t[0x98] = {M::Implied, Op::TYA, 2};
+
+    // JAM opcodes lock up the real CPU; the test ROMs use $02 as a halt
+    for (std::uint8_t jam : {0x02, 0x12, 0x22, 0x32, 0x42, 0x52, 0x62, 0x72, 0x92, 0xB2, 0xD2, 0xF2})
+    {
+        t[jam] = {M::Implied, Op::HLT, 0};
+    }
+
+    return t;
+}
+
+inline constexpr std::array<OpcodeInfo, 256> kOpcodeTable = buildOpcodeTable();
+
+static_assert(kOpcodeTable[0xA9].op == Op::LDA && kOpcodeTable[0xA9].mode == AddrMode::Immediate);
+static_assert(kOpcodeTable[0x6C].mode == AddrMode::Indirect && kOpcodeTable[0x6C].cycles == 5);
+static_assert([]
+              {
+                  int official = 0;
+                  for (const OpcodeInfo &info : kOpcodeTable)
+                      official += (info.op != Op::ILL && info.op != Op::HLT);
+                  return official; }() == 151);
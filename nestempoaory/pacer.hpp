@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "audio.hpp"
+#include "frame_mailbox.hpp"
+
+// Running figures for one kind of latency, in milliseconds
+struct LatencyStats
+{
+    std::uint64_t count = 0;
+    double last = 0;
+    double mean = 0;
+    double max = 0;
+
+    void add(double ms)
+    {
+        count++;
+        last = ms;
+        mean += (ms - mean) / static_cast<double>(count);
+        max = std::max(max, ms);
+    }
+};
+
+// Keeps the audio ring at a small, steady fill while video runs on the host clock. The host's audio
+// device and its system clock never quite agree, so an emulator paced by one slowly drains or floods
+// a buffer read by the other. Before each frame the pacer compares the ring's fill with its target and
+// sets how many samples the frame makes, within 0.5% of nominal either way: more when the ring is low,
+// fewer when it is high. A pitch change that small cannot be heard. The correction has a slow integral
+// part that learns the drift between the clocks, so the ring settles at its target rather than short
+// of it, where a steady drift would leave no margin for scheduling jitter.
+//
+// It also measures latency: for audio, samples in the ring plus what the device holds; for input, from
+// a controller change to the first frame showing it being presented.
+class Pacer
+{
+public:
+    static constexpr double kMaxRateDeviation = 0.005;
+    static constexpr double kIntegralGain = 0.01; // per frame: the drift is learned over about 100 frames
+
+private:
+    double _targetSamples;
+    double _integral = 0; // emulator thread only
+
+    // Written by the audio backend, read by the emulator thread
+    std::atomic<double> _deviceSamples{0};
+
+    // Written by the emulator thread, read by any
+    std::atomic<double> _rateScale{1.0};
+    std::atomic<double> _audioLatency{0}; // ms
+
+    // Presenting thread only
+    LatencyStats _inputToPhoton;
+    std::uint64_t _inputsShown = 0;
+
+public:
+    // The target is the fill the ring is steered towards just before a frame adds its samples, in
+    // seconds. Three quarters of a frame rides out a late wake-up and a 256-sample device period, and
+    // keeps the worst case, with the frame's own samples, under two frames.
+    explicit Pacer(double targetSeconds = 0.75 / 60.0) : _targetSamples(targetSeconds * audio::kSampleRate)
+    {
+    }
+
+    // What the audio device buffers past the ring, from the audio backend, for the latency figure
+    void setDeviceLatency(double seconds) { _deviceSamples.store(seconds * audio::kSampleRate, std::memory_order_relaxed); }
+
+    // Emulator thread, before running a frame: the rate scale for it, from the ring's fill now.
+    // The proportional part alone reaches the limit when the ring is empty or twice the target.
+    double frameStarting(std::size_t ringFill)
+    {
+        const double error = std::clamp((_targetSamples - static_cast<double>(ringFill)) / _targetSamples, -1.0, 1.0);
+        _integral = std::clamp(_integral + kIntegralGain * error, -1.0, 1.0);
+        const double scale = 1.0 + kMaxRateDeviation * std::clamp(error + _integral, -1.0, 1.0);
+        _rateScale.store(scale, std::memory_order_relaxed);
+        _audioLatency.store((static_cast<double>(ringFill) + _deviceSamples.load(std::memory_order_relaxed)) * 1000.0 / audio::kSampleRate, std::memory_order_relaxed);
+        return scale;
+    }
+
+    // Presenting thread, right after a frame went to the display
+    void framePresented(const FrameMailbox::Frame &frame, std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now())
+    {
+        if (frame.inputs <= _inputsShown)
+            return;
+        _inputsShown = frame.inputs;
+        _inputToPhoton.add(std::chrono::duration<double, std::milli>(now - frame.lastInput).count());
+    }
+
+    double targetSamples() const { return _targetSamples; }
+    double rateScale() const { return _rateScale.load(std::memory_order_relaxed); }
+
+    // Samples waiting in the ring and the device when the last frame started, in ms
+    double audioLatency() const { return _audioLatency.load(std::memory_order_relaxed); }
+
+    // Presenting thread only
+    const LatencyStats &inputToPhoton() const { return _inputToPhoton; }
+};
@@ -0,0 +1,635 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#include "tile_decoder.hpp"
+
+enum class Mirroring
+{
+    Horizontal, // $2000 = $2400, $2800 = $2C00
+    Vertical,   // $2000 = $2800, $2400 = $2C00
+    SingleScreenLow,
+    SingleScreenHigh,
+};
+
+// 2C02 picture processing unit. The CPU side goes through readRegister/writeRegister and runs it forward
+// with run(); time moves from event to event (line render, scroll copies, vblank) instead of dot by dot,
+// and each visible line is drawn whole at its first dot from the scroll and OAM state at that point.
+class PPU
+{
+public:
+    static constexpr int kWidth = 256;
+    static constexpr int kHeight = 240;
+    static constexpr int kDotsPerLine = 341;
+    static constexpr int kLinesPerFrame = 262;
+    static constexpr int kVblankLine = 241;
+    static constexpr int kPrerenderLine = 261;
+    // Where sprite pattern fetches from $1000 first raise A12 on a rendered line; MMC3 counts these
+    static constexpr int kScanlineClockDot = 260;
+
+private:
+    // Internal scroll registers: v (current VRAM address), t (temporary address), fine X, write toggle
+    std::uint16_t _v = 0;
+    std::uint16_t _t = 0;
+    std::uint8_t _fineX = 0;
+    bool _writeToggle = false;
+    std::uint8_t _readBuffer = 0;
+    std::uint8_t _ioLatch = 0; // last value on the register bus, read back from write-only registers
+
+    std::uint8_t _ctrl = 0;   // $2000
+    std::uint8_t _mask = 0;   // $2001
+    std::uint8_t _status = 0; // $2002
+    std::uint8_t _oamAddress = 0;
+
+    std::array<std::uint8_t, 0x800> _vram{};
+    std::array<std::uint8_t, 0x20> _palette{};
+    std::array<std::uint8_t, 0x100> _oam{};
+    std::array<std::uint8_t *, 4> _nametables{};
+    Mirroring _mirroring = Mirroring::Horizontal;
+
+    // Pattern tables are 8 1KB banks, each at an offset into the cartridge's CHR memory
+    const std::uint8_t *_chr = nullptr;
+    std::uint8_t *_chrRam = nullptr; // set when that memory is CHR-RAM
+    std::array<std::size_t, 8> _chrBankOffsets{};
+    TileCache _tiles;
+    tile::ApplyAttributes _applyAttributes = &tile::applyAttributesScalar;
+
+    int _scanline = 0;
+    int _dot = 0;
+    bool _oddFrame = false;
+    std::uint64_t _clock = 0; // dots since reset
+    std::uint64_t _frame = 0;
+    bool _nmiOutput = false;
+    int _sprite0HitDot = -1; // dot on the current line where sprite 0 hits, -1 when it does not
+    bool _countScanlines = false;   // set for mappers that watch the pattern table address lines
+    std::uint32_t _scanlineClocks = 0; // rendered lines since the mapper last took them
+
+    std::array<std::uint8_t, kWidth * kHeight> _framebuffer{};
+    std::uint8_t *_target = nullptr; // where lines are drawn when not into _framebuffer
+    bool _skipDrawing = false;
+
+    bool renderingEnabled() const { return (_mask & 0x18) != 0; }
+
+    std::size_t chrOffset(std::uint16_t address) const
+    {
+        return _chrBankOffsets[(address >> 10) & 0x07] + (address & 0x3FF);
+    }
+
+    std::uint8_t readChr(std::uint16_t address) const
+    {
+        return _chr[chrOffset(address)];
+    }
+
+    static std::uint8_t paletteIndex(std::uint16_t address)
+    {
+        std::uint8_t index = address & 0x1F;
+        if ((index & 0x13) == 0x10)
+            index &= 0x0F; // sprite backdrop entries mirror the background ones
+        return index;
+    }
+
+    std::uint8_t readVideo(std::uint16_t address) const
+    {
+        address &= 0x3FFF;
+        if (address < 0x2000)
+            return readChr(address);
+        if (address < 0x3F00)
+            return _nametables[(address >> 10) & 0x03][address & 0x3FF];
+        return _palette[paletteIndex(address)] & 0x3F;
+    }
+
+    void writeVideo(std::uint16_t address, std::uint8_t value)
+    {
+        address &= 0x3FFF;
+        if (address < 0x2000)
+        {
+            if (_chrRam)
+            {
+                _chrRam[chrOffset(address)] = value;
+                _tiles.invalidate(chrOffset(address));
+            }
+        }
+        else if (address < 0x3F00)
+            _nametables[(address >> 10) & 0x03][address & 0x3FF] = value;
+        else
+            _palette[paletteIndex(address)] = value;
+    }
+
+    void incrementVramAddress()
+    {
+        _v = (_v + ((_ctrl & 0x04) ? 32 : 1)) & 0x7FFF;
+    }
+
+    void incrementCoarseX(std::uint16_t &v) const
+    {
+        if ((v & 0x001F) == 31)
+            v = (v & ~0x001F) ^ 0x0400;
+        else
+            v++;
+    }
+
+    void incrementY()
+    {
+        if ((_v & 0x7000) != 0x7000)
+        {
+            _v += 0x1000;
+            return;
+        }
+        _v &= ~0x7000;
+        int coarseY = (_v & 0x03E0) >> 5;
+        if (coarseY == 29)
+        {
+            coarseY = 0;
+            _v ^= 0x0800;
+        }
+        else if (coarseY == 31)
+            coarseY = 0; // attribute rows wrap without switching nametables
+        else
+            coarseY++;
+        _v = (_v & ~0x03E0) | (coarseY << 5);
+    }
+
+    // For frames nobody sees only what the CPU can read back matters: the sprite overflow flag, and a
+    // sprite 0 hit, for which the line is drawn as usual. True when the line needs no more than that.
+    bool skipScanline()
+    {
+        if (!renderingEnabled() || !(_mask & 0x10))
+            return true;
+        const int height = (_ctrl & 0x20) ? 16 : 8;
+        int found = 0;
+        bool spriteZero = false;
+        for (int i = 0; i < 64; i++)
+        {
+            const int row = _scanline - _oam[i * 4] - 1;
+            if (row < 0 || row >= height)
+                continue;
+            if (++found > 8)
+            {
+                _status |= 0x20;
+                break;
+            }
+            spriteZero |= i == 0;
+        }
+        return !spriteZero || (_mask & 0x08) == 0 || (_status & 0x40) || _sprite0HitDot >= 0;
+    }
+
+    void renderScanline()
+    {
+        if (_skipDrawing && skipScanline())
+            return;
+        std::uint8_t *line = (_target ? _target : _framebuffer.data()) + _scanline * kWidth;
+        const std::uint8_t colorMask = (_mask & 0x01) ? 0x30 : 0x3F; // greyscale keeps the luma bits
+        if (!renderingEnabled())
+        {
+            std::fill(line, line + kWidth, _palette[0] & colorMask);
+            return;
+        }
+
+        // Background, one tile past the right edge so fine X can scroll into it. Tile rows come
+        // predecoded from the cache and the attribute palettes go on in one pass over the line.
+        std::array<std::uint8_t, kWidth + 16> background{};
+        if (_mask & 0x08)
+        {
+            std::array<std::uint8_t, kWidth + 16> attributes;
+            std::uint16_t v = _v;
+            const std::uint16_t patternBase = ((_ctrl & 0x10) ? 0x1000 : 0) + (v >> 12);
+            for (int tile = 0; tile < 33; tile++)
+            {
+                std::uint8_t index = readVideo(0x2000 | (v & 0x0FFF));
+                std::uint8_t attribute = readVideo(0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07));
+                int shift = ((v >> 4) & 0x04) | (v & 0x02);
+                std::memcpy(&background[tile * 8], _tiles.row(chrOffset(patternBase + index * 16)), 8);
+                std::memset(&attributes[tile * 8], ((attribute >> shift) & 0x03) << 2, 8);
+                incrementCoarseX(v);
+            }
+            _applyAttributes(background.data(), attributes.data(), 33 * 8);
+            if (!(_mask & 0x02))
+                std::fill(background.begin() + _fineX, background.begin() + _fineX + 8, 0);
+        }
+        const std::uint8_t *backgroundPixels = &background[_fineX];
+
+        // Sprites: the first 8 in OAM order on this line, earlier ones in front
+        std::array<std::uint8_t, kWidth> sprite{};
+        std::array<std::uint8_t, kWidth> spriteFlags{}; // bit 0: behind background, bit 1: sprite 0
+        if (_mask & 0x10)
+        {
+            const int height = (_ctrl & 0x20) ? 16 : 8;
+            int found = 0;
+            for (int i = 0; i < 64; i++)
+            {
+                const std::uint8_t *entry = &_oam[i * 4];
+                int row = _scanline - entry[0] - 1; // OAM holds the line above the sprite's top
+                if (row < 0 || row >= height)
+                    continue;
+                if (++found > 8)
+                {
+                    _status |= 0x20;
+                    break;
+                }
+
+                std::uint8_t tile = entry[1];
+                std::uint8_t attribute = entry[2];
+                if (attribute & 0x80)
+                    row = height - 1 - row;
+                std::uint16_t pattern;
+                if (height == 16)
+                    pattern = ((tile & 0x01) ? 0x1000 : 0) + (tile & 0xFE) * 16 + (row & 0x08) * 2 + (row & 0x07);
+                else
+                    pattern = ((_ctrl & 0x08) ? 0x1000 : 0) + tile * 16 + row;
+
+                std::uint8_t pixels[8], palette[8];
+                std::memcpy(pixels, _tiles.row(chrOffset(pattern)), 8);
+                std::memset(palette, 0x10 | ((attribute & 0x03) << 2), 8);
+                tile::applyAttributesScalar(pixels, palette, 8);
+                if (attribute & 0x40)
+                    std::reverse(std::begin(pixels), std::end(pixels));
+
+                for (int p = 0; p < 8 && entry[3] + p < kWidth; p++)
+                {
+                    int x = entry[3] + p;
+                    if (!pixels[p] || sprite[x])
+                        continue;
+                    sprite[x] = pixels[p];
+                    spriteFlags[x] = ((attribute & 0x20) ? 0x01 : 0) | (i == 0 ? 0x02 : 0);
+                }
+            }
+            if (!(_mask & 0x04))
+                std::fill(sprite.begin(), sprite.begin() + 8, 0);
+        }
+
+        for (int x = 0; x < kWidth; x++)
+        {
+            std::uint8_t color = backgroundPixels[x];
+            if (sprite[x])
+            {
+                if (color)
+                {
+                    if ((spriteFlags[x] & 0x02) && x != 255 && _sprite0HitDot < 0 && !(_status & 0x40))
+                        _sprite0HitDot = x + 1; // pixel x goes out at dot x + 1
+                    if (!(spriteFlags[x] & 0x01))
+                        color = sprite[x];
+                }
+                else
+                    color = sprite[x];
+            }
+            line[x] = _palette[paletteIndex(color)] & colorMask;
+        }
+    }
+
+    // Next dot on this line where something happens, or the end of the line
+    int nextEventDot() const
+    {
+        int next = kDotsPerLine;
+        auto consider = [&](int dot)
+        {
+            if (dot > _dot && dot < next)
+                next = dot;
+        };
+        if (_scanline < kHeight || _scanline == kPrerenderLine)
+        {
+            consider(1);
+            consider(256);
+            consider(257);
+            consider(_sprite0HitDot);
+            if (_countScanlines && renderingEnabled())
+                consider(kScanlineClockDot);
+            if (_scanline == kPrerenderLine)
+            {
+                consider(304);
+                consider(339);
+            }
+        }
+        else if (_scanline == kVblankLine)
+            consider(1);
+        return next;
+    }
+
+    void handleEvent()
+    {
+        if (_dot == kDotsPerLine)
+        {
+            _dot = 0;
+            _sprite0HitDot = -1;
+            if (++_scanline == kLinesPerFrame)
+            {
+                _scanline = 0;
+                _oddFrame = !_oddFrame;
+            }
+            return;
+        }
+
+        const bool visible = _scanline < kHeight;
+        if (visible && _dot == 1)
+            renderScanline();
+        if (_dot == _sprite0HitDot)
+            _status |= 0x40;
+
+        if (_scanline == kVblankLine && _dot == 1)
+        {
+            _status |= 0x80;
+            _frame++;
+            if (_ctrl & 0x80)
+                _nmiOutput = true;
+        }
+        if (_scanline == kPrerenderLine && _dot == 1)
+            _status &= 0x1F;
+
+        if ((visible || _scanline == kPrerenderLine) && renderingEnabled())
+        {
+            if (_dot == 256)
+                incrementY();
+            else if (_dot == 257)
+                _v = (_v & ~0x041F) | (_t & 0x041F); // horizontal scroll back from t
+            else if (_dot == kScanlineClockDot && _countScanlines)
+                _scanlineClocks++;
+            else if (_dot == 304)
+                _v = (_v & ~0x7BE0) | (_t & 0x7BE0); // vertical scroll, once per frame
+            else if (_dot == 339 && _oddFrame)
+                _dot = 340; // odd frames with rendering on skip the last dot of the pre-render line
+        }
+    }
+
+public:
+    void reset()
+    {
+        _v = _t = 0;
+        _fineX = 0;
+        _writeToggle = false;
+        _readBuffer = _ioLatch = 0;
+        _ctrl = _mask = _status = _oamAddress = 0;
+        _scanline = _dot = 0;
+        _oddFrame = false;
+        _clock = _frame = 0;
+        _nmiOutput = false;
+        _sprite0HitDot = -1;
+        _scanlineClocks = 0;
+    }
+
+    void setMirroring(Mirroring mirroring)
+    {
+        _mirroring = mirroring;
+        static constexpr std::uint8_t layouts[][4] = {{0, 0, 1, 1}, {0, 1, 0, 1}, {0, 0, 0, 0}, {1, 1, 1, 1}};
+        for (int i = 0; i < 4; i++)
+            _nametables[i] = &_vram[layouts[static_cast<int>(mirroring)][i] * 0x400];
+    }
+
+    // Lists the state a save-state keeps, for the savestate.hpp readers and writers. CHR memory belongs
+    // to the cartridge and the framebuffer is redrawn by the next frame, so neither is included.
+    template <typename Self, typename Visitor>
+    static void visitState(Self &ppu, Visitor &visitor)
+    {
+        visitor.value(ppu._v);
+        visitor.value(ppu._t);
+        visitor.value(ppu._fineX);
+        visitor.value(ppu._writeToggle);
+        visitor.value(ppu._readBuffer);
+        visitor.value(ppu._ioLatch);
+        visitor.value(ppu._ctrl);
+        visitor.value(ppu._mask);
+        visitor.value(ppu._status);
+        visitor.value(ppu._oamAddress);
+        visitor.value(ppu._mirroring);
+        visitor.value(ppu._chrBankOffsets);
+        visitor.value(ppu._scanline);
+        visitor.value(ppu._dot);
+        visitor.value(ppu._oddFrame);
+        visitor.value(ppu._clock);
+        visitor.value(ppu._frame);
+        visitor.value(ppu._nmiOutput);
+        visitor.value(ppu._sprite0HitDot);
+        visitor.value(ppu._scanlineClocks);
+        visitor.value(ppu._palette);
+        visitor.block(ppu._vram.data(), ppu._vram.size());
+        visitor.block(ppu._oam.data(), ppu._oam.size());
+    }
+
+    // Rebuilds what follows from loaded state; chrChanged when CHR-RAM was loaded with it
+    void stateLoaded(bool chrChanged)
+    {
+        setMirroring(_mirroring);
+        if (chrChanged)
+            _tiles.invalidateAll();
+    }
+
+    void setSimdLevel(SimdLevel level)
+    {
+        _tiles.setSimdLevel(level);
+        _applyAttributes = tile::attributeApplierFor(level);
+    }
+
+    // Attaches the cartridge's CHR memory with its first 8KB mapped; ram is the same memory when writable
+    void attachChr(const std::uint8_t *chr, std::size_t size, std::uint8_t *ram)
+    {
+        _chr = chr;
+        _chrRam = ram;
+        _tiles.attach(chr, size);
+        for (int slot = 0; slot < 8; slot++)
+            _chrBankOffsets[slot] = slot * 0x400;
+    }
+
+    // Points 1KB of the pattern tables ($0000-$1FFF) at an offset into CHR memory
+    void mapChr(int slot, std::size_t offset)
+    {
+        _chrBankOffsets[slot] = offset;
+    }
+
+    // Advances to the given dot count since reset
+    void run(std::uint64_t targetClock)
+    {
+        while (_clock < targetClock)
+        {
+            std::uint64_t step = nextEventDot() - _dot;
+            if (step > targetClock - _clock)
+            {
+                _dot += static_cast<int>(targetClock - _clock);
+                _clock = targetClock;
+                return;
+            }
+            _dot += static_cast<int>(step);
+            _clock += step;
+            handleEvent();
+        }
+    }
+
+    // Clock at which NMI is next raised if no register is written before then
+    std::uint64_t nextNmiClock() const
+    {
+        if (!(_ctrl & 0x80))
+            return std::numeric_limits<std::uint64_t>::max();
+        return nextVblankClock();
+    }
+
+    // Clock of the next 241:1, assuming rendering stays as it is
+    std::uint64_t nextVblankClock() const
+    {
+        const int position = _scanline * kDotsPerLine + _dot;
+        const int vblank = kVblankLine * kDotsPerLine + 1;
+        if (position < vblank)
+            return _clock + (vblank - position);
+        int frameEnd = kLinesPerFrame * kDotsPerLine;
+        if (_oddFrame && renderingEnabled() && position < kPrerenderLine * kDotsPerLine + 339)
+            frameEnd--;
+        return _clock + (frameEnd - position) + vblank;
+    }
+
+    // Clock of the count-th scanline clock from now, assuming rendering stays as it is
+    std::uint64_t scanlineClockAfter(std::uint32_t count) const
+    {
+        if (!_countScanlines || !renderingEnabled() || count == 0)
+            return std::numeric_limits<std::uint64_t>::max();
+        int line = _scanline;
+        bool odd = _oddFrame;
+        if (_dot < kScanlineClockDot && (line < kHeight || line == kPrerenderLine) && --count == 0)
+            return _clock + (kScanlineClockDot - _dot);
+
+        // The rest of this line, then whole lines; the pre-render line is a dot short on odd frames
+        std::uint64_t next = _clock + (kDotsPerLine - _dot);
+        if (line == kPrerenderLine && odd && _dot < 339)
+            next--;
+        for (;;)
+        {
+            if (++line == kLinesPerFrame)
+            {
+                line = 0;
+                odd = !odd;
+            }
+            if ((line < kHeight || line == kPrerenderLine) && --count == 0)
+                return next + kScanlineClockDot;
+            next += (line == kPrerenderLine && odd) ? kDotsPerLine - 1 : kDotsPerLine;
+        }
+    }
+
+    void setScanlineCounter(bool enabled) { _countScanlines = enabled; }
+
+    std::uint32_t takeScanlineClocks()
+    {
+        std::uint32_t clocks = _scanlineClocks;
+        _scanlineClocks = 0;
+        return clocks;
+    }
+
+    bool takeNmi()
+    {
+        bool raised = _nmiOutput;
+        _nmiOutput = false;
+        return raised;
+    }
+
+    std::uint8_t readRegister(std::uint16_t address)
+    {
+        switch (address & 0x07)
+        {
+        case 2:
+            _ioLatch = (_status & 0xE0) | (_ioLatch & 0x1F);
+            _status &= 0x7F;
+            _writeToggle = false;
+            break;
+        case 4:
+            _ioLatch = _oam[_oamAddress];
+            break;
+        case 7:
+            if ((_v & 0x3FFF) < 0x3F00)
+            {
+                _ioLatch = _readBuffer;
+                _readBuffer = readVideo(_v);
+            }
+            else
+            {
+                // Palette reads are immediate; the buffer gets the nametable byte underneath
+                _ioLatch = readVideo(_v);
+                _readBuffer = readVideo(_v - 0x1000);
+            }
+            incrementVramAddress();
+            break;
+        default:
+            break;
+        }
+        return _ioLatch;
+    }
+
+    void writeRegister(std::uint16_t address, std::uint8_t value)
+    {
+        _ioLatch = value;
+        switch (address & 0x07)
+        {
+        case 0:
+            // Turning NMI on during vblank raises it straight away
+            if (!(_ctrl & 0x80) && (value & 0x80) && (_status & 0x80))
+                _nmiOutput = true;
+            _ctrl = value;
+            _t = (_t & ~0x0C00) | ((value & 0x03) << 10);
+            break;
+        case 1:
+            _mask = value;
+            break;
+        case 3:
+            _oamAddress = value;
+            break;
+        case 4:
+            _oam[_oamAddress++] = value;
+            break;
+        case 5:
+            if (!_writeToggle)
+            {
+                _t = (_t & ~0x001F) | (value >> 3);
+                _fineX = value & 0x07;
+            }
+            else
+                _t = (_t & ~0x73E0) | ((value & 0x07) << 12) | ((value & 0xF8) << 2);
+            _writeToggle = !_writeToggle;
+            break;
+        case 6:
+            if (!_writeToggle)
+                _t = (_t & 0x00FF) | ((value & 0x3F) << 8);
+            else
+            {
+                _t = (_t & 0x7F00) | value;
+                _v = _t;
+            }
+            _writeToggle = !_writeToggle;
+            break;
+        case 7:
+            writeVideo(_v, value);
+            incrementVramAddress();
+            break;
+        default:
+            break;
+        }
+    }
+
+    // One byte of OAM DMA
+    void writeOam(std::uint8_t value)
+    {
+        _oam[_oamAddress++] = value;
+    }
+
+    bool sameStateAs(const PPU &other) const
+    {
+        return _v == other._v && _t == other._t && _fineX == other._fineX && _writeToggle == other._writeToggle &&
+               _readBuffer == other._readBuffer && _ctrl == other._ctrl && _mask == other._mask &&
+               _status == other._status && _oamAddress == other._oamAddress &&
+               _scanline == other._scanline && _dot == other._dot && _clock == other._clock &&
+               _vram == other._vram && _palette == other._palette && _oam == other._oam &&
+               std::equal(framebuffer(), framebuffer() + kWidth * kHeight, other.framebuffer());
+    }
+
+    // Draws the following lines into the given 256x240 buffer, or back into the PPU's own for
+    // nullptr. Switching between vblank and the first line hands over whole frames.
+    void setFramebuffer(std::uint8_t *pixels) { _target = pixels; }
+
+    // Leaves the framebuffer alone from the next line on, doing only what the CPU can tell apart
+    void setSkipDrawing(bool skip) { _skipDrawing = skip; }
+
+    // 256x240 NES color indices (0-63), complete for the last frame once vblank starts
+    const std::uint8_t *framebuffer() const { return _target ? _target : _framebuffer.data(); }
+    std::uint64_t frame() const { return _frame; }
+    std::uint64_t clock() const { return _clock; }
+    int scanline() const { return _scanline; }
+    int dot() const { return _dot; }
+    std::uint16_t vramAddress() const { return _v; }
+    std::uint8_t readBuffer() const { return _readBuffer; }
+};
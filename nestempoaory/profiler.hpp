@@ -0,0 +1,232 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+
+#include "opcodes.hpp"
+
+// Hardware counters come from perf_event_open, which only Linux has; elsewhere they read as unavailable
+#ifndef NES_PERF_EVENTS
+#if defined(__linux__)
+#define NES_PERF_EVENTS 1
+#else
+#define NES_PERF_EVENTS 0
+#endif
+#endif
+
+#if NES_PERF_EVENTS
+#include <cerrno>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Profiling without an external profiler: the host CPU's own counters, read around each emulated frame,
+// and a count and host time for each 6502 opcode the interpreter runs
+namespace profile
+{
+    // Cheapest clock there is: the time-stamp counter on x86, steady_clock nanoseconds elsewhere
+    inline std::uint64_t ticks()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+    }
+
+    // What reading the clock twice costs in ticks, averaged, to take off every timed interval
+    inline double readingCost()
+    {
+        constexpr int kReadings = 4096;
+        std::uint64_t total = 0;
+        for (int i = 0; i < kReadings; i++)
+        {
+            const std::uint64_t start = ticks();
+            total += ticks() - start;
+        }
+        return static_cast<double>(total) / kReadings;
+    }
+
+    // Measures how many ticks a nanosecond is, between construction and now
+    class TickClock
+    {
+    private:
+        std::uint64_t _startTicks = ticks();
+        std::chrono::steady_clock::time_point _start = std::chrono::steady_clock::now();
+
+    public:
+        double ticksPerNanosecond() const
+        {
+            const double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - _start).count();
+            return ns > 0 ? static_cast<double>(ticks() - _startTicks) / ns : 1.0;
+        }
+    };
+}
+
+enum class PerfCounter
+{
+    Cycles,
+    Instructions,
+    BranchMisses,
+    L1Misses, // L1 data cache read misses
+    Count,
+};
+
+// The host counters of the calling thread, user space only so the default perf_event_paranoid allows
+// them. Each one is opened on its own, so a machine or VM without, say, cache events still has the rest.
+class PerfCounters
+{
+public:
+    static constexpr std::size_t kCount = static_cast<std::size_t>(PerfCounter::Count);
+    using Sample = std::array<std::uint64_t, kCount>;
+
+private:
+    std::array<int, kCount> _fds;
+
+public:
+    PerfCounters() { _fds.fill(-1); }
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+    ~PerfCounters() { close(); }
+
+    static const char *name(PerfCounter counter)
+    {
+        constexpr const char *names[] = {"cycles", "instructions", "branch_misses", "l1_misses"};
+        return names[static_cast<std::size_t>(counter)];
+    }
+
+    // Starts every counter the host has; false, with the reason written to errors, if it has none
+    bool open(std::ostream &errors)
+    {
+        close();
+#if NES_PERF_EVENTS
+        const std::uint64_t l1ReadMiss = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        const std::pair<std::uint32_t, std::uint64_t> events[kCount] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+            {PERF_TYPE_HW_CACHE, l1ReadMiss},
+        };
+        int error = 0;
+        for (std::size_t i = 0; i < kCount; i++)
+        {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = events[i].first;
+            attr.config = events[i].second;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            _fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+            if (_fds[i] < 0)
+                error = errno;
+        }
+        if (available())
+            return true;
+        errors << "No hardware counters: perf_event_open failed (" << std::strerror(error) << ")" << std::endl;
+#else
+        errors << "No hardware counters on this platform" << std::endl;
+#endif
+        return false;
+    }
+
+    void close()
+    {
+#if NES_PERF_EVENTS
+        for (int &fd : _fds)
+        {
+            if (fd >= 0)
+                ::close(fd);
+            fd = -1;
+        }
+#endif
+    }
+
+    bool available() const
+    {
+        for (int fd : _fds)
+        {
+            if (fd >= 0)
+                return true;
+        }
+        return false;
+    }
+
+    bool available(PerfCounter counter) const { return _fds[static_cast<std::size_t>(counter)] >= 0; }
+
+    // Running totals; counters that are not there read 0
+    Sample read() const
+    {
+        Sample sample{};
+#if NES_PERF_EVENTS
+        for (std::size_t i = 0; i < kCount; i++)
+        {
+            if (_fds[i] >= 0 && ::read(_fds[i], &sample[i], sizeof(sample[i])) != sizeof(sample[i]))
+                sample[i] = 0;
+        }
+#endif
+        return sample;
+    }
+};
+
+// How often each opcode ran and the host time spent in its handler. Filled in by the emulator while it
+// is attached. A register write that makes the PPU or APU catch up counts towards the instruction doing
+// it; the catching up between instructions does not.
+class OpcodeProfile
+{
+private:
+    std::array<std::uint64_t, 256> _counts{};
+    std::array<std::uint64_t, 256> _ticks{};
+    double _readingCost = profile::readingCost();
+    profile::TickClock _clock;
+
+public:
+    void record(std::uint8_t opcode, std::uint64_t ticks)
+    {
+        _counts[opcode]++;
+        _ticks[opcode] += ticks;
+    }
+
+    std::uint64_t count(std::uint8_t opcode) const { return _counts[opcode]; }
+
+    // One line per opcode that ran, in opcode order: count, total and average host time, and its share
+    // of all the time spent in handlers. The cost of reading the clock is taken off.
+    void writeCsv(std::ostream &out) const
+    {
+        const double ticksPerNs = _clock.ticksPerNanosecond();
+        std::array<double, 256> ticks{};
+        double totalTicks = 0;
+        for (int opcode = 0; opcode < 256; opcode++)
+        {
+            ticks[opcode] = std::max(0.0, static_cast<double>(_ticks[opcode]) - _readingCost * static_cast<double>(_counts[opcode]));
+            totalTicks += ticks[opcode];
+        }
+
+        out << "opcode,mnemonic,mode,count,host_ns,ns_per_execution,time_share\n";
+        for (int opcode = 0; opcode < 256; opcode++)
+        {
+            if (!_counts[opcode])
+                continue;
+            const OpcodeInfo &info = kOpcodeTable[opcode];
+            const double ns = ticks[opcode] / ticksPerNs;
+            out << "0x" << std::hex << std::uppercase << std::setw(2) << std::setfill('0') << opcode
+                << std::dec << std::nouppercase << std::setfill(' ') << ','
+                << mnemonic(info.op) << ',' << addrModeName(info.mode) << ',' << _counts[opcode] << ','
+                << std::fixed << std::setprecision(0) << ns << ',' << std::setprecision(2)
+                << ns / static_cast<double>(_counts[opcode]) << ',' << std::setprecision(4)
+                << (totalTicks > 0 ? ticks[opcode] / totalTicks : 0.0) << '\n';
+        }
+        out << std::defaultfloat;
+    }
+};
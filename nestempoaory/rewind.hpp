@@ -0,0 +1,239 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+#include "nesemulator.hpp"
+
+namespace rle
+{
+    inline std::uint64_t load64(const std::uint8_t *data)
+    {
+        std::uint64_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    inline std::uint8_t *putVarint(std::uint8_t *out, std::size_t value)
+    {
+        while (value >= 0x80)
+        {
+            *out++ = static_cast<std::uint8_t>(value | 0x80);
+            value >>= 7;
+        }
+        *out++ = static_cast<std::uint8_t>(value);
+        return out;
+    }
+
+    inline const std::uint8_t *getVarint(const std::uint8_t *in, std::size_t &value)
+    {
+        value = 0;
+        for (int shift = 0;; shift += 7)
+        {
+            std::uint8_t byte = *in++;
+            value |= static_cast<std::size_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                return in;
+        }
+    }
+
+    // Most bytes encodeXor can write for size bytes of state
+    inline std::size_t maxEncodedSize(std::size_t size)
+    {
+        return size + (size / 8 + 1) * 2 * 10;
+    }
+
+    // Encodes state as its XOR with base: tokens of (equal bytes to skip, literal length, literal XOR
+    // bytes) with varint lengths. Equal stretches are found 8 bytes at a time; a literal runs until 8
+    // equal bytes in a row.
+    inline std::size_t encodeXor(const std::uint8_t *state, const std::uint8_t *base, std::size_t size, std::uint8_t *out)
+    {
+        std::uint8_t *start = out;
+        std::size_t position = 0;
+        while (position < size)
+        {
+            std::size_t literal = position;
+            while (literal + 8 <= size && load64(state + literal) == load64(base + literal))
+                literal += 8;
+            while (literal < size && state[literal] == base[literal])
+                literal++;
+            if (literal == size)
+                break;
+
+            std::size_t end = literal, equal = 0;
+            while (end < size && equal < 8)
+            {
+                equal = state[end] == base[end] ? equal + 1 : 0;
+                end++;
+            }
+            end -= equal;
+
+            out = putVarint(out, literal - position);
+            out = putVarint(out, end - literal);
+            for (std::size_t i = literal; i < end; i++)
+                *out++ = state[i] ^ base[i];
+            position = end;
+        }
+        return static_cast<std::size_t>(out - start);
+    }
+
+    // Applies encodeXor's output to a copy of its base
+    inline void decodeXor(const std::uint8_t *encoded, std::size_t size, std::uint8_t *state)
+    {
+        const std::uint8_t *end = encoded + size;
+        while (encoded < end)
+        {
+            std::size_t skip, length;
+            encoded = getVarint(encoded, skip);
+            encoded = getVarint(encoded, length);
+            state += skip;
+            for (std::size_t i = 0; i < length; i++)
+                *state++ ^= *encoded++;
+        }
+    }
+}
+
+// Per-frame save-states for stepping back in time. Every keyframeInterval frames a whole state is kept;
+// the frames in between are kept as the XOR of their state with that keyframe, run-length encoded.
+// Everything lives in one arena allocated up front; once it is full the oldest keyframe goes, along with
+// the frames encoded against it. Going back N frames restores one keyframe and applies one delta.
+class RewindBuffer
+{
+private:
+    struct Entry
+    {
+        std::size_t offset; // into the arena
+        std::size_t size;
+        std::size_t keyframeOffset; // the keyframe a delta decodes against; its own offset for a keyframe
+        bool keyframe;
+    };
+
+    std::vector<std::uint8_t> _arena;
+    std::size_t _head = 0; // where the next entry goes
+    std::deque<Entry> _entries; // oldest first
+    unsigned _keyframeInterval;
+    unsigned _sinceKeyframe = 0;
+    std::size_t _stateSize = 0;
+    std::vector<std::uint8_t> _state;   // scratch: the state being pushed or restored
+    std::vector<std::uint8_t> _encoded; // scratch: its encoding
+
+    static bool overlaps(const Entry &entry, std::size_t offset, std::size_t size)
+    {
+        return entry.offset < offset + size && offset < entry.offset + entry.size;
+    }
+
+    // How many of the oldest entries have to go to fit size more bytes, and where those bytes then go
+    std::size_t evictionsFor(std::size_t size, std::size_t &offset) const
+    {
+        offset = _head;
+        std::size_t count = 0;
+        if (offset + size > _arena.size())
+        {
+            // Whatever is stored past the head is older than everything before it
+            while (count < _entries.size() && _entries[count].offset >= _head)
+                count++;
+            offset = 0;
+        }
+        while (count < _entries.size() && overlaps(_entries[count], offset, size))
+            count++;
+        // Deltas cannot outlive their keyframe
+        while (count > 0 && count < _entries.size() && !_entries[count].keyframe)
+            count++;
+        return count;
+    }
+
+    void store(const std::uint8_t *data, std::size_t size, bool keyframe)
+    {
+        std::size_t offset;
+        std::size_t evictions = evictionsFor(size, offset);
+        _entries.erase(_entries.begin(), _entries.begin() + static_cast<std::ptrdiff_t>(evictions));
+        std::memcpy(&_arena[offset], data, size);
+        _head = offset + size;
+        _entries.push_back({offset, size, keyframe ? offset : _entries.back().keyframeOffset, keyframe});
+        _sinceKeyframe = keyframe ? 0 : _sinceKeyframe + 1;
+    }
+
+public:
+    explicit RewindBuffer(std::size_t megabytes, unsigned keyframeInterval = 60)
+        : _arena(megabytes << 20), _keyframeInterval(keyframeInterval)
+    {
+    }
+
+    // Keeps the emulator's state as the newest frame; call once per frame. False if the arena cannot
+    // hold even a keyframe.
+    bool push(const NESemulator &emulator)
+    {
+        if (!_stateSize)
+        {
+            _stateSize = emulator.keyframeSize();
+            _state.resize(_stateSize);
+            _encoded.resize(rle::maxEncodedSize(_stateSize));
+        }
+        if (_stateSize > _arena.size() || emulator.saveState(_state.data(), _state.size()) != _stateSize)
+            return false;
+
+        if (!_entries.empty() && _sinceKeyframe + 1 < _keyframeInterval)
+        {
+            const std::size_t keyframeOffset = _entries.back().keyframeOffset;
+            std::size_t size = rle::encodeXor(_state.data(), &_arena[keyframeOffset], _stateSize, _encoded.data());
+
+            // Stored as a delta unless making room would take its own keyframe
+            std::size_t offset;
+            std::size_t evictions = evictionsFor(size, offset);
+            bool keyframeKept = true;
+            for (std::size_t i = 0; i < evictions; i++)
+                keyframeKept = keyframeKept && !(_entries[i].keyframe && _entries[i].offset == keyframeOffset);
+            if (keyframeKept)
+            {
+                store(_encoded.data(), size, false);
+                return true;
+            }
+        }
+        store(_state.data(), _stateSize, true);
+        return true;
+    }
+
+    // Restores the state framesBack frames before the newest one (0 is the newest) and forgets the
+    // frames after it, so history continues from there
+    bool rewind(NESemulator &emulator, std::size_t framesBack)
+    {
+        if (framesBack >= _entries.size())
+            return false;
+        const std::size_t index = _entries.size() - 1 - framesBack;
+        const Entry &entry = _entries[index];
+        std::memcpy(_state.data(), &_arena[entry.keyframeOffset], _stateSize);
+        if (!entry.keyframe)
+            rle::decodeXor(&_arena[entry.offset], entry.size, _state.data());
+        if (!emulator.loadState(_state.data(), _stateSize))
+            return false;
+
+        _sinceKeyframe = 0;
+        for (std::size_t i = index; !_entries[i].keyframe; i--)
+            _sinceKeyframe++;
+        _head = entry.offset + entry.size;
+        _entries.resize(index + 1);
+        return true;
+    }
+
+    // Drops every frame, as after a reset or loading another ROM
+    void clear()
+    {
+        _entries.clear();
+        _head = 0;
+        _sinceKeyframe = 0;
+        _stateSize = 0;
+    }
+
+    std::size_t frames() const { return _entries.size(); }
+
+    std::size_t bytesUsed() const
+    {
+        std::size_t used = 0;
+        for (const Entry &entry : _entries)
+            used += entry.size;
+        return used;
+    }
+};
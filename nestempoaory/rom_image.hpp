@@ -0,0 +1,252 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define NES_ROM_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define NES_ROM_MMAP 0
+#endif
+
+// Nametable layout the header asks for. Four-screen cartridges bring their own extra VRAM.
+enum class HeaderMirroring
+{
+    Horizontal,
+    Vertical,
+    FourScreen,
+};
+
+// A cartridge file as the emulator sees it: the iNES or NES 2.0 header, PRG-ROM and CHR-ROM, all
+// read-only. The file is mapped into memory where the platform has mmap and read in once elsewhere;
+// emulators point their memory map and pattern tables straight into it rather than keeping copies.
+class RomImage
+{
+private:
+    const std::uint8_t *_data = nullptr;
+    std::size_t _size = 0;
+    void *_mapping = nullptr;
+    std::vector<std::uint8_t> _contents; // the file, when it is read rather than mapped
+    std::vector<std::uint8_t> _blankChr; // stands in for CHR-ROM the file is too short to hold
+    std::uint64_t _id = 0;
+
+    bool _nes2 = false;
+    unsigned _mapper = 0;
+    std::size_t _prgOffset = 0;
+    std::size_t _prgSize = 0;
+    std::size_t _chrSize = 0;
+    std::size_t _chrRamSize = 0;
+
+    // NES 2.0 sizes: 12 bits of units, or with the top nibble all ones, 2^exponent * (multiplier * 2 + 1)
+    static std::size_t romSize(std::uint8_t low, std::uint8_t high, std::size_t unit)
+    {
+        if (high == 0x0F)
+            return (std::size_t{1} << (low >> 2)) * ((low & 0x03) * 2 + 1);
+        return ((std::size_t{high} << 8) | low) * unit;
+    }
+
+    void parseHeader()
+    {
+        const std::uint8_t *h = _data;
+        _nes2 = (h[7] & 0x0C) == 0x08;
+        // Old dumping tools left text in bytes 7-15 ("DiskDude!"); such headers only have the low mapper nibble
+        const bool archaic = !_nes2 && (h[12] | h[13] | h[14] | h[15]) != 0;
+
+        _mapper = h[6] >> 4;
+        if (!archaic)
+            _mapper |= h[7] & 0xF0;
+        if (_nes2)
+            _mapper |= (h[8] & 0x0F) << 8;
+
+        _prgSize = _nes2 ? romSize(h[4], h[9] & 0x0F, 0x4000) : h[4] * std::size_t{0x4000};
+        _chrSize = _nes2 ? romSize(h[5], h[9] >> 4, 0x2000) : h[5] * std::size_t{0x2000};
+        _prgOffset = kHeaderSize + (hasTrainer() ? kTrainerSize : 0);
+
+        // CHR-RAM is 8KB unless a NES 2.0 header asks for more
+        _chrRamSize = 0;
+        if (!_chrSize)
+        {
+            const std::size_t requested = _nes2 && (h[11] & 0x0F) ? std::size_t{64} << (h[11] & 0x0F) : 0;
+            _chrRamSize = std::max<std::size_t>(requested, 0x2000);
+        }
+    }
+
+    bool read(const std::string &path, std::ostream &errors)
+    {
+#if NES_ROM_MMAP
+        int file = ::open(path.c_str(), O_RDONLY);
+        if (file < 0)
+        {
+            errors << "Failed to open ROM file: " << path << std::endl;
+            return false;
+        }
+        struct stat status;
+        bool ok = fstat(file, &status) == 0;
+        _size = ok ? static_cast<std::size_t>(status.st_size) : 0;
+        if (ok && _size >= kHeaderSize)
+        {
+            void *mapping = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, file, 0);
+            ok = mapping != MAP_FAILED;
+            if (ok)
+            {
+                _mapping = mapping;
+                _data = static_cast<const std::uint8_t *>(mapping);
+            }
+        }
+        ::close(file);
+        if (!ok)
+        {
+            errors << "Failed to read ROM file: " << path << std::endl;
+            return false;
+        }
+#else
+        std::ifstream romFile(path, std::ios::binary | std::ios::ate);
+        if (!romFile)
+        {
+            errors << "Failed to open ROM file: " << path << std::endl;
+            return false;
+        }
+        _contents.resize(static_cast<std::size_t>(romFile.tellg()));
+        romFile.seekg(0, std::ios::beg);
+        if (!romFile.read(reinterpret_cast<char *>(_contents.data()), static_cast<std::streamsize>(_contents.size())))
+        {
+            errors << "Failed to read ROM file: " << path << std::endl;
+            return false;
+        }
+        _data = _contents.data();
+        _size = _contents.size();
+#endif
+        if (_size < kHeaderSize)
+        {
+            errors << "ROM file too small: " << path << std::endl;
+            return false;
+        }
+        if (std::memcmp(_data, "NES\x1A", 4) != 0)
+        {
+            errors << "Not an iNES ROM: " << path << std::endl;
+            return false;
+        }
+        parseHeader();
+        // Banks are mapped in whole 8KB PRG and 1KB CHR windows, which an odd size would run past the end of
+        if (_prgSize % 0x2000 || _chrSize % 0x400)
+        {
+            errors << "Unsupported PRG-ROM or CHR-ROM size: " << path << std::endl;
+            return false;
+        }
+        if (!_prgSize || _size < _prgOffset + _prgSize)
+        {
+            errors << "ROM file too small: " << path << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+public:
+    static constexpr std::size_t kHeaderSize = 0x10;
+    static constexpr std::size_t kTrainerSize = 0x200;
+
+    RomImage() = default;
+    RomImage(const RomImage &) = delete;
+    RomImage &operator=(const RomImage &) = delete;
+
+    ~RomImage()
+    {
+#if NES_ROM_MMAP
+        if (_mapping)
+            munmap(_mapping, _size);
+#endif
+    }
+
+    // Reads and parses the file; nullptr, with the reason written to errors, if it is no usable ROM
+    static std::shared_ptr<const RomImage> open(const std::string &path, std::ostream &errors)
+    {
+        std::shared_ptr<RomImage> image = std::make_shared<RomImage>();
+        if (!image->read(path, errors))
+            return nullptr;
+
+        image->_id = 0xCBF29CE484222325ull;
+        for (std::size_t i = 0; i < image->_size; i++)
+            image->_id = (image->_id ^ image->_data[i]) * 0x100000001B3ull;
+
+        // A file that stops short of the CHR-ROM its header promises reads as blank CHR
+        if (image->chrSize() && image->_size < image->chrOffset() + image->chrSize())
+            image->_blankChr.assign(image->chrSize(), 0);
+        return image;
+    }
+
+    const std::uint8_t *header() const { return _data; }
+    bool isNes2() const { return _nes2; }
+    unsigned mapper() const { return _mapper; }
+
+    HeaderMirroring mirroring() const
+    {
+        if (_data[6] & 0x08)
+            return HeaderMirroring::FourScreen;
+        return (_data[6] & 0x01) ? HeaderMirroring::Vertical : HeaderMirroring::Horizontal;
+    }
+
+    bool hasBattery() const { return _data[6] & 0x02; }
+
+    // 512 bytes the cartridge has at $7000, between the header and PRG-ROM
+    bool hasTrainer() const { return _data[6] & 0x04; }
+    const std::uint8_t *trainer() const { return _data + kHeaderSize; }
+
+    const std::uint8_t *prg() const { return _data + _prgOffset; }
+    std::size_t prgSize() const { return _prgSize; }
+
+    // CHR-ROM follows PRG-ROM; none means the cartridge has CHR-RAM instead
+    std::size_t chrOffset() const { return _prgOffset + _prgSize; }
+    std::size_t chrSize() const { return _chrSize; }
+    const std::uint8_t *chr() const { return _blankChr.empty() ? _data + chrOffset() : _blankChr.data(); }
+    std::size_t chrRamSize() const { return _chrRamSize; }
+
+    // FNV-1a of the whole file, tying save-states to it
+    std::uint64_t id() const { return _id; }
+};
+
+// Process-wide table of the ROM images in use, so every emulator running a cartridge shares one copy
+// of it however many instances there are. An image lives as long as some emulator holds it; the file
+// is not looked at again while it does.
+class RomCache
+{
+public:
+    static std::shared_ptr<const RomImage> acquire(const std::string &path, std::ostream &errors)
+    {
+        static std::mutex mutex;
+        static std::map<std::string, std::weak_ptr<const RomImage>> images;
+
+        std::error_code error;
+        std::string key = std::filesystem::weakly_canonical(path, error).string();
+        if (error)
+            key = path;
+
+        // Held while a new image is read, so instances starting together still map the file once
+        std::lock_guard<std::mutex> lock(mutex);
+        if (std::shared_ptr<const RomImage> image = images[key].lock())
+            return image;
+
+        for (auto entry = images.begin(); entry != images.end();)
+            entry = entry->second.expired() && entry->first != key ? images.erase(entry) : std::next(entry);
+        std::shared_ptr<const RomImage> image = RomImage::open(path, errors);
+        if (image)
+            images[key] = image;
+        else
+            images.erase(key);
+        return image;
+    }
+};
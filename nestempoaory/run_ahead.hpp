@@ -0,0 +1,134 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "nesemulator.hpp"
+
+// Run-ahead takes away the frames of lag a game has between reading the controller and showing the
+// result. Each frame is run for real, with its sound but without drawing; then the state is saved,
+// the given number of frames is run ahead on the same input, the last of them drawn, and the state is
+// loaded back. What is shown is where the game will be that many frames from now, if the input stays
+// as it is. Frames ahead make no sound and are drawn only where the game could notice otherwise.
+// The state before the frame is saved too: a frame with nothing run ahead of it, because the CPU
+// halted or the state could not be saved, is run again from there and drawn.
+class RunAhead
+{
+public:
+    // Host time spent, in nanoseconds, over all frames run
+    struct Stats
+    {
+        std::uint64_t frames = 0;
+        std::uint64_t realNs = 0;      // the frames themselves
+        std::uint64_t aheadNs = 0;     // the frames ahead
+        std::uint64_t saveLoadNs = 0;  // saving and loading the state
+        std::uint64_t failed = 0;      // frames whose state could not be saved or loaded back
+
+        // Host time per frame in all, to set against the same game run without run-ahead
+        double microsecondsPerFrame() const
+        {
+            return frames ? static_cast<double>(realNs + aheadNs + saveLoadNs) / static_cast<double>(frames) / 1e3 : 0.0;
+        }
+    };
+
+private:
+    int _frames;
+    std::vector<std::uint8_t> _before; // the state before the frame
+    std::vector<std::uint8_t> _state;  // the state after it
+    Stats _stats;
+
+    static std::uint64_t since(std::chrono::steady_clock::time_point start)
+    {
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    // Runs the frame just run again from the state before it, drawn. The sound comes out the same and
+    // was made the first time, so the second run is silent and the synthesizer carries on from it.
+    void redraw(NESemulator &emulator, std::size_t beforeSize)
+    {
+        emulator.setAudioSuspended(true);
+        emulator.setVideoSkipped(false);
+        if (emulator.loadState(_before.data(), beforeSize))
+            emulator.runFrames(1);
+        emulator.setAudioSuspended(false);
+    }
+
+public:
+    explicit RunAhead(int frames) : _frames(frames) {}
+
+    int frames() const { return _frames; }
+    const Stats &stats() const { return _stats; }
+
+    // Runs one frame, and the frames ahead when there are any; the framebuffer then holds the last of
+    // those. Returns the instructions the frame itself ran.
+    std::size_t runFrame(NESemulator &emulator)
+    {
+        auto start = std::chrono::steady_clock::now();
+        if (_frames <= 0)
+        {
+            const std::size_t executed = emulator.runFrames(1);
+            _stats.frames++;
+            _stats.realNs += since(start);
+            return executed;
+        }
+
+        _before.resize(emulator.keyframeSize());
+        const std::size_t beforeSize = emulator.saveState(_before.data(), _before.size());
+        _stats.saveLoadNs += since(start);
+        if (!beforeSize)
+        {
+            start = std::chrono::steady_clock::now();
+            const std::size_t executed = emulator.runFrames(1);
+            _stats.frames++;
+            _stats.failed++;
+            _stats.realNs += since(start);
+            return executed;
+        }
+
+        start = std::chrono::steady_clock::now();
+        emulator.setVideoSkipped(true);
+        const std::size_t executed = emulator.runFrames(1);
+        _stats.frames++;
+        if (emulator.cpuState().halted)
+        {
+            redraw(emulator, beforeSize);
+            _stats.realNs += since(start);
+            return executed;
+        }
+        _stats.realNs += since(start);
+
+        start = std::chrono::steady_clock::now();
+        _state.resize(emulator.keyframeSize());
+        const std::size_t size = emulator.saveState(_state.data(), _state.size());
+        _stats.saveLoadNs += since(start);
+        if (!size)
+        {
+            start = std::chrono::steady_clock::now();
+            _stats.failed++;
+            redraw(emulator, beforeSize);
+            _stats.realNs += since(start);
+            return executed;
+        }
+
+        start = std::chrono::steady_clock::now();
+        emulator.setAudioSuspended(true);
+        if (_frames > 1)
+            emulator.runFrames(static_cast<std::uint64_t>(_frames - 1));
+        emulator.setVideoSkipped(false);
+        emulator.runFrames(1);
+        _stats.aheadNs += since(start);
+
+        start = std::chrono::steady_clock::now();
+        const bool loaded = emulator.loadState(_state.data(), size);
+        if (!loaded)
+            _stats.failed++;
+        emulator.setAudioSuspended(false);
+        // Frames ahead that stay run leave the kept synthesizer that far behind
+        if (!loaded)
+            emulator.restartAudio();
+        _stats.saveLoadNs += since(start);
+        return executed;
+    }
+};
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Save-states are a StateHeader followed by the emulator's fields in the order its visitState lists
+// them, copied straight between the caller's buffer and the emulator; nothing is allocated on the way.
+// Fields come in two kinds: values (registers, counters, small tables) are always stored whole, and
+// memory blocks (RAM, VRAM, OAM, CHR-RAM, the mapper registers) are stored in 256-byte pages. A
+// keyframe stores every page; a delta stores, per block, a mask of the pages that differ from its
+// keyframe and only those pages.
+// Multi-byte fields are in host byte order.
+
+constexpr char kStateMagic[8] = {'N', 'E', 'S', 'S', 'T', 'A', 'T', 'E'};
+constexpr std::uint32_t kStateVersion = 6;
+
+enum class StateKind : std::uint32_t
+{
+    Keyframe,
+    Delta,
+};
+
+struct StateHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    StateKind kind;
+    std::uint64_t romId;     // which cartridge the state belongs to
+    std::uint64_t stamp;     // keyframes: unique per save; deltas: the stamp of their keyframe
+    std::uint64_t size;      // bytes, header included
+};
+
+namespace state
+{
+    constexpr std::size_t kPageSize = 0x100;
+    constexpr std::size_t kPagesPerMask = 64;
+
+    inline std::size_t pageCount(std::size_t size) { return (size + kPageSize - 1) / kPageSize; }
+    inline std::size_t maskCount(std::size_t size) { return (pageCount(size) + kPagesPerMask - 1) / kPagesPerMask; }
+
+    template <typename T>
+    void checkValue()
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "state values are copied as raw bytes");
+    }
+
+    // Counts the bytes a state takes: keyframe size, and the worst case for a delta
+    class Sizer
+    {
+    public:
+        std::size_t keyframe = 0;
+        std::size_t delta = 0;
+
+        template <typename T>
+        void value(const T &)
+        {
+            checkValue<T>();
+            keyframe += sizeof(T);
+            delta += sizeof(T);
+        }
+
+        void block(const void *, std::size_t size)
+        {
+            keyframe += size;
+            delta += size + maskCount(size) * sizeof(std::uint64_t);
+        }
+    };
+
+    // Appends to the caller's buffer; once it runs out, the rest is only counted
+    class Writer
+    {
+    protected:
+        std::uint8_t *_out;
+        std::size_t _capacity;
+        std::size_t _size = 0;
+
+        void put(const void *data, std::size_t size)
+        {
+            if (_size + size <= _capacity)
+                std::memcpy(_out + _size, data, size);
+            _size += size;
+        }
+
+    public:
+        Writer(std::uint8_t *out, std::size_t capacity) : _out(out), _capacity(capacity)
+        {
+        }
+
+        template <typename T>
+        void value(const T &field)
+        {
+            checkValue<T>();
+            put(&field, sizeof(T));
+        }
+
+        void block(const void *data, std::size_t size)
+        {
+            put(data, size);
+        }
+
+        std::size_t size() const { return _size; }
+        bool fits() const { return _size <= _capacity; }
+    };
+
+    // Writes the pages that differ from the keyframe, walking the keyframe's fields alongside
+    class DeltaWriter : public Writer
+    {
+    private:
+        const std::uint8_t *_keyframe;
+
+    public:
+        DeltaWriter(std::uint8_t *out, std::size_t capacity, const std::uint8_t *keyframe)
+            : Writer(out, capacity), _keyframe(keyframe)
+        {
+        }
+
+        template <typename T>
+        void value(const T &field)
+        {
+            Writer::value(field);
+            _keyframe += sizeof(T);
+        }
+
+        void block(const void *data, std::size_t size)
+        {
+            const std::uint8_t *bytes = static_cast<const std::uint8_t *>(data);
+            for (std::size_t first = 0; first < pageCount(size); first += kPagesPerMask)
+            {
+                std::size_t last = std::min(pageCount(size), first + kPagesPerMask);
+                std::uint64_t mask = 0;
+                for (std::size_t page = first; page < last; page++)
+                {
+                    std::size_t offset = page * kPageSize, length = std::min(kPageSize, size - offset);
+                    if (std::memcmp(bytes + offset, _keyframe + offset, length) != 0)
+                        mask |= std::uint64_t{1} << (page - first);
+                }
+                put(&mask, sizeof(mask));
+                for (std::size_t page = first; page < last; page++)
+                {
+                    if (mask & (std::uint64_t{1} << (page - first)))
+                        put(bytes + page * kPageSize, std::min(kPageSize, size - page * kPageSize));
+                }
+            }
+            _keyframe += size;
+        }
+    };
+
+    // Reads a keyframe. With apply off it only checks that the data is long enough, so a load can be
+    // validated in full before it changes anything.
+    class Reader
+    {
+    protected:
+        const std::uint8_t *_in;
+        std::size_t _size;
+        std::size_t _position = 0;
+        bool _apply;
+        bool _ok = true;
+
+    public:
+        Reader(const std::uint8_t *in, std::size_t size, bool apply) : _in(in), _size(size), _apply(apply)
+        {
+        }
+
+        // Next size bytes of the input, or nullptr past its end
+        const std::uint8_t *take(std::size_t size)
+        {
+            if (!_ok || _position + size > _size)
+            {
+                _ok = false;
+                return nullptr;
+            }
+            const std::uint8_t *data = _in + _position;
+            _position += size;
+            return data;
+        }
+
+        template <typename T>
+        void value(T &field)
+        {
+            checkValue<T>();
+            const std::uint8_t *data = take(sizeof(T));
+            if (data && _apply)
+                std::memcpy(&field, data, sizeof(T));
+        }
+
+        void block(void *data, std::size_t size)
+        {
+            const std::uint8_t *source = take(size);
+            if (source && _apply)
+                std::memcpy(data, source, size);
+        }
+
+        // True when everything was there and all of it was used
+        bool complete() const { return _ok && _position == _size; }
+    };
+
+    // Reads a delta, taking unchanged pages from its keyframe
+    class DeltaReader : public Reader
+    {
+    private:
+        Reader _keyframe;
+
+    public:
+        DeltaReader(const std::uint8_t *delta, std::size_t deltaSize, const std::uint8_t *keyframe, std::size_t keyframeSize, bool apply)
+            : Reader(delta, deltaSize, apply), _keyframe(keyframe, keyframeSize, false)
+        {
+        }
+
+        template <typename T>
+        void value(T &field)
+        {
+            Reader::value(field);
+            _keyframe.value(field);
+        }
+
+        void block(void *data, std::size_t size)
+        {
+            std::uint8_t *bytes = static_cast<std::uint8_t *>(data);
+            const std::uint8_t *base = _keyframe.take(size);
+            for (std::size_t first = 0; first < pageCount(size); first += kPagesPerMask)
+            {
+                // The mask is needed to walk the delta, so it is read even when nothing is applied
+                std::uint64_t mask = 0;
+                if (const std::uint8_t *stored = take(sizeof(mask)))
+                    std::memcpy(&mask, stored, sizeof(mask));
+                std::size_t last = std::min(pageCount(size), first + kPagesPerMask);
+                for (std::size_t page = first; page < last; page++)
+                {
+                    std::size_t offset = page * kPageSize, length = std::min(kPageSize, size - offset);
+                    const std::uint8_t *source = (mask & (std::uint64_t{1} << (page - first))) ? take(length) : base ? base + offset : nullptr;
+                    if (source && _apply)
+                        std::memcpy(bytes + offset, source, length);
+                }
+            }
+        }
+
+        bool complete() const { return Reader::complete() && _keyframe.complete(); }
+    };
+}
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// x86-64 always has SSE2; AVX2 versions are compiled with a target attribute and picked at runtime.
+// Build with -DNES_TILE_SIMD=0 for the scalar decoder only.
+#ifndef NES_TILE_SIMD
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define NES_TILE_SIMD 1
+#else
+#define NES_TILE_SIMD 0
+#endif
+#endif
+
+#if NES_TILE_SIMD
+#include <immintrin.h>
+#endif
+
+enum class SimdLevel
+{
+    Scalar,
+    SSE2,
+    AVX2,
+};
+
+// A CHR tile is 16 bytes: 8 rows of the low bit plane, then 8 rows of the high one. Decoded tiles are
+// 64 bytes, one 2-bit pixel per byte, row by row, leftmost pixel (bit 7) first.
+namespace tile
+{
+    constexpr std::size_t kBytes = 16;
+    constexpr std::size_t kPixels = 64;
+
+    using DecodeTiles = void (*)(const std::uint8_t *chr, std::size_t count, std::uint8_t *out);
+    // pixels[i] |= attributes[i] where pixels[i] is not transparent; count is a multiple of 8
+    using ApplyAttributes = void (*)(std::uint8_t *pixels, const std::uint8_t *attributes, std::size_t count);
+
+    inline void decodeTilesScalar(const std::uint8_t *chr, std::size_t count, std::uint8_t *out)
+    {
+        for (std::size_t t = 0; t < count; t++, chr += kBytes)
+        {
+            for (int row = 0; row < 8; row++)
+            {
+                for (int i = 0; i < 8; i++)
+                    *out++ = ((chr[row] >> (7 - i)) & 0x01) | (((chr[row + 8] >> (7 - i)) & 0x01) << 1);
+            }
+        }
+    }
+
+    // Eight pixels per 64-bit word; pixel values are at most 3, so the attribute never carries
+    inline void applyAttributesScalar(std::uint8_t *pixels, const std::uint8_t *attributes, std::size_t count)
+    {
+        for (std::size_t i = 0; i < count; i += 8)
+        {
+            std::uint64_t p, a;
+            std::memcpy(&p, pixels + i, 8);
+            std::memcpy(&a, attributes + i, 8);
+            std::uint64_t opaque = ((p | (p >> 1)) & 0x0101010101010101ull) * 0xFF;
+            p |= a & opaque;
+            std::memcpy(pixels + i, &p, 8);
+        }
+    }
+
+#if NES_TILE_SIMD
+    // Two rows per vector: each plane byte is broadcast over 8 lanes and tested against its pixel's bit
+    inline void decodeTilesSSE2(const std::uint8_t *chr, std::size_t count, std::uint8_t *out)
+    {
+        const __m128i bits = _mm_setr_epi8(char(0x80), 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+                                           char(0x80), 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+        const __m128i one = _mm_set1_epi8(1), two = _mm_set1_epi8(2);
+        for (std::size_t t = 0; t < count; t++, chr += kBytes)
+        {
+            for (int row = 0; row < 8; row += 2, out += 16)
+            {
+                __m128i low = _mm_unpacklo_epi64(_mm_set1_epi8(char(chr[row])), _mm_set1_epi8(char(chr[row + 1])));
+                __m128i high = _mm_unpacklo_epi64(_mm_set1_epi8(char(chr[row + 8])), _mm_set1_epi8(char(chr[row + 9])));
+                low = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(low, bits), bits), one);
+                high = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(high, bits), bits), two);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_or_si128(low, high));
+            }
+        }
+    }
+
+    inline void applyAttributesSSE2(std::uint8_t *pixels, const std::uint8_t *attributes, std::size_t count)
+    {
+        std::size_t i = 0;
+        for (; i + 16 <= count; i += 16)
+        {
+            __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pixels + i));
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(attributes + i));
+            __m128i transparent = _mm_cmpeq_epi8(p, _mm_setzero_si128());
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(pixels + i), _mm_or_si128(p, _mm_andnot_si128(transparent, a)));
+        }
+        applyAttributesScalar(pixels + i, attributes + i, count - i);
+    }
+
+    // Four rows per vector: the whole tile is broadcast to both lanes and each row byte shuffled into place
+    __attribute__((target("avx2"))) inline void decodeTilesAVX2(const std::uint8_t *chr, std::size_t count, std::uint8_t *out)
+    {
+        const __m256i bits = _mm256_set1_epi64x(0x0102040810204080ll);
+        const __m256i one = _mm256_set1_epi8(1), two = _mm256_set1_epi8(2);
+        const __m256i rows01_23 = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                                   2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+        const __m256i four = _mm256_set1_epi8(4), eight = _mm256_set1_epi8(8);
+        for (std::size_t t = 0; t < count; t++, chr += kBytes)
+        {
+            const __m256i tile = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(chr)));
+            __m256i index = rows01_23;
+            for (int half = 0; half < 2; half++, out += 32, index = _mm256_add_epi8(index, four))
+            {
+                __m256i low = _mm256_shuffle_epi8(tile, index);
+                __m256i high = _mm256_shuffle_epi8(tile, _mm256_add_epi8(index, eight));
+                low = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(low, bits), bits), one);
+                high = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(high, bits), bits), two);
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), _mm256_or_si256(low, high));
+            }
+        }
+    }
+
+    __attribute__((target("avx2"))) inline void applyAttributesAVX2(std::uint8_t *pixels, const std::uint8_t *attributes, std::size_t count)
+    {
+        std::size_t i = 0;
+        for (; i + 32 <= count; i += 32)
+        {
+            __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pixels + i));
+            __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(attributes + i));
+            __m256i transparent = _mm256_cmpeq_epi8(p, _mm256_setzero_si256());
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(pixels + i), _mm256_or_si256(p, _mm256_andnot_si256(transparent, a)));
+        }
+        applyAttributesSSE2(pixels + i, attributes + i, count - i);
+    }
+#endif
+
+    inline SimdLevel detectSimdLevel()
+    {
+#if NES_TILE_SIMD
+        if (__builtin_cpu_supports("avx2"))
+            return SimdLevel::AVX2;
+        return SimdLevel::SSE2;
+#else
+        return SimdLevel::Scalar;
+#endif
+    }
+
+    inline DecodeTiles decoderFor(SimdLevel level)
+    {
+#if NES_TILE_SIMD
+        if (level == SimdLevel::AVX2)
+            return &decodeTilesAVX2;
+        if (level == SimdLevel::SSE2)
+            return &decodeTilesSSE2;
+#endif
+        (void)level;
+        return &decodeTilesScalar;
+    }
+
+    inline ApplyAttributes attributeApplierFor(SimdLevel level)
+    {
+#if NES_TILE_SIMD
+        if (level == SimdLevel::AVX2)
+            return &applyAttributesAVX2;
+        if (level == SimdLevel::SSE2)
+            return &applyAttributesSSE2;
+#endif
+        (void)level;
+        return &applyAttributesScalar;
+    }
+}
+
+// Every tile of the CHR memory kept decoded. CHR-ROM is decoded in one pass when attached;
+// a write to CHR-RAM marks its tile stale, and the tile is decoded again the next time it is drawn.
+class TileCache
+{
+private:
+    const std::uint8_t *_chr = nullptr;
+    std::size_t _tiles = 0;
+    std::vector<std::uint8_t> _decoded;
+    std::vector<std::uint8_t> _stale;
+    bool _anyStale = false;
+    tile::DecodeTiles _decode = &tile::decodeTilesScalar;
+
+public:
+    void setSimdLevel(SimdLevel level)
+    {
+        _decode = tile::decoderFor(level);
+    }
+
+    void attach(const std::uint8_t *chr, std::size_t size)
+    {
+        _chr = chr;
+        _tiles = size / tile::kBytes;
+        _decoded.assign(_tiles * tile::kPixels, 0);
+        _stale.assign(_tiles, 0);
+        _anyStale = false;
+        _decode(_chr, _tiles, _decoded.data());
+    }
+
+    void invalidate(std::size_t chrAddress)
+    {
+        _stale[chrAddress / tile::kBytes] = 1;
+        _anyStale = true;
+    }
+
+    void invalidateAll()
+    {
+        std::fill(_stale.begin(), _stale.end(), 1);
+        _anyStale = true;
+    }
+
+    // Decoded pixels of the row a pattern address selects (either bit plane's address works)
+    const std::uint8_t *row(std::size_t chrAddress)
+    {
+        std::size_t index = chrAddress / tile::kBytes;
+        if (_anyStale && _stale[index])
+        {
+            _decode(_chr + index * tile::kBytes, 1, &_decoded[index * tile::kPixels]);
+            _stale[index] = 0;
+        }
+        return &_decoded[index * tile::kPixels + (chrAddress & 0x07) * 8];
+    }
+};
+
+// Checks the vector decoders against the scalar ones on real pattern data
+inline bool verifyTileDecoders(const std::uint8_t *chr, std::size_t size, SimdLevel level)
+{
+    std::size_t tiles = size / tile::kBytes;
+    std::vector<std::uint8_t> expected(tiles * tile::kPixels), actual(tiles * tile::kPixels);
+    tile::decodeTilesScalar(chr, tiles, expected.data());
+    tile::decoderFor(level)(chr, tiles, actual.data());
+    if (expected != actual)
+        return false;
+
+    // Attributes from the pattern bytes themselves, cut down to the 4 palette selections
+    std::vector<std::uint8_t> attributes(expected.size());
+    for (std::size_t i = 0; i < attributes.size(); i++)
+        attributes[i] = (chr[i % size] & 0x03) << 2;
+    tile::applyAttributesScalar(expected.data(), attributes.data(), expected.size());
+    tile::attributeApplierFor(level)(actual.data(), attributes.data(), actual.size());
+    return expected == actual;
+}
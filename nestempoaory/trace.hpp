@@ -0,0 +1,391 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "opcodes.hpp"
+
+enum class TraceKind : std::uint8_t
+{
+    Instruction,
+    Reset,
+};
+
+// One instruction as the CPU is about to execute it, or the reset. Written to disk as is, in host
+// byte order; the file header records the layout version and record size.
+struct TraceRecord
+{
+    std::uint64_t cycle;    // CPU cycles since power-up, the 7-cycle reset sequence included
+    std::uint64_t ppuClock; // PPU dots since power-up
+    std::uint16_t pc;
+    std::uint16_t address; // effective address, branch target or jump target, when the mode has one
+    std::uint16_t scanline;
+    std::uint16_t dot;
+    std::uint16_t vramAddress;
+    std::uint8_t bytes[3]; // opcode and operands; how many are used follows from the opcode
+    std::uint8_t a, x, y, sp, status;
+    std::uint8_t readBuffer;
+    TraceKind kind;
+    std::uint8_t reserved[4];
+};
+
+static_assert(sizeof(TraceRecord) == 40, "trace files depend on the record layout");
+
+struct TraceFileHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t recordSize;
+};
+
+constexpr char kTraceMagic[8] = {'N', 'E', 'S', 'T', 'R', 'A', 'C', 'E'};
+constexpr std::uint32_t kTraceVersion = 1;
+
+// Single-producer single-consumer ring of trace records. The emulator thread pushes, the drain thread
+// takes whole contiguous runs; head and tail only ever grow and are masked on access.
+class TraceRing
+{
+private:
+    std::vector<TraceRecord> _records;
+    std::size_t _mask;
+    alignas(64) std::atomic<std::size_t> _head{0};
+    std::size_t _cachedTail = 0; // producer's last view of _tail, so a push rarely touches the consumer's line
+    alignas(64) std::atomic<std::size_t> _tail{0};
+
+public:
+    // capacity has to be a power of two
+    explicit TraceRing(std::size_t capacity) : _records(capacity), _mask(capacity - 1)
+    {
+    }
+
+    bool tryPush(const TraceRecord &record)
+    {
+        const std::size_t head = _head.load(std::memory_order_relaxed);
+        if (head - _cachedTail == _records.size())
+        {
+            _cachedTail = _tail.load(std::memory_order_acquire);
+            if (head - _cachedTail == _records.size())
+                return false;
+        }
+        _records[head & _mask] = record;
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Oldest unread records that are contiguous in memory; returns how many
+    std::size_t peek(const TraceRecord *&first) const
+    {
+        const std::size_t tail = _tail.load(std::memory_order_relaxed);
+        const std::size_t available = _head.load(std::memory_order_acquire) - tail;
+        const std::size_t untilWrap = _records.size() - (tail & _mask);
+        first = &_records[tail & _mask];
+        return available < untilWrap ? available : untilWrap;
+    }
+
+    void release(std::size_t count)
+    {
+        _tail.store(_tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+};
+
+// Hands trace records to a consumer on a background thread, by default one writing them to a file.
+// record() never formats or does I/O; when the consumer falls behind and the ring is full it waits
+// rather than drop records.
+class TraceRecorder
+{
+public:
+    // Called on the drain thread with records in the order they were recorded
+    using Consumer = std::function<void(const TraceRecord *records, std::size_t count)>;
+
+private:
+    TraceRing _ring;
+    Consumer _consume;
+    std::ofstream _file;
+    std::thread _drain;
+    std::atomic<bool> _stopping{false};
+    std::uint64_t _stalls = 0;
+
+    void drainLoop()
+    {
+        for (;;)
+        {
+            // Read before peeking: everything pushed before close() is then visible
+            const bool stopping = _stopping.load(std::memory_order_acquire);
+            const TraceRecord *first = nullptr;
+            std::size_t count = _ring.peek(first);
+            if (count)
+            {
+                _consume(first, count);
+                _ring.release(count);
+                continue;
+            }
+            if (stopping)
+                break;
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+
+public:
+    explicit TraceRecorder(std::size_t capacity = 1 << 16) : _ring(capacity)
+    {
+    }
+
+    ~TraceRecorder()
+    {
+        close();
+    }
+
+    TraceRecorder(const TraceRecorder &) = delete;
+    TraceRecorder &operator=(const TraceRecorder &) = delete;
+
+    // Writes the records to a trace file, after a TraceFileHeader
+    bool open(const std::string &path)
+    {
+        _file.open(path, std::ios::binary | std::ios::trunc);
+        if (!_file)
+        {
+            std::cerr << "Failed to open trace file: " << path << std::endl;
+            return false;
+        }
+
+        TraceFileHeader header{};
+        std::memcpy(header.magic, kTraceMagic, sizeof(header.magic));
+        header.version = kTraceVersion;
+        header.recordSize = sizeof(TraceRecord);
+        _file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+        open([this](const TraceRecord *records, std::size_t count)
+             { _file.write(reinterpret_cast<const char *>(records), static_cast<std::streamsize>(count * sizeof(TraceRecord))); });
+        return true;
+    }
+
+    void open(Consumer consumer)
+    {
+        _consume = std::move(consumer);
+        _drain = std::thread(&TraceRecorder::drainLoop, this);
+    }
+
+    void record(const TraceRecord &record)
+    {
+        while (!_ring.tryPush(record))
+        {
+            _stalls++;
+            std::this_thread::yield();
+        }
+    }
+
+    // Waits until the consumer has had everything recorded so far
+    void close()
+    {
+        if (!_drain.joinable())
+            return;
+        _stopping.store(true, std::memory_order_release);
+        _drain.join();
+        if (_file.is_open())
+            _file.close();
+    }
+
+    // How often record() found the ring full
+    std::uint64_t stalls() const { return _stalls; }
+};
+
+// Which columns a text trace has; the reference traces grew them as the tests did
+enum class TraceColumns
+{
+    Registers, // A, X, Y and the cycle (Tracelogs 1 and 2)
+    Flags,     // and the status flags (3)
+    Stack,     // and the stack pointer (4 to 6)
+    Ppu,       // and the PPU position, VRAM address and read buffer (7)
+};
+
+namespace trace
+{
+    // Visual column at the end of the line with 8-wide tab stops
+    inline std::size_t column(const std::string &line)
+    {
+        std::size_t column = 0;
+        for (char c : line)
+            column = c == '\t' ? (column + 8) & ~std::size_t{7} : column + 1;
+        return column;
+    }
+
+    // Pads with tabs up to the given column, with at least one tab
+    inline void tabTo(std::string &line, std::size_t target)
+    {
+        do
+            line += '\t';
+        while (column(line) < target);
+    }
+
+    inline std::size_t instructionLength(std::uint8_t opcode)
+    {
+        const OpcodeInfo &info = kOpcodeTable[opcode];
+        // BRK skips a padding byte, and the reference traces show it
+        if (info.op == Op::BRK)
+            return 2;
+        return 1 + operandSize(info.mode);
+    }
+
+    // The instruction as the reference traces write it, e.g. "LDA $801A, X -> $8025"
+    inline std::string disassemble(const TraceRecord &record)
+    {
+        const OpcodeInfo &info = kOpcodeTable[record.bytes[0]];
+        const unsigned zp = record.bytes[1];
+        const unsigned absolute = record.bytes[1] | (record.bytes[2] << 8);
+        const unsigned target = record.address;
+        char operand[48] = "";
+        switch (info.mode)
+        {
+        case AddrMode::Implied:
+            break;
+        case AddrMode::Accumulator:
+            std::snprintf(operand, sizeof(operand), "A");
+            break;
+        case AddrMode::Immediate:
+            std::snprintf(operand, sizeof(operand), "#%02X", zp);
+            break;
+        case AddrMode::ZeroPage:
+            std::snprintf(operand, sizeof(operand), "<$%02X", zp);
+            break;
+        case AddrMode::ZeroPageX:
+        case AddrMode::ZeroPageY:
+            std::snprintf(operand, sizeof(operand), "<$%02X, %c -> $%02X", zp, info.mode == AddrMode::ZeroPageX ? 'X' : 'Y', target);
+            break;
+        case AddrMode::Absolute:
+            std::snprintf(operand, sizeof(operand), "$%04X", absolute);
+            break;
+        case AddrMode::AbsoluteX:
+        case AddrMode::AbsoluteY:
+            std::snprintf(operand, sizeof(operand), "$%04X, %c -> $%04X", absolute, info.mode == AddrMode::AbsoluteX ? 'X' : 'Y', target);
+            break;
+        case AddrMode::Indirect:
+            std::snprintf(operand, sizeof(operand), "($%04X) -> $%04X", absolute, target);
+            break;
+        case AddrMode::IndirectX:
+            std::snprintf(operand, sizeof(operand), "($%04X, X) -> $%04X", zp, target);
+            break;
+        case AddrMode::IndirectY:
+            std::snprintf(operand, sizeof(operand), "($%04X), Y -> $%04X", zp, target);
+            break;
+        case AddrMode::Relative:
+            std::snprintf(operand, sizeof(operand), "$%04X", target);
+            break;
+        }
+
+        std::string text = mnemonic(info.op);
+        text += ' ';
+        text += operand;
+
+        // Data port accesses also show the VRAM address they go to
+        const bool dataAccess = info.mode != AddrMode::Implied && info.mode != AddrMode::Accumulator &&
+                                info.mode != AddrMode::Immediate && info.mode != AddrMode::Relative &&
+                                info.op != Op::JMP && info.op != Op::JSR;
+        if (dataAccess && target >= 0x2000 && target < 0x4000 && (target & 0x07) == 0x07)
+        {
+            char port[24];
+            std::snprintf(port, sizeof(port), " | PPU[$%04X]", record.vramAddress & 0x3FFF);
+            text += port;
+        }
+        return text;
+    }
+
+    // One line of a reference trace, without the line ending
+    inline std::string formatLine(const TraceRecord &record, TraceColumns columns)
+    {
+        char field[64];
+        std::snprintf(field, sizeof(field), "$%04X", record.kind == TraceKind::Reset ? 0xFFFF : record.pc);
+        std::string line = field;
+        tabTo(line, 8);
+
+        if (record.kind == TraceKind::Reset)
+        {
+            line += "--";
+        }
+        else
+        {
+            for (std::size_t i = 0; i < instructionLength(record.bytes[0]); i++)
+            {
+                std::snprintf(field, sizeof(field), "%02X ", record.bytes[i]);
+                line += field;
+            }
+        }
+        tabTo(line, 24);
+
+        line += record.kind == TraceKind::Reset ? "RESET" : disassemble(record);
+        tabTo(line, 48);
+
+        std::snprintf(field, sizeof(field), "A:%02X\tX:%02X\tY:%02X\t", record.a, record.x, record.y);
+        line += field;
+        if (columns >= TraceColumns::Stack)
+        {
+            std::snprintf(field, sizeof(field), "SP:%02X\t", record.sp);
+            line += field;
+        }
+        if (columns >= TraceColumns::Flags)
+        {
+            const char *flags = "NV--DIZC";
+            for (int bit = 7; bit >= 0; bit--)
+            {
+                char flag = flags[7 - bit];
+                line += (flag == '-' || (record.status >> bit) & 0x01) ? flag : static_cast<char>(flag + ('a' - 'A'));
+            }
+            line += '\t';
+        }
+        std::snprintf(field, sizeof(field), "Cycle: %llu", static_cast<unsigned long long>(record.cycle));
+        line += field;
+
+        if (columns >= TraceColumns::Ppu)
+        {
+            line += '\t';
+            const std::size_t start = column(line);
+            std::snprintf(field, sizeof(field), "PPU_cycle: %llu (%u, %u)", static_cast<unsigned long long>(record.ppuClock),
+                          record.scanline, record.dot);
+            line += field;
+            tabTo(line, start + 32);
+            std::snprintf(field, sizeof(field), "VRAMAddress:%04X\tPPUReadBuffer:%02X", record.vramAddress, record.readBuffer);
+            line += field;
+        }
+        return line;
+    }
+
+    // Checks the header of a binary trace and leaves the stream at the first record
+    inline bool readHeader(std::istream &in)
+    {
+        TraceFileHeader header{};
+        if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)))
+            return false;
+        return std::memcmp(header.magic, kTraceMagic, sizeof(header.magic)) == 0 &&
+               header.version == kTraceVersion && header.recordSize == sizeof(TraceRecord);
+    }
+
+    // Reads the next record; false at the end of the trace
+    inline bool readRecord(std::istream &in, TraceRecord &record)
+    {
+        return static_cast<bool>(in.read(reinterpret_cast<char *>(&record), sizeof(record)));
+    }
+}
+
+// Renders a binary trace as text in the format of Tracelogs/*.txt, which use CRLF line endings
+inline bool formatTrace(std::istream &in, std::ostream &out, TraceColumns columns, const char *lineEnd = "\r\n")
+{
+    if (!trace::readHeader(in))
+    {
+        std::cerr << "Not a trace file, or one from another version" << std::endl;
+        return false;
+    }
+    TraceRecord record;
+    while (trace::readRecord(in, record))
+    {
+        out << trace::formatLine(record, columns) << lineEnd;
+    }
+    return static_cast<bool>(out);
+}
@@ -0,0 +1,148 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "nesemulator.hpp"
+#include "trace_diff.hpp"
+
+// Runs ROMs against their reference traces and reports the first line where each one differs.
+// Pairs run in parallel, one per core.
+
+namespace
+{
+    struct Job
+    {
+        std::string rom;
+        std::string reference;
+        bool ok = false;
+        std::string report;
+    };
+
+    int usage()
+    {
+        std::cerr << "Usage: nes_trace_diff [--jobs N] [--dispatch table|threaded]\n"
+                     "                      (--all DIR | <rom> <reference> [<rom> <reference> ...])\n"
+                     "--all pairs every DIR/Tracelogs/NAME.txt with DIR/NAME.nes."
+                  << std::endl;
+        return 2;
+    }
+
+    // The block cache records no trace, so a traced run in predecoded or tiered mode would go through
+    // the handler table and test nothing of it; those modes are checked in lockstep instead
+    bool parseDispatch(const std::string &name, DispatchMode &mode)
+    {
+        if (name == "table")
+            mode = DispatchMode::Table;
+        else if (name == "threaded")
+            mode = DispatchMode::Threaded;
+        else if (name == "predecoded" || name == "tiered")
+        {
+            std::cerr << "Traces run through the handler table in " << name << " mode; compare it with "
+                      << "`nes_verify --verify-dispatch` instead" << std::endl;
+            return false;
+        }
+        else
+            return false;
+        return true;
+    }
+
+    void addReferencePairs(const std::filesystem::path &directory, std::vector<Job> &jobs)
+    {
+        std::vector<std::filesystem::path> references;
+        for (const auto &entry : std::filesystem::directory_iterator(directory / "Tracelogs"))
+        {
+            if (entry.path().extension() == ".txt")
+                references.push_back(entry.path());
+        }
+        std::sort(references.begin(), references.end());
+        for (const auto &reference : references)
+        {
+            std::filesystem::path rom = directory / reference.stem();
+            rom += ".nes";
+            if (std::filesystem::exists(rom))
+                jobs.push_back({rom.string(), reference.string(), false, ""});
+        }
+    }
+
+    void runJob(Job &job, DispatchMode mode)
+    {
+        TraceDiffer differ;
+        if (!differ.open(job.reference))
+        {
+            job.report = job.reference + ": cannot be read";
+            return;
+        }
+
+        NESemulator emulator(job.rom);
+        emulator.setDispatchMode(mode);
+        emulator.startTrace([&differ](const TraceRecord *records, std::size_t count)
+                            { differ.consume(records, count); });
+        if (emulator.init())
+        {
+            // The differ sees records a little after they are made, so check in between chunks
+            while (!emulator.cpuState().halted && !differ.diverged())
+                emulator.runInstructions(1024);
+        }
+        emulator.stopTrace();
+
+        job.ok = differ.finish();
+        job.report = differ.report();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<Job> jobs;
+    unsigned workers = std::max(1u, std::thread::hardware_concurrency());
+    DispatchMode mode = DispatchMode::Table;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (option == "--jobs" && hasValue)
+            workers = std::max(1, std::atoi(argv[++i]));
+        else if (option == "--dispatch" && hasValue)
+        {
+            if (!parseDispatch(argv[++i], mode))
+                return usage();
+        }
+        else if (option == "--all" && hasValue)
+            addReferencePairs(argv[++i], jobs);
+        else if (option.rfind("--", 0) != 0 && hasValue)
+        {
+            jobs.push_back({option, argv[i + 1], false, ""});
+            i++;
+        }
+        else
+            return usage();
+    }
+    if (jobs.empty())
+        return usage();
+
+    std::atomic<std::size_t> next{0};
+    std::vector<std::thread> threads;
+    for (unsigned w = 0; w < std::min<std::size_t>(workers, jobs.size()); w++)
+    {
+        threads.emplace_back([&]
+                             {
+                                 for (std::size_t j = next++; j < jobs.size(); j = next++)
+                                     runJob(jobs[j], mode); });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+
+    std::size_t passed = 0;
+    for (const Job &job : jobs)
+    {
+        std::cout << job.report << std::endl;
+        passed += job.ok;
+    }
+    std::cout << passed << " of " << jobs.size() << " traces match" << std::endl;
+    return passed == jobs.size() ? 0 : 1;
+}
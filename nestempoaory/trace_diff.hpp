@@ -0,0 +1,184 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "trace.hpp"
+
+// Compares trace records against a reference trace as they arrive. Each record is formatted with
+// the reference's columns and checked against the reference's next line, so neither trace is ever
+// held in memory; the first line that differs ends the comparison.
+class TraceDiffer
+{
+private:
+    using Fields = std::vector<std::pair<std::string, std::string>>;
+
+    std::ifstream _reference;
+    std::string _referencePath;
+    TraceColumns _columns = TraceColumns::Registers;
+    std::uint64_t _line = 0;
+    std::atomic<bool> _diverged{false};
+    std::string _report;
+
+    bool nextReferenceLine(std::string &line)
+    {
+        if (!std::getline(_reference, line))
+            return false;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        _line++;
+        return true;
+    }
+
+    // The reference's reset line shows every column the file has
+    static TraceColumns columnsOf(const std::string &line)
+    {
+        if (line.find("PPU_cycle:") != std::string::npos)
+            return TraceColumns::Ppu;
+        if (line.find("SP:") != std::string::npos)
+            return TraceColumns::Stack;
+        if (line.find("--d") != std::string::npos || line.find("--D") != std::string::npos)
+            return TraceColumns::Flags;
+        return TraceColumns::Registers;
+    }
+
+    // Splits a line on its tabs and names the fields: PC, bytes and instruction by position, the rest
+    // by the label before their colon, the status flags as P
+    static Fields fieldsOf(const std::string &line)
+    {
+        static const char *const leading[] = {"PC", "bytes", "instruction"};
+        Fields fields;
+        std::istringstream in(line);
+        std::string text;
+        while (std::getline(in, text, '\t'))
+        {
+            if (text.empty())
+                continue;
+            if (fields.size() < 3)
+            {
+                fields.emplace_back(leading[fields.size()], text);
+                continue;
+            }
+            std::size_t colon = text.find(':');
+            if (text.size() == 8 && text.compare(2, 2, "--") == 0)
+                fields.emplace_back("P", text);
+            else if (colon != std::string::npos)
+                fields.emplace_back(text.substr(0, colon), text.substr(text[colon + 1] == ' ' ? colon + 2 : colon + 1));
+            else
+                fields.emplace_back("?", text);
+        }
+        return fields;
+    }
+
+    static std::string flagDiff(const std::string &expected, const std::string &actual)
+    {
+        std::string diff;
+        for (std::size_t i = 0; i < expected.size() && i < actual.size(); i++)
+        {
+            if (expected[i] == actual[i])
+                continue;
+            bool set = expected[i] >= 'A' && expected[i] <= 'Z';
+            diff += diff.empty() ? " (" : ", ";
+            diff += static_cast<char>(expected[i] & ~0x20);
+            diff += set ? " should be set" : " should be clear";
+        }
+        return diff.empty() ? diff : diff + ")";
+    }
+
+    void diverge(const std::string &report)
+    {
+        _report = report;
+        _diverged.store(true, std::memory_order_release);
+    }
+
+    void compare(const std::string &expected, const std::string &actual)
+    {
+        std::ostringstream report;
+        report << _referencePath << ":" << _line << ": differs\n"
+               << "  expected: " << expected << "\n"
+               << "  actual:   " << actual;
+
+        const Fields expectedFields = fieldsOf(expected), actualFields = fieldsOf(actual);
+        for (const auto &field : expectedFields)
+        {
+            auto match = std::find_if(actualFields.begin(), actualFields.end(), [&field](const auto &other)
+                                      { return other.first == field.first; });
+            if (match == actualFields.end())
+                report << "\n  " << field.first << ": missing";
+            else if (match->second != field.second)
+            {
+                report << "\n  " << field.first << ": expected " << field.second << ", got " << match->second;
+                if (field.first == "P")
+                    report << flagDiff(field.second, match->second);
+            }
+        }
+        diverge(report.str());
+    }
+
+public:
+    bool open(const std::string &referencePath)
+    {
+        _referencePath = referencePath;
+        _reference.open(referencePath, std::ios::binary);
+        std::string first;
+        if (!_reference || !std::getline(_reference, first))
+        {
+            std::cerr << "Failed to read reference trace: " << referencePath << std::endl;
+            return false;
+        }
+        _columns = columnsOf(first);
+        _reference.seekg(0);
+        return true;
+    }
+
+    // Runs on the recorder's drain thread
+    void consume(const TraceRecord *records, std::size_t count)
+    {
+        for (std::size_t i = 0; i < count && !diverged(); i++)
+        {
+            std::string actual = trace::formatLine(records[i], _columns);
+            std::string expected;
+            if (!nextReferenceLine(expected))
+            {
+                std::ostringstream report;
+                report << _referencePath << ":" << _line << ": the reference ends here, the emulator went on with\n"
+                       << "  actual:   " << actual;
+                diverge(report.str());
+            }
+            else if (actual != expected)
+            {
+                compare(expected, actual);
+            }
+        }
+    }
+
+    // Call once recording has stopped: true if the whole reference was matched
+    bool finish()
+    {
+        std::string expected;
+        if (!diverged() && nextReferenceLine(expected))
+        {
+            std::ostringstream report;
+            report << _referencePath << ":" << _line << ": the emulator stopped before\n"
+                   << "  expected: " << expected;
+            diverge(report.str());
+        }
+        if (!diverged())
+        {
+            std::ostringstream report;
+            report << _referencePath << ": all " << _line << " lines match";
+            _report = report.str();
+        }
+        return !diverged();
+    }
+
+    bool diverged() const { return _diverged.load(std::memory_order_acquire); }
+    const std::string &report() const { return _report; }
+};
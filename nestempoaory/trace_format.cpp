@@ -0,0 +1,63 @@
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "trace.hpp"
+
+// Renders a binary trace recorded with --trace as text in the format of Tracelogs/*.txt
+
+namespace
+{
+    int usage()
+    {
+        std::cerr << "Usage: nes_trace_format <trace> [--columns registers|flags|stack|ppu] [--lf]\n"
+                     "Writes the trace to stdout with the PPU columns and CRLF line endings unless told otherwise."
+                  << std::endl;
+        return 2;
+    }
+
+    bool parseColumns(const std::string &name, TraceColumns &columns)
+    {
+        if (name == "registers")
+            columns = TraceColumns::Registers;
+        else if (name == "flags")
+            columns = TraceColumns::Flags;
+        else if (name == "stack")
+            columns = TraceColumns::Stack;
+        else if (name == "ppu")
+            columns = TraceColumns::Ppu;
+        else
+            return false;
+        return true;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+        return usage();
+
+    TraceColumns columns = TraceColumns::Ppu;
+    const char *lineEnd = "\r\n";
+    for (int i = 2; i < argc; i++)
+    {
+        std::string option = argv[i];
+        if (option == "--columns" && i + 1 < argc)
+        {
+            if (!parseColumns(argv[++i], columns))
+                return usage();
+        }
+        else if (option == "--lf")
+            lineEnd = "\n";
+        else
+            return usage();
+    }
+
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in)
+    {
+        std::cerr << "Failed to open trace file: " << argv[1] << std::endl;
+        return 1;
+    }
+    return formatTrace(in, std::cout, columns, lineEnd) ? 0 : 1;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs a batch of independent jobs on a fixed number of threads. The jobs are dealt out up front in
+// contiguous shards, one queue per worker; a worker takes from the front of its own queue and, once
+// that runs dry, steals from the back of the others'. Jobs that take very different times (a ROM that
+// halts at once next to one that runs every frame) then still keep every core busy.
+class WorkStealingPool
+{
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<std::size_t> jobs;
+    };
+
+    unsigned _workers;
+    std::size_t _stolen = 0;
+
+    static bool take(Queue &queue, bool fromBack, std::size_t &job)
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.jobs.empty())
+            return false;
+        if (fromBack)
+        {
+            job = queue.jobs.back();
+            queue.jobs.pop_back();
+        }
+        else
+        {
+            job = queue.jobs.front();
+            queue.jobs.pop_front();
+        }
+        return true;
+    }
+
+public:
+    explicit WorkStealingPool(unsigned workers) : _workers(workers ? workers : 1)
+    {
+    }
+
+    // Calls job(index, worker) once for every index below count and returns when all have finished.
+    // No job is added while the batch runs, so a worker that finds every queue empty is done.
+    void run(std::size_t count, const std::function<void(std::size_t, unsigned)> &job)
+    {
+        std::unique_ptr<Queue[]> queues(new Queue[_workers]);
+        for (unsigned worker = 0; worker < _workers; worker++)
+        {
+            for (std::size_t index = count * worker / _workers; index < count * (worker + 1) / _workers; index++)
+                queues[worker].jobs.push_back(index);
+        }
+
+        std::vector<std::size_t> stolen(_workers, 0);
+        std::vector<std::thread> threads;
+        for (unsigned worker = 0; worker < _workers; worker++)
+        {
+            threads.emplace_back([&, worker]
+                                 {
+                                     std::size_t index;
+                                     for (;;)
+                                     {
+                                         bool found = take(queues[worker], false, index);
+                                         for (unsigned other = 1; !found && other < _workers; other++)
+                                         {
+                                             found = take(queues[(worker + other) % _workers], true, index);
+                                             stolen[worker] += found;
+                                         }
+                                         if (!found)
+                                             return;
+                                         job(index, worker);
+                                     } });
+        }
+        for (std::thread &thread : threads)
+            thread.join();
+
+        _stolen = 0;
+        for (std::size_t jobs : stolen)
+            _stolen += jobs;
+    }
+
+    unsigned workers() const { return _workers; }
+
+    // Jobs the last batch ran on another worker than the one they were dealt to
+    std::size_t stolen() const { return _stolen; }
+};
@@ -1,12 +1,20 @@
 #include "vve_window.hpp"
 
+#include <stdexcept>
+
 void vve::VveWindow::_initWindow()
 {
-    glfwInit();
+    if (!glfwInit())
+        throw std::runtime_error("Failed to initialize GLFW");
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
     glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
 
     _window = glfwCreateWindow(_width, _height, _windowName.c_str(), nullptr, nullptr);
+    if (!_window)
+    {
+        glfwTerminate();
+        throw std::runtime_error("Failed to create window");
+    }
 }
 
 vve::VveWindow::VveWindow(int width, int height, const std::string &windowName) : _width(width), _height(height), _windowName(windowName)
@@ -24,3 +32,18 @@ bool vve::VveWindow::shouldClose()
 {
     return glfwWindowShouldClose(_window);
 }
+
+void vve::VveWindow::pollEvents()
+{
+    glfwPollEvents();
+}
+
+void vve::VveWindow::waitEvents(double timeoutSeconds)
+{
+    glfwWaitEventsTimeout(timeoutSeconds);
+}
+
+bool vve::VveWindow::keyDown(int key) const
+{
+    return glfwGetKey(_window, key) == GLFW_PRESS;
+}
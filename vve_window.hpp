@@ -23,6 +23,10 @@ namespace vve
         ~VveWindow();
 
         bool shouldClose();
+        void pollEvents();
+        // Like pollEvents, but first sleeps until an event arrives or the timeout has passed
+        void waitEvents(double timeoutSeconds);
+        bool keyDown(int key) const;
     };
 
 } // namespace vve
\ No newline at end of file